@@ -3,6 +3,12 @@
 
 #define __STDC_WANT_IEC_60559_TYPES_EXT__
 
+// pinning threads and reserving huge pages are gnu extensions on linux, and glibc only
+// declares the mkstemps the cpu backend writes its sources with under them too
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+    #define _GNU_SOURCE
+#endif
+
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -12,6 +18,23 @@
 #include <math.h>
 #include <string.h>
 #include <stdalign.h>
+#include <stdarg.h>
+#include <time.h>
+
+// thread pools, the compile pool, mapped arenas and data pipelines are built on posix
+#if defined(__unix__) || defined(__APPLE__)
+    #include <pthread.h>
+    #include <unistd.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <fcntl.h>
+#else
+    #error "ccml needs a posix platform for its threads and mapped memory"
+#endif
+
+#if defined(__linux__)
+    #include <sched.h>
+#endif
 
 #if defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 199409L) && !defined(CCML_API)
     #define CCML_API static inline
@@ -20,28 +43,290 @@
 #endif
 
 #define CCML_ASSERT(x, ...) do { if (!(x)) {                                               \
-    fprintf(stderr, "CCML_ASSERT: %s:%d: %s ", __FILE__, __LINE__, #x);                    \
-    __VA_OPT__(fprintf(stderr, __VA_ARGS__);)                                              \
-    exit(EXIT_FAILURE);                                                                    \
+    ccml_assert_fail(__FILE__, __LINE__, #x, "" __VA_ARGS__);                              \
 } } while (0)
 
-#define CCML_SRCS_MAX 2
+#define CCML_SRCS_MAX 4
 #define CCML_TYPE_MAX 3
-#define CCML_DIMS_MAX 4
-#define CCML_KERN_MAX 16
-#define CCML_CHAR_MAX 80
+#if !defined(CCML_DIMS_MAX)
+    #define CCML_DIMS_MAX 4
+#endif
+
+#if CCML_DIMS_MAX < 4 || CCML_DIMS_MAX > 8
+    #error "CCML_DIMS_MAX has to be between 4 and 8"
+#endif
+
+#define CCML_KERN_MAX 32
+#define CCML_DEVICE_MAX 8
+#define CCML_THREAD_MAX 64
 #define CCML_NODE_MAX 128
+#define CCML_OUTPUT_MAX 8
+#define CCML_FIELD_MAX 4
+#define CCML_PREFETCH_MAX 8
 
 // KNOWN ISSUES
 // - including ccml.h in separate compilation units compiles separate/independent symbols
 // - a lot of function return statuses aren't checked, mostly snprintf/fread/fwrite
-// - openCL backend has no error checking at the moment
-// - metal backend has incomplete error checkingat the moment
+// - misusing the api is still fatal, running out of arena memory and backend failures are recoverable
+// - gpu sums and max reductions accumulate without atomics, threads updating the same element race
+// - the metal backend copies every buffer to the device and back on each execution
+// - only the cpu interprets kernels still compiling, async gpu graphs and fused kernels are not ready until built
+// - fused ops (attention, softmax) run a scalar thread per row
 
 // TO DO
 // - support for dynamic node count
 // - more backends
 
+//
+//  ██╗      ██████╗  ██████╗  ██████╗ ██╗███╗   ██╗ ██████╗
+//  ██║     ██╔═══██╗██╔════╝ ██╔════╝ ██║████╗  ██║██╔════╝
+//  ██║     ██║   ██║██║  ███╗██║  ███╗██║██╔██╗ ██║██║  ███╗
+//  ██║     ██║   ██║██║   ██║██║   ██║██║██║╚██╗██║██║   ██║
+//  ███████╗╚██████╔╝╚██████╔╝╚██████╔╝██║██║ ╚████║╚██████╔╝
+//  ╚══════╝ ╚═════╝  ╚═════╝  ╚═════╝ ╚═╝╚═╝  ╚═══╝ ╚═════╝
+//
+
+#if !defined(CCML_LOG_LEVEL)
+    #define CCML_LOG_LEVEL CCML_LOG_WARN
+#endif
+
+// messages handed to a hook are cut off at this length, stderr gets them whole
+#if !defined(CCML_LOG_LENGTH)
+    #define CCML_LOG_LENGTH 512
+#endif
+
+typedef enum ccml_status {
+    CCML_STATUS_OK,
+    CCML_STATUS_NO_DEVICE,
+    CCML_STATUS_IO_FAILED,
+    CCML_STATUS_COMPILE_FAILED,
+    CCML_STATUS_BACKEND_FAILED,
+    CCML_STATUS_UNSUPPORTED,
+    CCML_STATUS_OUT_OF_MEMORY,
+    CCML_STATUS_NOT_READY
+} ccml_status;
+
+typedef enum ccml_log_level {
+    CCML_LOG_DEBUG,
+    CCML_LOG_INFO,
+    CCML_LOG_WARN,
+    CCML_LOG_ERROR,
+    CCML_LOG_NONE
+} ccml_log_level;
+
+typedef void (*ccml_log_hook)(ccml_log_level level, const char * message, void * user);
+
+typedef struct ccml_logger {
+    ccml_log_level level;
+    ccml_log_hook hook;
+    void * user;
+} ccml_logger;
+
+static ccml_logger ccml_log_state = {
+    .level = CCML_LOG_LEVEL,
+    .hook  = NULL,
+    .user  = NULL
+};
+
+CCML_API const char * ccml_log_level_string(ccml_log_level level) {
+    switch (level) {
+        case CCML_LOG_DEBUG: return "debug";
+        case CCML_LOG_INFO: return "info";
+        case CCML_LOG_WARN: return "warn";
+        case CCML_LOG_ERROR: return "error";
+        default: return "none";
+    }
+}
+
+CCML_API const char * ccml_status_string(ccml_status status) {
+    switch (status) {
+        case CCML_STATUS_OK: return "ok";
+        case CCML_STATUS_NO_DEVICE: return "no device";
+        case CCML_STATUS_IO_FAILED: return "io failed";
+        case CCML_STATUS_COMPILE_FAILED: return "compile failed";
+        case CCML_STATUS_BACKEND_FAILED: return "backend failed";
+        case CCML_STATUS_UNSUPPORTED: return "unsupported";
+        case CCML_STATUS_OUT_OF_MEMORY: return "out of memory";
+        case CCML_STATUS_NOT_READY: return "not ready";
+        default: return "unknown";
+    }
+}
+
+CCML_API void ccml_set_log(ccml_log_level level, ccml_log_hook hook, void * user) {
+    ccml_log_state = (ccml_logger) {
+        .level = level,
+        .hook  = hook,
+        .user  = user
+    };
+}
+
+CCML_API bool ccml_log_enabled(ccml_log_level level) {
+    return level >= ccml_log_state.level && level != CCML_LOG_NONE;
+}
+
+CCML_API void ccml_message(ccml_log_level level, const char * format, ...) {
+    // filtered out messages are never formatted, so quiet runs do no stdio at all
+    if (!ccml_log_enabled(level)) return;
+
+    // long messages like kernel sources go to stderr as they're formatted, the lock keeps
+    // the lines of other threads out of them
+    va_list args;
+    va_start(args, format);
+    if (ccml_log_state.hook != NULL) {
+        char message[CCML_LOG_LENGTH];
+        vsnprintf(message, sizeof(message), format, args);
+        ccml_log_state.hook(level, message, ccml_log_state.user);
+    } else {
+        flockfile(stderr);
+        fprintf(stderr, "ccml %s: ", ccml_log_level_string(level));
+        vfprintf(stderr, format, args);
+        fputc('\n', stderr);
+        funlockfile(stderr);
+    }
+    va_end(args);
+}
+
+CCML_API _Noreturn void ccml_assert_fail(const char * file, int line, const char * condition, const char * format, ...) {
+    char details[CCML_LOG_LENGTH];
+
+    va_list args;
+    va_start(args, format);
+    vsnprintf(details, sizeof(details), format, args);
+    va_end(args);
+
+    ccml_message(CCML_LOG_ERROR, "CCML_ASSERT: %s:%d: %s %s", file, line, condition, details);
+    exit(EXIT_FAILURE);
+}
+
+//
+//  ████████╗██╗  ██╗██████╗ ███████╗ █████╗ ██████╗ ███████╗
+//  ╚══██╔══╝██║  ██║██╔══██╗██╔════╝██╔══██╗██╔══██╗██╔════╝
+//     ██║   ███████║██████╔╝█████╗  ███████║██║  ██║███████╗
+//     ██║   ██╔══██║██╔══██╗██╔══╝  ██╔══██║██║  ██║╚════██║
+//     ██║   ██║  ██║██║  ██║███████╗██║  ██║██████╔╝███████║
+//     ╚═╝   ╚═╝  ╚═╝╚═╝  ╚═╝╚══════╝╚═╝  ╚═╝╚═════╝ ╚══════╝
+//
+
+typedef void (*ccml_task)(void * arg, int worker, int n_workers);
+
+typedef struct ccml_worker {
+    struct ccml_pool * pool;
+    int index;
+} ccml_worker;
+
+typedef struct ccml_pool {
+    int n_workers;
+    bool pin_threads;
+    pthread_t threads[CCML_THREAD_MAX];
+    ccml_worker workers[CCML_THREAD_MAX];
+    pthread_mutex_t mutex;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    int generation;
+    int n_done;
+    bool stop;
+    ccml_task task;
+    void * arg;
+} ccml_pool;
+
+CCML_API void ccml_pin_thread(int worker, int n_workers) {
+#if defined(__linux__)
+    // workers are spread evenly over the cpus rather than packed onto the first ones,
+    // with cpus numbered socket by socket this gives each socket its share of workers
+    int n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET((int)((long)worker * n_cpus / n_workers) % n_cpus, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    (void)worker;
+    (void)n_workers;
+#endif
+}
+
+CCML_API void * ccml_pool_worker(void * arg) {
+    ccml_worker worker = *(ccml_worker *)arg;
+    ccml_pool * pool = worker.pool;
+    int generation = 0;
+
+    if (pool->pin_threads) ccml_pin_thread(worker.index, pool->n_workers);
+
+    pthread_mutex_lock(&pool->mutex);
+    while (true) {
+        while (!pool->stop && pool->generation == generation) {
+            pthread_cond_wait(&pool->start, &pool->mutex);
+        }
+        if (pool->stop) break;
+        generation = pool->generation;
+
+        pthread_mutex_unlock(&pool->mutex);
+        pool->task(pool->arg, worker.index, pool->n_workers);
+        pthread_mutex_lock(&pool->mutex);
+
+        if (++pool->n_done == pool->n_workers) pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    return NULL;
+}
+
+CCML_API void ccml_pool_start(ccml_pool * pool, ccml_task task, void * arg) {
+    // every worker runs the task once, the caller carries on without waiting for them
+    pthread_mutex_lock(&pool->mutex);
+    pool->task = task;
+    pool->arg = arg;
+    pool->n_done = 0;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+CCML_API void ccml_pool_wait(ccml_pool * pool) {
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->n_done != pool->n_workers) {
+        pthread_cond_wait(&pool->done, &pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+CCML_API void ccml_pool_run(ccml_pool * pool, ccml_task task, void * arg) {
+    ccml_pool_start(pool, task, arg);
+    ccml_pool_wait(pool);
+}
+
+CCML_API void ccml_pool_init(ccml_pool * pool, int n_workers, bool pin_threads) {
+    CCML_ASSERT(n_workers > 0 && n_workers <= CCML_THREAD_MAX);
+
+    *pool = (ccml_pool) {
+        .n_workers   = n_workers,
+        .pin_threads = pin_threads
+    };
+
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    for (int i = 0; i < n_workers; i++) {
+        pool->workers[i] = (ccml_worker) {.pool = pool, .index = i};
+        pthread_create(&pool->threads[i], NULL, ccml_pool_worker, &pool->workers[i]);
+    }
+}
+
+CCML_API void ccml_pool_free(ccml_pool * pool) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (int i = 0; i < pool->n_workers; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+}
+
 //
 //   ██████╗ ██████╗ ███╗   ██╗████████╗███████╗██╗  ██╗████████╗
 //  ██╔════╝██╔═══██╗████╗  ██║╚══██╔══╝██╔════╝╚██╗██╔╝╚══██╔══╝
@@ -51,42 +336,238 @@
 //   ╚═════╝ ╚═════╝ ╚═╝  ╚═══╝   ╚═╝   ╚══════╝╚═╝  ╚═╝   ╚═╝
 //
 
+#define CCML_CACHE_LINE 64
+#define CCML_HUGE_PAGE (2 << 20)
+
+typedef struct ccml_context_options {
+    int alignment;      // alignment of tensor data, defaults to a cache line
+    bool huge_pages;    // back the arena with huge pages to cut down on tlb misses
+    bool first_touch;   // let the workers fault graph buffers in by the rows they compute, see ccml_graph_allocate
+    int n_threads;      // workers of the cpu backend, none when zero
+    bool pin_threads;   // pin every worker to its own cpu
+} ccml_context_options;
+
 typedef struct ccml_context {
     int capacity;
     int used;
+    int alignment;
+    bool mapped;
     void * memory;
+    ccml_pool * pool;
+    bool first_touch;
+    ccml_status status;
 } ccml_context;
 
-CCML_API ccml_context * ccml_new_context(int capacity) {
+CCML_API void * ccml_new_memory(int * capacity, ccml_context_options * options, bool * mapped) {
+    *mapped = options->huge_pages || options->first_touch;
+    if (!*mapped) {
+        void * memory = NULL;
+        int ret = posix_memalign(&memory, CCML_CACHE_LINE, *capacity);
+        CCML_ASSERT(ret == 0, "failed to allocate %d bytes", *capacity);
+        return memory;
+    }
+
+    // mapped memory is left untouched until first use, which is what places its pages
+    void * memory = MAP_FAILED;
+#if defined(MAP_HUGETLB)
+    if (options->huge_pages) {
+        *capacity = (*capacity + CCML_HUGE_PAGE - 1) / CCML_HUGE_PAGE * CCML_HUGE_PAGE;
+        memory = mmap(NULL, *capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+#endif
+
+    // without reserved huge pages transparent ones are requested instead
+    if (memory == MAP_FAILED) {
+        memory = mmap(NULL, *capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        CCML_ASSERT(memory != MAP_FAILED, "failed to map %d bytes", *capacity);
+    #if defined(MADV_HUGEPAGE)
+        if (options->huge_pages) madvise(memory, *capacity, MADV_HUGEPAGE);
+    #endif
+    }
+
+    return memory;
+}
+
+CCML_API ccml_context * ccml_new_context_options(int capacity, ccml_context_options options) {
     CCML_ASSERT(capacity > 0);
-    void * memory = malloc(capacity);
+    CCML_ASSERT(options.alignment >= 0 && (options.alignment & (options.alignment - 1)) == 0);
+    CCML_ASSERT(options.n_threads >= 0 && options.n_threads <= CCML_THREAD_MAX);
+
+    bool mapped = false;
+    void * memory = ccml_new_memory(&capacity, &options, &mapped);
     int max_align = alignof(max_align_t);
     ccml_context * ctx = memory;
 
     *ctx = (ccml_context) {
-        .capacity = capacity,
-        .used     = (sizeof(ccml_context) / max_align + 1) * max_align,
-        .memory   = memory
+        .capacity  = capacity,
+        .used      = (sizeof(ccml_context) / max_align + 1) * max_align,
+        .alignment = options.alignment != 0 ? options.alignment : CCML_CACHE_LINE,
+        .mapped    = mapped,
+        .memory    = memory,
+        .pool        = NULL,
+        .first_touch = options.first_touch,
+        .status      = CCML_STATUS_OK
     };
 
+    if (options.n_threads > 0) {
+        ctx->pool = memory + ctx->used;
+        ctx->used += (sizeof(ccml_pool) / max_align + 1) * max_align;
+        CCML_ASSERT(ctx->used < ctx->capacity);
+        ccml_pool_init(ctx->pool, options.n_threads, options.pin_threads);
+    }
+
+    // pages end up on the node of the thread touching them first. workers fault in the rows
+    // of graph buffers they compute as the graphs are built, without any the caller touches it all
+    if (options.first_touch && ctx->pool == NULL) memset(ctx->memory + ctx->used, 0, ctx->capacity - ctx->used);
+
     return ctx;
 }
 
-CCML_API void * ccml_malloc(ccml_context * ctx, int size) {
+CCML_API ccml_context * ccml_new_context(int capacity) {
+    return ccml_new_context_options(capacity, (ccml_context_options) {0});
+}
+
+CCML_API int ccml_align(int size) {
     int max_align = alignof(max_align_t);
-    int size_aligned = (size / max_align + 1) * max_align;
+    return (size / max_align + 1) * max_align;
+}
+
+CCML_API bool ccml_context_reserve(ccml_context * ctx, int size) {
+    // once the arena runs out every allocation after it fails too, so whatever was being built
+    // fails as a whole. the status stays on the context, constructors return NULL from then on
+    if (ctx->status == CCML_STATUS_OK && ctx->used + size < ctx->capacity) return true;
+
+    if (ctx->status == CCML_STATUS_OK) {
+        ccml_message(CCML_LOG_ERROR, "out of memory, needed %d bytes, available %d bytes", ctx->used + size, ctx->capacity);
+    }
+    ctx->status = CCML_STATUS_OUT_OF_MEMORY;
+
+    return false;
+}
+
+CCML_API bool ccml_context_failed(ccml_context * ctx) {
+    return ctx->status != CCML_STATUS_OK;
+}
 
-    CCML_ASSERT(ctx->used + size_aligned < ctx->capacity,
-                "needed %d bytes, available %d bytes",
-                ctx->used + size_aligned, ctx->capacity);
+CCML_API ccml_status ccml_context_rollback(ccml_context * ctx, int used) {
+    // scratch allocations are dropped along with any failure they ran into
+    ccml_status status = ctx->status;
+    ctx->used = used;
+    ctx->status = CCML_STATUS_OK;
+
+    return status;
+}
+
+CCML_API void * ccml_malloc(ccml_context * ctx, int size) {
+    int size_aligned = ccml_align(size);
+    if (!ccml_context_reserve(ctx, size_aligned)) return NULL;
 
     void * ptr = ctx->memory + ctx->used;
     ctx->used += size_aligned;
     return ptr;
 }
 
+CCML_API void * ccml_malloc_aligned(ccml_context * ctx, int size, int alignment) {
+    int padding = (alignment - (uintptr_t)(ctx->memory + ctx->used) % alignment) % alignment;
+    if (!ccml_context_reserve(ctx, padding + ccml_align(size))) return NULL;
+
+    ctx->used += padding;
+    return ccml_malloc(ctx, size);
+}
+
 CCML_API void ccml_context_free(ccml_context * ctx) {
-    free(ctx->memory);
+    if (ctx->pool != NULL) ccml_pool_free(ctx->pool);
+
+    if (ctx->mapped) {
+        munmap(ctx->memory, ctx->capacity);
+    } else {
+        free(ctx->memory);
+    }
+}
+
+//
+//  ███████╗████████╗██████╗ ██╗███╗   ██╗ ██████╗
+//  ██╔════╝╚══██╔══╝██╔══██╗██║████╗  ██║██╔════╝
+//  ███████╗   ██║   ██████╔╝██║██╔██╗ ██║██║  ███╗
+//  ╚════██║   ██║   ██╔══██╗██║██║╚██╗██║██║   ██║
+//  ███████║   ██║   ██║  ██║██║██║ ╚████║╚██████╔╝
+//  ╚══════╝   ╚═╝   ╚═╝  ╚═╝╚═╝╚═╝  ╚═══╝ ╚═════╝
+//
+
+typedef struct ccml_string {
+    int length;
+    int capacity;
+    char * data;
+    ccml_context * context;
+} ccml_string;
+
+CCML_API ccml_string * ccml_new_string(ccml_context * ctx, int capacity) {
+    CCML_ASSERT(capacity > 0);
+    ccml_string * string = ccml_malloc(ctx, sizeof(ccml_string));
+    char * data = ccml_malloc(ctx, capacity);
+    if (data == NULL) return NULL;
+
+    *string = (ccml_string) {
+        .length   = 0,
+        .capacity = capacity,
+        .data     = data,
+        .context  = ctx
+    };
+
+    string->data[0] = '\0';
+
+    return string;
+}
+
+CCML_API bool ccml_string_reserve(ccml_string * string, int size) {
+    if (string->length + size < string->capacity) return true;
+
+    ccml_context * ctx = string->context;
+    int capacity = string->capacity;
+    while (string->length + size >= capacity) capacity *= 2;
+
+    // if the buffer is the most recent arena allocation it's grown in place,
+    // otherwise it's copied over, doubling keeps the wasted space below the final size
+    if ((char *)ctx->memory + ctx->used == string->data + ccml_align(string->capacity)) {
+        int growth = ccml_align(capacity) - ccml_align(string->capacity);
+        if (!ccml_context_reserve(ctx, growth)) return false;
+        ctx->used += growth;
+    } else {
+        char * data = ccml_malloc(ctx, capacity);
+        if (data == NULL) return false;
+        memcpy(data, string->data, string->length + 1);
+        string->data = data;
+    }
+
+    string->capacity = capacity;
+    return true;
+}
+
+CCML_API void ccml_string_append(ccml_string * string, const char * format, ...) {
+    // strings stop growing once their context is out of memory, the caller checks it at the end
+    if (string == NULL || ccml_context_failed(string->context)) return;
+
+    va_list args, args_copy;
+    va_start(args, format);
+    va_copy(args_copy, args);
+
+    int available = string->capacity - string->length;
+    int length = vsnprintf(string->data + string->length, available, format, args);
+    CCML_ASSERT(length >= 0, "invalid format string");
+
+    if (length >= available) {
+        if (!ccml_string_reserve(string, length + 1)) {
+            va_end(args_copy);
+            va_end(args);
+            return;
+        }
+        vsnprintf(string->data + string->length, string->capacity - string->length, format, args_copy);
+    }
+
+    string->length += length;
+
+    va_end(args_copy);
+    va_end(args);
 }
 
 //
@@ -98,8 +579,11 @@ CCML_API void ccml_context_free(ccml_context * ctx) {
 //     ╚═╝   ╚══════╝╚═╝  ╚═══╝╚══════╝ ╚═════╝ ╚═╝  ╚═╝
 //
 
+// int32 tensors hold indices, they share the 4 byte storage of float tensors and are
+// written through (int32_t *)tensor->data. they only feed gathers and scatter-adds
 typedef enum ccml_type {
-    CCML_TYPE_FP32 = -1
+    CCML_TYPE_FP32  = -1,
+    CCML_TYPE_INT32 = -4
 } ccml_type;
 
 typedef enum ccml_grad {
@@ -112,7 +596,7 @@ CCML_API bool ccml_is_grad(int value) {
 }
 
 CCML_API bool ccml_is_type(int value) {
-    return value >= CCML_TYPE_FP32 && value <= CCML_TYPE_FP32;
+    return value == CCML_TYPE_FP32 || value == CCML_TYPE_INT32;
 }
 
 typedef enum ccml_oper {
@@ -123,12 +607,33 @@ typedef enum ccml_oper {
     CCML_OPER_SQT,
     CCML_OPER_ADD,
     CCML_OPER_MUL,
+    CCML_OPER_NEG,
+    CCML_OPER_MAX,
+    CCML_OPER_POW,
+    CCML_OPER_CMPLT,
+    CCML_OPER_WHERE,
+    CCML_OPER_FMA,
+    CCML_OPER_UNIFORM,
+    CCML_OPER_NORMAL,
+    CCML_OPER_GATHER,
     CCML_OPER_SUM,
+    CCML_OPER_RMAX,
+    CCML_OPER_SCATTER_ADD,
     CCML_OPER_RES,
     CCML_OPER_PER,
+    CCML_OPER_VIEW,
+    CCML_OPER_STORE,
     CCML_OPER_LOAD,
     CCML_OPER_INTR,
     CCML_OPER_SAVE,
+    CCML_OPER_ATTN,
+    CCML_OPER_ATTN_LSE,
+    CCML_OPER_ATTN_DQ,
+    CCML_OPER_ATTN_DK,
+    CCML_OPER_ATTN_DV,
+    CCML_OPER_SOFTMAX,
+    CCML_OPER_LOG_SOFTMAX,
+    CCML_OPER_SOFTMAX_XENT,
 } ccml_oper;
 
 typedef struct ccml_tensor {
@@ -137,53 +642,65 @@ typedef struct ccml_tensor {
 
     int shape[CCML_DIMS_MAX];
     int stride[CCML_DIMS_MAX];
+    int offset;
+    int axis;
 
     bool has_gradient;
     int index;
+    int version;
     float * data;
 
     struct ccml_tensor * grad;
     struct ccml_tensor * src[CCML_SRCS_MAX];
 } ccml_tensor;
 
+CCML_API void ccml_new_stride(int * shape, int * stride) {
+    stride[CCML_DIMS_MAX - 1] = 1;
+    for (int i = CCML_DIMS_MAX - 2; i >= 0; i--) {
+        stride[i] = stride[i + 1] * shape[i + 1];
+    }
+}
+
 CCML_API ccml_tensor * ccml_new_tensor_impl(ccml_context * ctx, ccml_type type,
                                             ccml_oper oper, int * shape) {
     ccml_tensor * result = ccml_malloc(ctx, sizeof(ccml_tensor));
-    int stride[CCML_DIMS_MAX] = {
-        shape[1] * shape[2] * shape[3], shape[2] * shape[3], shape[3], 1
-    };
+    if (result == NULL) return NULL;
 
     *result = (ccml_tensor) {
         .type   = type,
         .oper   = oper,
-        .shape  = {shape[0], shape[1], shape[2], shape[3]},
-        .stride = {stride[0], stride[1], stride[2], stride[3]},
         .index  = -1
     };
 
+    // shapes always have CCML_DIMS_MAX entries, trailing zeros are unit dims
+    for (int i = 0; i < CCML_DIMS_MAX; i++) {
+        result->shape[i] = shape[i] > 0 ? shape[i] : 1;
+    }
+    ccml_new_stride(result->shape, result->stride);
+
     return result;
 }
 
 #define ccml_new_tensor(ctx, ne0, ...) ({                                                  \
     int input[CCML_DIMS_MAX + 2] = {ne0, __VA_ARGS__};                                     \
-    int shape[CCML_DIMS_MAX] = {ne0, 1, 1, 1};                                             \
+    int shape[CCML_DIMS_MAX] = {ne0};                                                      \
     ccml_type type = CCML_TYPE_FP32;                                                       \
     int has_gradient = false;                                                              \
     int dim_counter = 0;                                                                   \
                                                                                            \
-    for (int i = 0; i < CCML_DIMS_MAX; i++) {                                              \
-        if (input[i] > 0) shape[dim_counter++] = input[i];                                 \
+    for (int i = 0; i < CCML_DIMS_MAX + 2; i++) {                                          \
+        if (input[i] > 0) {                                                                \
+            CCML_ASSERT(dim_counter < CCML_DIMS_MAX, "too many dimensions");               \
+            shape[dim_counter++] = input[i];                                               \
+        }                                                                                  \
         if (ccml_is_type(input[i])) type = input[i];                                       \
         if (ccml_is_grad(input[i])) has_gradient = input[i];                               \
     }                                                                                      \
                                                                                            \
-    CCML_ASSERT(dim_counter < CCML_DIMS_MAX);                                              \
-                                                                                           \
     ccml_tensor * tensor = ccml_new_tensor_impl(ctx, type, CCML_OPER_LOAD, shape);         \
-    if (has_gradient == -2) tensor->has_gradient = false;                                  \
-    if (has_gradient == -3) tensor->has_gradient = true;                                   \
-    if (type         == -1) tensor->type         = CCML_TYPE_FP32;                         \
-    tensor->oper == CCML_OPER_LOAD;                                                        \
+    if (tensor != NULL && has_gradient == -2) tensor->has_gradient = false;                \
+    if (tensor != NULL && has_gradient == -3) tensor->has_gradient = true;                 \
+    if (tensor != NULL && type == -1) tensor->type = CCML_TYPE_FP32;                       \
                                                                                            \
     tensor;                                                                                \
 })
@@ -207,18 +724,33 @@ CCML_API bool ccml_has_buffer(ccml_tensor * tensor) {
 }
 
 CCML_API void ccml_fill(ccml_context * ctx, ccml_tensor * tensor, float value) {
+    if (ccml_context_failed(ctx)) return;
     CCML_ASSERT(ccml_has_buffer(tensor) && tensor->data == NULL);
 
     int size = ccml_size(tensor);
+    float * data = ccml_malloc_aligned(ctx, size * sizeof(float), ctx->alignment);
+    if (data == NULL) return;
+
     tensor->oper = CCML_OPER_LOAD;
-    tensor->data = ccml_malloc(ctx, size * sizeof(float));
+    tensor->data = data;
+    tensor->version++;
     for (int i = 0; i < size; i++) {
-        tensor->data[i] = value;
+        if (tensor->type == CCML_TYPE_INT32) {
+            ((int32_t *)tensor->data)[i] = (int32_t)value;
+        } else {
+            tensor->data[i] = value;
+        }
     }
 }
 
+// marks a tensor as changed. loads written to directly are also caught by the hash every
+// execution takes of them, see ccml_graph_check_loads
+CCML_API void ccml_invalidate(ccml_tensor * tensor) {
+    tensor->version++;
+}
+
 CCML_API ccml_tensor * ccml_scalar(ccml_context * ctx, float value) {
-    ccml_tensor * scalar = ccml_new_tensor_impl(ctx, CCML_TYPE_FP32, CCML_OPER_INTR, (int []){1, 1, 1, 1});
+    ccml_tensor * scalar = ccml_new_tensor_impl(ctx, CCML_TYPE_FP32, CCML_OPER_INTR, (int [CCML_DIMS_MAX]){1});
     ccml_fill(ctx, scalar, value);
 
     return scalar;
@@ -249,8 +781,40 @@ CCML_API bool ccml_can_broadcast(ccml_tensor * lhs, ccml_tensor * rhs) {
     return true;
 }
 
+CCML_API bool ccml_is_fused(ccml_oper oper) {
+    switch (oper) {
+        case CCML_OPER_ATTN:
+        case CCML_OPER_ATTN_LSE:
+        case CCML_OPER_ATTN_DQ:
+        case CCML_OPER_ATTN_DK:
+        case CCML_OPER_ATTN_DV:
+        case CCML_OPER_SOFTMAX:
+        case CCML_OPER_LOG_SOFTMAX:
+        case CCML_OPER_SOFTMAX_XENT: return true;
+        default: return false;
+    }
+}
+
+CCML_API bool ccml_is_reduce(ccml_oper oper) {
+    return oper == CCML_OPER_SUM || oper == CCML_OPER_RMAX || oper == CCML_OPER_SCATTER_ADD;
+}
+
+CCML_API bool ccml_is_random(ccml_oper oper) {
+    return oper == CCML_OPER_UNIFORM || oper == CCML_OPER_NORMAL;
+}
+
+CCML_API bool ccml_reads_buffer(ccml_oper oper) {
+    // these read memory instead of computing anything from their sources
+    return oper == CCML_OPER_LOAD || oper == CCML_OPER_INTR || oper == CCML_OPER_RES ||
+           oper == CCML_OPER_PER || oper == CCML_OPER_VIEW;
+}
+
 CCML_API bool ccml_is_leaf(ccml_tensor * tensor) {
-    return tensor->src[0] == NULL && tensor->src[1] == NULL;
+    for (int i = 0; i < CCML_SRCS_MAX; i++) {
+        if (tensor->src[i] != NULL) return false;
+    }
+
+    return true;
 }
 
 CCML_API int ccml_dim(ccml_tensor * tensor) {
@@ -263,7 +827,7 @@ CCML_API int ccml_dim(ccml_tensor * tensor) {
 }
 
 CCML_API bool ccml_is_matrix(ccml_tensor * tensor) {
-    return tensor->shape[0] != 1 && tensor->shape[1] != 1 && tensor->shape[2] == 1 && tensor->shape[3] == 1;
+    return tensor->shape[0] != 1 && tensor->shape[1] != 1 && ccml_dim(tensor) == 2;
 }
 
 //
@@ -283,7 +847,10 @@ CCML_API bool ccml_is_matrix(ccml_tensor * tensor) {
 //
 
 CCML_API ccml_tensor * ccml_log(ccml_context * ctx, ccml_tensor * tensor) {
+    if (ccml_context_failed(ctx)) return NULL;
     ccml_tensor * result = ccml_new_tensor_impl(ctx, tensor->type, CCML_OPER_LOG, tensor->shape);
+    if (result == NULL) return NULL;
+
     result->src[0]       = tensor;
     result->has_gradient = tensor->has_gradient;
 
@@ -291,7 +858,10 @@ CCML_API ccml_tensor * ccml_log(ccml_context * ctx, ccml_tensor * tensor) {
 }
 
 CCML_API ccml_tensor * ccml_exp(ccml_context * ctx, ccml_tensor * tensor) {
+    if (ccml_context_failed(ctx)) return NULL;
     ccml_tensor * result = ccml_new_tensor_impl(ctx, tensor->type, CCML_OPER_EXP, tensor->shape);
+    if (result == NULL) return NULL;
+
     result->src[0]       = tensor;
     result->has_gradient = tensor->has_gradient;
 
@@ -299,7 +869,10 @@ CCML_API ccml_tensor * ccml_exp(ccml_context * ctx, ccml_tensor * tensor) {
 }
 
 CCML_API ccml_tensor * ccml_sin(ccml_context * ctx, ccml_tensor * tensor) {
+    if (ccml_context_failed(ctx)) return NULL;
     ccml_tensor * result = ccml_new_tensor_impl(ctx, tensor->type, CCML_OPER_SIN, tensor->shape);
+    if (result == NULL) return NULL;
+
     result->src[0]       = tensor;
     result->has_gradient = tensor->has_gradient;
 
@@ -307,7 +880,10 @@ CCML_API ccml_tensor * ccml_sin(ccml_context * ctx, ccml_tensor * tensor) {
 }
 
 CCML_API ccml_tensor * ccml_rec(ccml_context * ctx, ccml_tensor * tensor) {
+    if (ccml_context_failed(ctx)) return NULL;
     ccml_tensor * result = ccml_new_tensor_impl(ctx, tensor->type, CCML_OPER_REC, tensor->shape);
+    if (result == NULL) return NULL;
+
     result->src[0]       = tensor;
     result->has_gradient = tensor->has_gradient;
 
@@ -315,7 +891,10 @@ CCML_API ccml_tensor * ccml_rec(ccml_context * ctx, ccml_tensor * tensor) {
 }
 
 CCML_API ccml_tensor * ccml_sqrt(ccml_context * ctx, ccml_tensor * tensor) {
+    if (ccml_context_failed(ctx)) return NULL;
     ccml_tensor * result = ccml_new_tensor_impl(ctx, tensor->type, CCML_OPER_SQT, tensor->shape);
+    if (result == NULL) return NULL;
+
     result->src[0]       = tensor;
     result->has_gradient = tensor->has_gradient;
 
@@ -323,6 +902,7 @@ CCML_API ccml_tensor * ccml_sqrt(ccml_context * ctx, ccml_tensor * tensor) {
 }
 
 CCML_API ccml_tensor * ccml_add(ccml_context * ctx, ccml_tensor * lhs, ccml_tensor * rhs) {
+    if (ccml_context_failed(ctx)) return NULL;
     CCML_ASSERT(ccml_can_broadcast(lhs, rhs), "incompatible dimensions for broadcasting");
     bool null_input = lhs == NULL || rhs == NULL;
     int shape[CCML_DIMS_MAX] = {0};
@@ -334,6 +914,8 @@ CCML_API ccml_tensor * ccml_add(ccml_context * ctx, ccml_tensor * lhs, ccml_tens
     }
 
     ccml_tensor * result = ccml_new_tensor_impl(ctx, lhs->type, CCML_OPER_ADD, shape);
+    if (result == NULL) return NULL;
+
     result->src[0]       = lhs;
     result->src[1]       = rhs;
     result->has_gradient = has_gradient;
@@ -342,6 +924,7 @@ CCML_API ccml_tensor * ccml_add(ccml_context * ctx, ccml_tensor * lhs, ccml_tens
 }
 
 CCML_API ccml_tensor * ccml_mul(ccml_context * ctx, ccml_tensor * lhs, ccml_tensor * rhs) {
+    if (ccml_context_failed(ctx)) return NULL;
     CCML_ASSERT(ccml_can_broadcast(lhs, rhs), "incompatible dimensions for broadcasting");
     bool null_input = lhs == NULL || rhs == NULL;
     int shape[CCML_DIMS_MAX] = {0};
@@ -353,6 +936,8 @@ CCML_API ccml_tensor * ccml_mul(ccml_context * ctx, ccml_tensor * lhs, ccml_tens
     }
 
     ccml_tensor * result = ccml_new_tensor_impl(ctx, lhs->type, CCML_OPER_MUL, shape);
+    if (result == NULL) return NULL;
+
     result->src[0]       = lhs;
     result->src[1]       = rhs;
     result->has_gradient = has_gradient;
@@ -360,30 +945,172 @@ CCML_API ccml_tensor * ccml_mul(ccml_context * ctx, ccml_tensor * lhs, ccml_tens
     return result;
 }
 
-CCML_API ccml_tensor * ccml_reshape(ccml_context * ctx, ccml_tensor * tensor, int * shape) {
-    int size = ccml_size(tensor);
-    int new_size = shape[0] * shape[1] * shape[2] * shape[3];
-    CCML_ASSERT(size == new_size, "reshaped and source tensor must have the same size");
+CCML_API ccml_tensor * ccml_new_elementwise(ccml_context * ctx, ccml_oper oper, int n_srcs, ccml_tensor ** srcs) {
+    // the result broadcasts all of its sources against each other
+    if (ccml_context_failed(ctx)) return NULL;
+    int shape[CCML_DIMS_MAX];
+    for (int i = 0; i < CCML_DIMS_MAX; i++) {
+        shape[i] = 1;
+        for (int j = 0; j < n_srcs; j++) {
+            CCML_ASSERT(ccml_can_broadcast(srcs[0], srcs[j]), "incompatible dimensions for broadcasting");
+            if (srcs[j]->shape[i] != 1) shape[i] = srcs[j]->shape[i];
+        }
+    }
 
-    int stride[CCML_DIMS_MAX] = {
-        shape[1] * shape[2] * shape[3], shape[2] * shape[3], shape[3], 1
-    };
+    ccml_tensor * result = ccml_new_tensor_impl(ctx, srcs[0]->type, oper, shape);
+    if (result == NULL) return NULL;
 
-    ccml_tensor * result = ccml_new_tensor_impl(ctx, tensor->type, CCML_OPER_RES, shape);
-    result->src[0]       = tensor;
-    result->has_gradient = tensor->has_gradient;
+    for (int i = 0; i < n_srcs; i++) {
+        result->src[i]        = srcs[i];
+        result->has_gradient |= srcs[i]->has_gradient;
+    }
+
+    return result;
+}
+
+CCML_API ccml_tensor * ccml_neg(ccml_context * ctx, ccml_tensor * tensor) {
+    return ccml_new_elementwise(ctx, CCML_OPER_NEG, 1, &tensor);
+}
+
+CCML_API ccml_tensor * ccml_max(ccml_context * ctx, ccml_tensor * lhs, ccml_tensor * rhs) {
+    return ccml_new_elementwise(ctx, CCML_OPER_MAX, 2, (ccml_tensor *[]){lhs, rhs});
+}
 
+CCML_API ccml_tensor * ccml_pow(ccml_context * ctx, ccml_tensor * base, ccml_tensor * exponent) {
+    return ccml_new_elementwise(ctx, CCML_OPER_POW, 2, (ccml_tensor *[]){base, exponent});
+}
+
+CCML_API ccml_tensor * ccml_cmplt(ccml_context * ctx, ccml_tensor * lhs, ccml_tensor * rhs) {
+    // one where lhs < rhs and zero elsewhere, masks are constant so nothing flows back through them
+    ccml_tensor * result = ccml_new_elementwise(ctx, CCML_OPER_CMPLT, 2, (ccml_tensor *[]){lhs, rhs});
+    if (result == NULL) return NULL;
+
+    result->has_gradient = false;
+
+    return result;
+}
+
+CCML_API ccml_tensor * ccml_where(ccml_context * ctx, ccml_tensor * condition, ccml_tensor * lhs, ccml_tensor * rhs) {
+    // lhs wherever the condition is non-zero and rhs elsewhere
+    ccml_tensor * result = ccml_new_elementwise(ctx, CCML_OPER_WHERE, 3, (ccml_tensor *[]){condition, lhs, rhs});
+    if (result == NULL) return NULL;
+
+    result->has_gradient = lhs->has_gradient || rhs->has_gradient;
+
+    return result;
+}
+
+CCML_API ccml_tensor * ccml_fma(ccml_context * ctx, ccml_tensor * lhs, ccml_tensor * rhs, ccml_tensor * addend) {
+    return ccml_new_elementwise(ctx, CCML_OPER_FMA, 3, (ccml_tensor *[]){lhs, rhs, addend});
+}
+
+CCML_API ccml_tensor * ccml_new_random(ccml_context * ctx, ccml_oper oper, int * shape, ccml_tensor * seed, int stream) {
+    // random values are generated inside the kernels reading them, from the seed, the stream
+    // (kept in axis) and the index of every element, so they take no memory and come out the
+    // same however the kernel is split. the seed is a tensor, so executions can change it
+    if (ccml_context_failed(ctx)) return NULL;
+    CCML_ASSERT(seed->type == CCML_TYPE_INT32 && ccml_size(seed) == 1, "random tensors take an int32 seed");
+    ccml_tensor * result = ccml_new_tensor_impl(ctx, CCML_TYPE_FP32, oper, shape);
+    if (result == NULL) return NULL;
+
+    result->src[0] = seed;
+    result->axis   = stream;
+
+    return result;
+}
+
+CCML_API ccml_tensor * ccml_uniform(ccml_context * ctx, int * shape, ccml_tensor * seed, int stream) {
+    return ccml_new_random(ctx, CCML_OPER_UNIFORM, shape, seed, stream);
+}
+
+CCML_API ccml_tensor * ccml_normal(ccml_context * ctx, int * shape, ccml_tensor * seed, int stream) {
+    return ccml_new_random(ctx, CCML_OPER_NORMAL, shape, seed, stream);
+}
+
+CCML_API ccml_tensor * ccml_new_view(ccml_context * ctx, ccml_tensor * tensor);
+CCML_API ccml_tensor * ccml_sum(ccml_context * ctx, ccml_tensor * tensor, int n_axes, int * axes);
+
+CCML_API bool ccml_is_view(ccml_tensor * tensor) {
+    return tensor->oper == CCML_OPER_RES || tensor->oper == CCML_OPER_PER || tensor->oper == CCML_OPER_VIEW;
+}
+
+CCML_API bool ccml_is_contiguous(ccml_tensor * tensor) {
+    int stride = 1;
+    for (int i = CCML_DIMS_MAX - 1; i >= 0; i--) {
+        if (tensor->shape[i] != 1 && tensor->stride[i] != stride) return false;
+        stride *= tensor->shape[i];
+    }
+
+    return true;
+}
+
+CCML_API ccml_tensor * ccml_reshape(ccml_context * ctx, ccml_tensor * tensor, int * new_shape) {
+    if (ccml_context_failed(ctx)) return NULL;
+    int shape[CCML_DIMS_MAX];
+    int new_size = 1;
     for (int i = 0; i < CCML_DIMS_MAX; i++) {
-        result->shape[i]  = shape[i];
-        result->stride[i] = stride[i];
+        shape[i] = new_shape[i] > 0 ? new_shape[i] : 1;
+        new_size *= shape[i];
     }
+    CCML_ASSERT(ccml_size(tensor) == new_size, "reshaped and source tensor must have the same size");
+
+    int contiguous[CCML_DIMS_MAX];
+    ccml_new_stride(shape, contiguous);
+
+    // reshapes alias the buffer they're taken from, contiguous views are reshaped as views
+    // and anything else is copied into a buffer through an empty sum, which keeps its gradient
+    if (tensor->oper == CCML_OPER_RES) tensor = tensor->src[0];
+    if (ccml_is_view(tensor) && ccml_is_contiguous(tensor)) {
+        ccml_tensor * view = ccml_new_view(ctx, tensor);
+        if (view == NULL) return NULL;
+
+        for (int i = 0; i < CCML_DIMS_MAX; i++) {
+            view->shape[i]  = shape[i];
+            view->stride[i] = contiguous[i];
+        }
+
+        return view;
+    }
+    if (!ccml_has_buffer(tensor)) tensor = ccml_sum(ctx, tensor, 0, NULL);
+    if (tensor == NULL) return NULL;
+
+    ccml_tensor * result = ccml_new_tensor_impl(ctx, tensor->type, CCML_OPER_RES, shape);
+    if (result == NULL) return NULL;
+
+    result->src[0]       = tensor;
+    result->has_gradient = tensor->has_gradient;
 
     return result;
 }
 
 CCML_API ccml_tensor * ccml_permute(ccml_context * ctx, ccml_tensor * tensor, int * perm) {
+    // the strides of a permute are the ones of its buffer, permutes of permutes alias it directly,
+    // other views are permuted as views and computed values are copied into a buffer first
+    if (ccml_context_failed(ctx)) return NULL;
+    if (!ccml_is_view(tensor) && !ccml_has_buffer(tensor)) tensor = ccml_sum(ctx, tensor, 0, NULL);
+    if (tensor == NULL) return NULL;
+    if (ccml_is_view(tensor) && tensor->oper != CCML_OPER_PER) {
+        ccml_tensor * view = ccml_new_view(ctx, tensor);
+        if (view == NULL) return NULL;
+
+        int shape[CCML_DIMS_MAX];
+        int stride[CCML_DIMS_MAX];
+        for (int i = 0; i < CCML_DIMS_MAX; i++) {
+            shape[i]  = view->shape[perm[i]];
+            stride[i] = view->stride[perm[i]];
+        }
+        for (int i = 0; i < CCML_DIMS_MAX; i++) {
+            view->shape[i]  = shape[i];
+            view->stride[i] = stride[i];
+        }
+
+        return view;
+    }
+
     ccml_tensor * result = ccml_new_tensor_impl(ctx, tensor->type, CCML_OPER_PER, tensor->shape);
-    result->src[0]       = tensor;
+    if (result == NULL) return NULL;
+
+    result->src[0]       = tensor->oper == CCML_OPER_PER ? tensor->src[0] : tensor;
     result->has_gradient = tensor->has_gradient;
 
 
@@ -396,8 +1123,9 @@ CCML_API ccml_tensor * ccml_permute(ccml_context * ctx, ccml_tensor * tensor, in
 }
 
 CCML_API ccml_tensor * ccml_sum(ccml_context * ctx, ccml_tensor * tensor, int n_axes, int * axes) {
+    if (ccml_context_failed(ctx)) return NULL;
     CCML_ASSERT(n_axes >= 0 && n_axes <= CCML_DIMS_MAX, "invalid number of summed axes");
-    int shape[CCML_DIMS_MAX] = {1, 1, 1, 1};
+    int shape[CCML_DIMS_MAX];
 
     for (int i = 0; i < CCML_DIMS_MAX; i++) {
         shape[i] = tensor->shape[i];
@@ -408,36 +1136,148 @@ CCML_API ccml_tensor * ccml_sum(ccml_context * ctx, ccml_tensor * tensor, int n_
     }
 
     ccml_tensor * result = ccml_new_tensor_impl(ctx, tensor->type, CCML_OPER_SUM, shape);
+    if (result == NULL) return NULL;
+
     result->src[0]       = tensor;
     result->has_gradient = tensor->has_gradient;
 
     ccml_tensor * save = ccml_new_tensor_impl(ctx, result->type, CCML_OPER_INTR, result->shape);
+    if (save == NULL) return NULL;
+
     save->src[0]       = result;
     save->has_gradient = result->has_gradient;
 
     return save;
 }
 
-//
-//  ███████╗███████╗ ██████╗ ██████╗ ███╗   ██╗██████╗  █████╗ ██████╗ ██╗   ██╗
-//  ██╔════╝██╔════╝██╔════╝██╔═══██╗████╗  ██║██╔══██╗██╔══██╗██╔══██╗╚██╗ ██╔╝
-//  ███████╗█████╗  ██║     ██║   ██║██╔██╗ ██║██║  ██║███████║██████╔╝ ╚████╔╝
-//  ╚════██║██╔══╝  ██║     ██║   ██║██║╚██╗██║██║  ██║██╔══██║██╔══██╗  ╚██╔╝
-//  ███████║███████╗╚██████╗╚██████╔╝██║ ╚████║██████╔╝██║  ██║██║  ██║   ██║
-//  ╚══════╝╚══════╝ ╚═════╝ ╚═════╝ ╚═╝  ╚═══╝╚═════╝ ╚═╝  ╚═╝╚═╝  ╚═╝   ╚═╝
-//
-//   ██████╗ ██████╗ ███████╗██████╗  █████╗ ████████╗██╗ ██████╗ ███╗   ██╗███████╗
-//  ██╔═══██╗██╔══██╗██╔════╝██╔══██╗██╔══██╗╚══██╔══╝██║██╔═══██╗████╗  ██║██╔════╝
-//  ██║   ██║██████╔╝█████╗  ██████╔╝███████║   ██║   ██║██║   ██║██╔██╗ ██║███████╗
+CCML_API ccml_tensor * ccml_reduce_max(ccml_context * ctx, ccml_tensor * tensor, int n_axes, int * axes) {
+    // reduced like a sum, with the buffer starting out from -inf instead of zero
+    ccml_tensor * save = ccml_sum(ctx, tensor, n_axes, axes);
+    if (save == NULL) return NULL;
+
+    save->src[0]->oper = CCML_OPER_RMAX;
+
+    return save;
+}
+
+CCML_API ccml_tensor * ccml_gather(ccml_context * ctx, ccml_tensor * table, ccml_tensor * indices) {
+    // the rows of the table picked by a vector of indices, which are read by index inside
+    // whatever kernel uses them, so a lookup costs the rows it reads instead of a one-hot
+    // product over the whole table. tables without a buffer are copied into one first
+    if (ccml_context_failed(ctx)) return NULL;
+    CCML_ASSERT(indices->type == CCML_TYPE_INT32, "gathers take int32 indices");
+    CCML_ASSERT(ccml_dim(indices) == 1, "gathers take a vector of indices");
+    int shape[CCML_DIMS_MAX];
+    for (int i = 0; i < CCML_DIMS_MAX; i++) {
+        shape[i] = i == 0 ? indices->shape[0] : table->shape[i];
+    }
+
+    ccml_tensor * source = ccml_has_buffer(table) ? table : ccml_sum(ctx, table, 0, NULL);
+    ccml_tensor * result = ccml_new_tensor_impl(ctx, table->type, CCML_OPER_GATHER, shape);
+    if (result == NULL) return NULL;
+
+    result->src[0]       = source;
+    result->src[1]       = indices;
+    result->has_gradient = table->has_gradient;
+
+    return result;
+}
+
+CCML_API ccml_tensor * ccml_scatter_add(ccml_context * ctx, ccml_tensor * values, ccml_tensor * indices, int rows) {
+    // every row of values is added into the row of its index of a zeroed tensor with the
+    // given number of rows, repeated indices accumulate. like sums, the result is written
+    // into the buffer of the intermediary that follows
+    if (ccml_context_failed(ctx)) return NULL;
+    CCML_ASSERT(indices->type == CCML_TYPE_INT32, "scatter-adds take int32 indices");
+    CCML_ASSERT(ccml_dim(indices) == 1 && indices->shape[0] == values->shape[0], "one index per row of values");
+    int shape[CCML_DIMS_MAX];
+    for (int i = 0; i < CCML_DIMS_MAX; i++) {
+        shape[i] = i == 0 ? rows : values->shape[i];
+    }
+
+    ccml_tensor * result = ccml_new_tensor_impl(ctx, values->type, CCML_OPER_SCATTER_ADD, shape);
+    if (result == NULL) return NULL;
+
+    result->src[0]       = values;
+    result->src[1]       = indices;
+    result->has_gradient = values->has_gradient;
+
+    ccml_tensor * save = ccml_new_tensor_impl(ctx, result->type, CCML_OPER_INTR, result->shape);
+    if (save == NULL) return NULL;
+
+    save->src[0]       = result;
+    save->has_gradient = result->has_gradient;
+
+    return save;
+}
+
+CCML_API ccml_tensor * ccml_new_fused(ccml_context * ctx, ccml_oper oper, int * shape, int axis,
+                                      ccml_tensor ** srcs, int n_srcs) {
+    // fused ops run a thread for every element outside of their axis and walk the axis in a
+    // loop. they index their sources freely, so every source is read out of a buffer, values
+    // without one are copied into one through an empty sum, which keeps their gradients
+    if (ccml_context_failed(ctx)) return NULL;
+    ccml_tensor * result = ccml_new_tensor_impl(ctx, srcs[0]->type, oper, shape);
+    if (result == NULL) return NULL;
+
+    result->axis = axis;
+
+    for (int i = 0; i < n_srcs; i++) {
+        bool reads_buffer = ccml_has_buffer(srcs[i]) || ccml_is_view(srcs[i]);
+        result->src[i] = reads_buffer ? srcs[i] : ccml_sum(ctx, srcs[i], 0, NULL);
+        result->has_gradient |= srcs[i]->has_gradient;
+    }
+
+    // like sums, the result is written into the buffer of the intermediary that follows
+    ccml_tensor * save = ccml_new_tensor_impl(ctx, result->type, CCML_OPER_INTR, result->shape);
+    if (save == NULL) return NULL;
+
+    save->src[0]       = result;
+    save->has_gradient = result->has_gradient;
+
+    return save;
+}
+
+CCML_API ccml_tensor * ccml_attention(ccml_context * ctx, ccml_tensor * q, ccml_tensor * k, ccml_tensor * v) {
+    // softmax(q*k^T/sqrt(d))*v over the last two dims, rows along the first and features along
+    // the second, any dims before them are batch dims. each row streams over the keys tile by
+    // tile with a running max and sum, so the scores are never stored anywhere
+    if (ccml_context_failed(ctx)) return NULL;
+    int dim = ccml_dim(q);
+    if (ccml_dim(k) > dim) dim = ccml_dim(k);
+    if (ccml_dim(v) > dim) dim = ccml_dim(v);
+    int axis = (dim < 2 ? 2 : dim) - 1;
+
+    CCML_ASSERT(q->shape[axis] == k->shape[axis], "queries and keys must have the same features");
+    CCML_ASSERT(k->shape[axis - 1] == v->shape[axis - 1], "keys and values must have the same rows");
+    for (int i = 0; i < axis - 1; i++) {
+        CCML_ASSERT(q->shape[i] == k->shape[i] && k->shape[i] == v->shape[i], "attention batch dims must match");
+    }
+
+    int shape[CCML_DIMS_MAX];
+    for (int i = 0; i < CCML_DIMS_MAX; i++) {
+        shape[i] = i == axis ? v->shape[i] : q->shape[i];
+    }
+
+    return ccml_new_fused(ctx, CCML_OPER_ATTN, shape, axis, (ccml_tensor *[]){q, k, v}, 3);
+}
+
+//
+//  ███████╗███████╗ ██████╗ ██████╗ ███╗   ██╗██████╗  █████╗ ██████╗ ██╗   ██╗
+//  ██╔════╝██╔════╝██╔════╝██╔═══██╗████╗  ██║██╔══██╗██╔══██╗██╔══██╗╚██╗ ██╔╝
+//  ███████╗█████╗  ██║     ██║   ██║██╔██╗ ██║██║  ██║███████║██████╔╝ ╚████╔╝
+//  ╚════██║██╔══╝  ██║     ██║   ██║██║╚██╗██║██║  ██║██╔══██║██╔══██╗  ╚██╔╝
+//  ███████║███████╗╚██████╗╚██████╔╝██║ ╚████║██████╔╝██║  ██║██║  ██║   ██║
+//  ╚══════╝╚══════╝ ╚═════╝ ╚═════╝ ╚═╝  ╚═══╝╚═════╝ ╚═╝  ╚═╝╚═╝  ╚═╝   ╚═╝
+//
+//   ██████╗ ██████╗ ███████╗██████╗  █████╗ ████████╗██╗ ██████╗ ███╗   ██╗███████╗
+//  ██╔═══██╗██╔══██╗██╔════╝██╔══██╗██╔══██╗╚══██╔══╝██║██╔═══██╗████╗  ██║██╔════╝
+//  ██║   ██║██████╔╝█████╗  ██████╔╝███████║   ██║   ██║██║   ██║██╔██╗ ██║███████╗
 //  ██║   ██║██╔═══╝ ██╔══╝  ██╔══██╗██╔══██║   ██║   ██║██║   ██║██║╚██╗██║╚════██║
 //  ╚██████╔╝██║     ███████╗██║  ██║██║  ██║   ██║   ██║╚██████╔╝██║ ╚████║███████║
 //   ╚═════╝ ╚═╝     ╚══════╝╚═╝  ╚═╝╚═╝  ╚═╝   ╚═╝   ╚═╝ ╚═════╝ ╚═╝  ╚═══╝╚══════╝
 //
 
-CCML_API ccml_tensor * ccml_neg(ccml_context * ctx, ccml_tensor * tensor) {
-    return ccml_log(ctx, ccml_rec(ctx, ccml_exp(ctx, tensor)));
-}
-
 CCML_API ccml_tensor * ccml_sub(ccml_context * ctx, ccml_tensor * lhs, ccml_tensor * rhs) {
     return ccml_add(ctx, lhs, ccml_neg(ctx, rhs));
 }
@@ -454,36 +1294,299 @@ CCML_API ccml_tensor * ccml_cos(ccml_context * ctx, ccml_tensor * tensor) {
     return ccml_sin(ctx, ccml_add(ctx, tensor, ccml_scalar(ctx, M_PI_2)));
 }
 
+CCML_API ccml_tensor * ccml_relu(ccml_context * ctx, ccml_tensor * tensor) {
+    return ccml_max(ctx, tensor, ccml_scalar(ctx, 0.0f));
+}
+
+CCML_API ccml_tensor * ccml_bernoulli(ccml_context * ctx, int * shape, float p, ccml_tensor * seed, int stream) {
+    return ccml_cmplt(ctx, ccml_uniform(ctx, shape, seed, stream), ccml_scalar(ctx, p));
+}
+
+CCML_API ccml_tensor * ccml_dropout(ccml_context * ctx, ccml_tensor * tensor, float p, ccml_tensor * seed, int stream) {
+    // the mask is generated in the kernel applying it, survivors are scaled up to keep the mean
+    if (ccml_context_failed(ctx)) return NULL;
+    CCML_ASSERT(p >= 0.0f && p < 1.0f, "invalid dropout probability");
+    ccml_tensor * mask = ccml_bernoulli(ctx, tensor->shape, 1.0f - p, seed, stream);
+
+    return ccml_mul(ctx, tensor, ccml_mul(ctx, mask, ccml_scalar(ctx, 1.0f / (1.0f - p))));
+}
+
 CCML_API ccml_tensor * ccml_tanh(ccml_context * ctx, ccml_tensor * tensor) {
-    ccml_tensor * exp_neg = ccml_neg(ctx, ccml_exp(ctx, tensor));
+    ccml_tensor * exp_neg = ccml_exp(ctx, ccml_neg(ctx, tensor));
     ccml_tensor * exp = ccml_exp(ctx, tensor);
 
     return ccml_div(ctx, ccml_sub(ctx, exp, exp_neg), ccml_add(ctx, exp, exp_neg));
 }
 
 CCML_API ccml_tensor * ccml_matmul(ccml_context * ctx, ccml_tensor * lhs, ccml_tensor * rhs) {
+    if (ccml_context_failed(ctx)) return NULL;
     CCML_ASSERT(ccml_is_matrix(lhs) && ccml_is_matrix(rhs));
     CCML_ASSERT(lhs->shape[1] == rhs->shape[0]);
-    ccml_tensor * lhs_r = ccml_reshape(ctx, lhs, (int[]){lhs->shape[0], lhs->shape[1], 1, 1});
-    ccml_tensor * rhs_r = ccml_reshape(ctx, rhs, (int[]){1, rhs->shape[0], rhs->shape[1], 1});
+    ccml_tensor * lhs_r = ccml_reshape(ctx, lhs, (int[CCML_DIMS_MAX]){lhs->shape[0], lhs->shape[1]});
+    ccml_tensor * rhs_r = ccml_reshape(ctx, rhs, (int[CCML_DIMS_MAX]){1, rhs->shape[0], rhs->shape[1]});
     ccml_tensor * mul_r = ccml_mul(ctx, lhs_r, rhs_r);
     ccml_tensor * sum_r = ccml_sum(ctx, mul_r, 1, (int[]){1});
-    ccml_tensor * res_r = ccml_reshape(ctx, sum_r, (int[]){sum_r->shape[0], sum_r->shape[2], 1, 1});
+    if (sum_r == NULL) return NULL;
+
+    ccml_tensor * res_r = ccml_reshape(ctx, sum_r, (int[CCML_DIMS_MAX]){sum_r->shape[0], sum_r->shape[2]});
 
     return res_r;
 }
 
+CCML_API ccml_tensor * ccml_softmax(ccml_context * ctx, ccml_tensor * tensor, int axis) {
+    if (ccml_context_failed(ctx)) return NULL;
+    CCML_ASSERT(axis >= 0 && axis < CCML_DIMS_MAX, "invalid axis");
+    return ccml_new_fused(ctx, CCML_OPER_SOFTMAX, tensor->shape, axis, &tensor, 1);
+}
+
+CCML_API ccml_tensor * ccml_log_softmax(ccml_context * ctx, ccml_tensor * tensor, int axis) {
+    if (ccml_context_failed(ctx)) return NULL;
+    CCML_ASSERT(axis >= 0 && axis < CCML_DIMS_MAX, "invalid axis");
+    return ccml_new_fused(ctx, CCML_OPER_LOG_SOFTMAX, tensor->shape, axis, &tensor, 1);
+}
+
+CCML_API ccml_tensor * ccml_softmax_cross_entropy(ccml_context * ctx, ccml_tensor * logits,
+                                                  ccml_tensor * target, int axis) {
+    // the loss of every row along the axis, taken straight from the logits
+    if (ccml_context_failed(ctx)) return NULL;
+    CCML_ASSERT(axis >= 0 && axis < CCML_DIMS_MAX, "invalid axis");
+    int shape[CCML_DIMS_MAX];
+    for (int i = 0; i < CCML_DIMS_MAX; i++) {
+        CCML_ASSERT(logits->shape[i] == target->shape[i], "logits and targets must have the same shape");
+        shape[i] = i == axis ? 1 : logits->shape[i];
+    }
+
+    return ccml_new_fused(ctx, CCML_OPER_SOFTMAX_XENT, shape, axis, (ccml_tensor *[]){logits, target}, 2);
+}
+
 CCML_API ccml_tensor * ccml_soft_max(ccml_context * ctx, ccml_tensor * tensor) {
-    int dims[CCML_DIMS_MAX] = {0, 1, 2, 3};
+    // the softmax of the whole tensor is the one of its only row
+    if (ccml_context_failed(ctx)) return NULL;
+    ccml_tensor * row = ccml_has_buffer(tensor) || ccml_is_view(tensor) ? tensor : ccml_sum(ctx, tensor, 0, NULL);
+    row = ccml_reshape(ctx, row, (int [CCML_DIMS_MAX]){ccml_size(tensor)});
 
-    return ccml_div(ctx, ccml_exp(ctx, tensor), ccml_sum(ctx, ccml_exp(ctx, tensor), 4, dims));
+    return ccml_reshape(ctx, ccml_softmax(ctx, row, 0), tensor->shape);
 }
 
+// deprecated, ccml_softmax_cross_entropy takes the logits directly and stays finite where
+// the log of a softmax underflows
 CCML_API ccml_tensor * ccml_cross_entropy_loss(ccml_context * ctx, ccml_tensor * tensor, ccml_tensor * target) {
+    if (ccml_context_failed(ctx)) return NULL;
     CCML_ASSERT(ccml_size(tensor) == ccml_size(target));
-    int dims[CCML_DIMS_MAX] = {0, 1, 2, 3};
+    int dims[CCML_DIMS_MAX];
+    for (int i = 0; i < CCML_DIMS_MAX; i++) dims[i] = i;
+
+    // probabilities coming out of a softmax are handed to the fused loss on its logits, anything
+    // else is still taken as probabilities
+    ccml_tensor * save = tensor->oper == CCML_OPER_RES ? tensor->src[0] : tensor;
+    if (save->oper == CCML_OPER_INTR && save->src[0] != NULL && save->src[0]->oper == CCML_OPER_SOFTMAX) {
+        ccml_tensor * logits = save->src[0]->src[0];
+        if (memcmp(target->shape, logits->shape, sizeof(logits->shape)) != 0) {
+            target = ccml_reshape(ctx, target, logits->shape);
+        }
+
+        return ccml_sum(ctx, ccml_softmax_cross_entropy(ctx, logits, target, save->src[0]->axis), CCML_DIMS_MAX, dims);
+    }
+
+    return ccml_neg(ctx, ccml_sum(ctx, ccml_mul(ctx, target, ccml_log(ctx, tensor)), CCML_DIMS_MAX, dims));
+}
+
+//
+//  ██╗   ██╗██╗███████╗██╗    ██╗███████╗
+//  ██║   ██║██║██╔════╝██║    ██║██╔════╝
+//  ██║   ██║██║█████╗  ██║ █╗ ██║███████╗
+//  ╚██╗ ██╔╝██║██╔══╝  ██║███╗██║╚════██║
+//   ╚████╔╝ ██║███████╗╚███╔███╔╝███████║
+//    ╚═══╝  ╚═╝╚══════╝ ╚══╝╚══╝ ╚══════╝
+//
+
+// views read straight out of the buffer they were taken from through their own shape, strides
+// and storage offset, so slicing, expanding and squeezing never copy anything. values without
+// a buffer are copied into one through an empty sum first. gradients go back through the same
+// strides into the buffer, see ccml_grad_view
+
+CCML_API ccml_tensor * ccml_new_view(ccml_context * ctx, ccml_tensor * tensor) {
+    if (ccml_context_failed(ctx)) return NULL;
+    if (!ccml_has_buffer(tensor) && !ccml_is_view(tensor)) {
+        tensor = ccml_sum(ctx, tensor, 0, NULL);
+    }
+    if (tensor == NULL) return NULL;
+
+    // views of views read the same buffer, src[1] orders them after the stores filling it
+    ccml_tensor * view = ccml_new_tensor_impl(ctx, tensor->type, CCML_OPER_VIEW, tensor->shape);
+    if (view == NULL) return NULL;
+
+    view->src[0]       = ccml_is_view(tensor) ? tensor->src[0] : tensor;
+    view->src[1]       = ccml_is_view(tensor) ? tensor->src[1] : NULL;
+    view->offset       = tensor->offset;
+    view->has_gradient = tensor->has_gradient;
+
+    for (int i = 0; i < CCML_DIMS_MAX; i++) {
+        view->stride[i] = tensor->stride[i];
+    }
+
+    return view;
+}
+
+CCML_API ccml_tensor * ccml_slice(ccml_context * ctx, ccml_tensor * tensor, int axis,
+                                  int start, int finish, int step) {
+    if (ccml_context_failed(ctx)) return NULL;
+    CCML_ASSERT(axis >= 0 && axis < CCML_DIMS_MAX, "invalid axis");
+    CCML_ASSERT(start >= 0 && start < finish && finish <= tensor->shape[axis] && step > 0, "invalid slice");
+    ccml_tensor * view = ccml_new_view(ctx, tensor);
+    if (view == NULL) return NULL;
+
+    view->offset       += start * view->stride[axis];
+    view->shape[axis]   = (finish - start + step - 1) / step;
+    view->stride[axis] *= step;
+
+    return view;
+}
+
+CCML_API ccml_tensor * ccml_expand(ccml_context * ctx, ccml_tensor * tensor, int * shape) {
+    // expanded dims repeat the same elements, binary ops already broadcast without this
+    if (ccml_context_failed(ctx)) return NULL;
+    ccml_tensor * view = ccml_new_view(ctx, tensor);
+    if (view == NULL) return NULL;
+
+    for (int i = 0; i < CCML_DIMS_MAX; i++) {
+        if (view->shape[i] == shape[i]) continue;
+
+        CCML_ASSERT(view->shape[i] == 1, "only unit dims can be expanded");
+        view->shape[i]  = shape[i];
+        view->stride[i] = 0;
+    }
+
+    return view;
+}
+
+CCML_API ccml_tensor * ccml_squeeze(ccml_context * ctx, ccml_tensor * tensor, int axis) {
+    if (ccml_context_failed(ctx)) return NULL;
+    CCML_ASSERT(axis >= 0 && axis < CCML_DIMS_MAX && tensor->shape[axis] == 1, "only unit dims can be squeezed");
+    ccml_tensor * view = ccml_new_view(ctx, tensor);
+    if (view == NULL) return NULL;
+
+    for (int i = axis; i < CCML_DIMS_MAX - 1; i++) {
+        view->shape[i]  = view->shape[i + 1];
+        view->stride[i] = view->stride[i + 1];
+    }
+    view->shape[CCML_DIMS_MAX - 1]  = 1;
+    view->stride[CCML_DIMS_MAX - 1] = 1;
+
+    return view;
+}
+
+CCML_API ccml_tensor * ccml_unsqueeze(ccml_context * ctx, ccml_tensor * tensor, int axis) {
+    if (ccml_context_failed(ctx)) return NULL;
+    CCML_ASSERT(axis >= 0 && axis < CCML_DIMS_MAX && tensor->shape[CCML_DIMS_MAX - 1] == 1,
+                "no room for another dim");
+    ccml_tensor * view = ccml_new_view(ctx, tensor);
+    if (view == NULL) return NULL;
+
+    for (int i = CCML_DIMS_MAX - 1; i > axis; i--) {
+        view->shape[i]  = view->shape[i - 1];
+        view->stride[i] = view->stride[i - 1];
+    }
+    view->shape[axis]  = 1;
+    view->stride[axis] = 1;
+
+    return view;
+}
+
+CCML_API ccml_tensor * ccml_new_store(ccml_context * ctx, ccml_tensor * tensor, ccml_tensor * destination,
+                                      int * stride, int offset) {
+    // a store writes its value into a strided region of the destination buffer, chaining
+    // it onto the previous store of the same destination orders the two
+    if (ccml_context_failed(ctx)) return NULL;
+    ccml_tensor * store = ccml_new_tensor_impl(ctx, tensor->type, CCML_OPER_STORE, tensor->shape);
+    if (store == NULL) return NULL;
+
+    store->src[0] = tensor;
+    store->src[1] = destination;
+    store->offset = offset;
+
+    for (int i = 0; i < CCML_DIMS_MAX; i++) {
+        store->stride[i] = stride[i];
+    }
+
+    return store;
+}
+
+CCML_API ccml_tensor * ccml_concat(ccml_context * ctx, int n_tensors, ccml_tensor ** tensors, int axis) {
+    // every part is computed straight into its region of the destination, in a kernel of its
+    // own, and the result reads the destination back once all of the stores are done
+    if (ccml_context_failed(ctx)) return NULL;
+    CCML_ASSERT(n_tensors > 0 && axis >= 0 && axis < CCML_DIMS_MAX, "invalid concatenation");
+    int shape[CCML_DIMS_MAX];
+    for (int i = 0; i < CCML_DIMS_MAX; i++) {
+        shape[i] = i == axis ? 0 : tensors[0]->shape[i];
+    }
 
-    return ccml_neg(ctx, ccml_sum(ctx, ccml_mul(ctx, target, ccml_log(ctx, tensor)), 4, dims));
+    for (int i = 0; i < n_tensors; i++) {
+        for (int j = 0; j < CCML_DIMS_MAX; j++) {
+            CCML_ASSERT(j == axis || tensors[i]->shape[j] == shape[j], "concatenated tensors must match outside the axis");
+        }
+        shape[axis] += tensors[i]->shape[axis];
+    }
+
+    ccml_tensor * destination = ccml_new_tensor_impl(ctx, tensors[0]->type, CCML_OPER_INTR, shape);
+    if (destination == NULL) return NULL;
+
+    ccml_tensor * previous = destination;
+    int offset = 0;
+
+    for (int i = 0; i < n_tensors; i++) {
+        previous = ccml_new_store(ctx, tensors[i], previous, destination->stride, offset);
+        offset += tensors[i]->shape[axis] * destination->stride[axis];
+    }
+
+    ccml_tensor * result = ccml_new_view(ctx, destination);
+    if (result == NULL) return NULL;
+
+    result->src[1] = previous;
+    for (int i = 0; i < n_tensors; i++) {
+        result->has_gradient |= tensors[i]->has_gradient;
+    }
+
+    return result;
+}
+
+CCML_API ccml_tensor * ccml_stack(ccml_context * ctx, int n_tensors, ccml_tensor ** tensors, int axis) {
+    // stacked parts get a new dim, their stores skip over it in the destination's strides
+    if (ccml_context_failed(ctx)) return NULL;
+    CCML_ASSERT(n_tensors > 0 && axis >= 0 && axis < CCML_DIMS_MAX, "invalid stack");
+    CCML_ASSERT(tensors[0]->shape[CCML_DIMS_MAX - 1] == 1, "no room for another dim");
+    int shape[CCML_DIMS_MAX];
+    for (int i = 0; i < CCML_DIMS_MAX; i++) {
+        shape[i] = i == axis ? n_tensors : tensors[0]->shape[i - (i > axis)];
+    }
+
+    ccml_tensor * destination = ccml_new_tensor_impl(ctx, tensors[0]->type, CCML_OPER_INTR, shape);
+    if (destination == NULL) return NULL;
+
+    ccml_tensor * previous = destination;
+
+    int stride[CCML_DIMS_MAX];
+    for (int i = 0; i < CCML_DIMS_MAX; i++) {
+        stride[i] = i < CCML_DIMS_MAX - 1 ? destination->stride[i + (i >= axis)] : 1;
+    }
+
+    for (int i = 0; i < n_tensors; i++) {
+        for (int j = 0; j < CCML_DIMS_MAX; j++) {
+            CCML_ASSERT(tensors[i]->shape[j] == tensors[0]->shape[j], "stacked tensors must have the same shape");
+        }
+        previous = ccml_new_store(ctx, tensors[i], previous, stride, i * destination->stride[axis]);
+    }
+
+    ccml_tensor * result = ccml_new_view(ctx, destination);
+    if (result == NULL) return NULL;
+
+    result->src[1] = previous;
+    for (int i = 0; i < n_tensors; i++) {
+        result->has_gradient |= tensors[i]->has_gradient;
+    }
+
+    return result;
 }
 
 //
@@ -516,9 +1619,36 @@ CCML_API uint64_t ccml_hash_key(void * key) {
     return hash;
 }
 
+CCML_API uint64_t ccml_hash_string(const char * string) {
+    uint64_t hash = CCML_FNV_OFFSET;
+    for (; *string != '\0'; string++) {
+        hash ^= (uint8_t)*string;
+        hash *= CCML_FNV_PRIME;
+    }
+    return hash;
+}
+
+CCML_API uint64_t ccml_hash_data(const void * data, int size) {
+    // fnv over 64-bit words in four independent lanes, so hashing keeps up with memory
+    uint64_t lanes[4] = {CCML_FNV_OFFSET, CCML_FNV_OFFSET ^ 1, CCML_FNV_OFFSET ^ 2, CCML_FNV_OFFSET ^ 3};
+    const uint8_t * bytes = data;
+    int n_words = size / sizeof(uint64_t);
+    for (int i = 0; i < n_words; i++) {
+        uint64_t word;
+        memcpy(&word, bytes + i * sizeof(uint64_t), sizeof(word));
+        lanes[i % 4] = (lanes[i % 4] ^ word) * CCML_FNV_PRIME;
+    }
+    for (int i = n_words * sizeof(uint64_t); i < size; i++) {
+        lanes[0] = (lanes[0] ^ bytes[i]) * CCML_FNV_PRIME;
+    }
+
+    return ((lanes[0] * CCML_FNV_PRIME ^ lanes[1]) * CCML_FNV_PRIME ^ lanes[2]) * CCML_FNV_PRIME ^ lanes[3];
+}
+
 CCML_API ccml_hashmap * ccml_new_hashmap(ccml_context * ctx) {
     int capacity = CCML_NODE_MAX;
     ccml_hashmap * map = ccml_malloc(ctx, sizeof(ccml_hashmap));
+    if (map == NULL) return NULL;
 
     *map = (ccml_hashmap) {
         .used     = 0,
@@ -574,6 +1704,152 @@ CCML_API void ccml_hashmap_set(ccml_hashmap * map, void * key, int value) {
     map->used++;
 }
 
+//
+//  ██████╗ ██████╗  ██████╗ ███████╗██╗██╗     ███████╗
+//  ██╔══██╗██╔══██╗██╔═══██╗██╔════╝██║██║     ██╔════╝
+//  ██████╔╝██████╔╝██║   ██║█████╗  ██║██║     █████╗
+//  ██╔═══╝ ██╔══██╗██║   ██║██╔══╝  ██║██║     ██╔══╝
+//  ██║     ██║  ██║╚██████╔╝██║     ██║███████╗███████╗
+//  ╚═╝     ╚═╝  ╚═╝ ╚═════╝ ╚═╝     ╚═╝╚══════╝╚══════╝
+//
+
+#if defined(CCML_PROFILE)
+    #define CCML_PROFILE_ENABLED true
+#else
+    #define CCML_PROFILE_ENABLED false
+#endif
+
+// timestamps that only end up in the profile, without CCML_PROFILE they aren't even taken
+#define ccml_profile_time() (CCML_PROFILE_ENABLED ? ccml_time() : 0.0)
+
+// an execution compiles and launches every kernel on every device at most once, on top of
+// a handful of phases around them
+#define CCML_EVENT_MAX (2 * CCML_KERN_MAX * CCML_DEVICE_MAX + 16)
+
+typedef enum ccml_phase {
+    CCML_PHASE_TRACE,
+    CCML_PHASE_BACKWARD,
+    CCML_PHASE_SCHEDULE,
+    CCML_PHASE_ALLOCATE,
+    CCML_PHASE_CODEGEN,
+    CCML_PHASE_COMPILE,
+    CCML_PHASE_UPLOAD,
+    CCML_PHASE_RUN,
+    CCML_PHASE_DOWNLOAD
+} ccml_phase;
+
+typedef struct ccml_event {
+    ccml_phase phase;
+    int kernel;         // -1 for events that aren't a kernel launch
+    int device;
+    int start_node;     // kernels cover the nodes in [start_node, finish_node)
+    int finish_node;
+    double start;       // seconds since the profile began
+    double duration;
+} ccml_event;
+
+typedef struct ccml_profile {
+    double origin;
+    int n_events;
+    int n_built;        // events recorded while building the graph, they outlive resets
+    int n_dropped;      // events that didn't fit since the last reset
+    ccml_event events[CCML_EVENT_MAX];
+    double flops[CCML_NODE_MAX];
+    double bytes[CCML_NODE_MAX];
+} ccml_profile;
+
+CCML_API double ccml_time(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+CCML_API const char * ccml_phase_string(ccml_phase phase) {
+    switch (phase) {
+        case CCML_PHASE_TRACE: return "trace";
+        case CCML_PHASE_BACKWARD: return "backward";
+        case CCML_PHASE_SCHEDULE: return "schedule";
+        case CCML_PHASE_ALLOCATE: return "allocate";
+        case CCML_PHASE_CODEGEN: return "codegen";
+        case CCML_PHASE_COMPILE: return "compile";
+        case CCML_PHASE_UPLOAD: return "upload";
+        case CCML_PHASE_RUN: return "run";
+        case CCML_PHASE_DOWNLOAD: return "download";
+        default: CCML_ASSERT(false, "unknown phase");
+    }
+}
+
+CCML_API void ccml_profile_event(ccml_profile * profile, ccml_event event) {
+    if (!CCML_PROFILE_ENABLED) return;
+    if (profile->n_events == CCML_EVENT_MAX) {
+        if (profile->n_dropped++ == 0) ccml_message(CCML_LOG_WARN, "profile is full, further events are dropped");
+        return;
+    }
+
+    event.start -= profile->origin;
+    profile->events[profile->n_events++] = event;
+}
+
+CCML_API void ccml_profile_reset(ccml_profile * profile) {
+    // executions start from the events of building the graph, so a profile only ever
+    // holds the last one
+    profile->n_events  = profile->n_built;
+    profile->n_dropped = 0;
+}
+
+CCML_API void ccml_profile_phase(ccml_profile * profile, ccml_phase phase, int device, double start) {
+    ccml_profile_event(profile, (ccml_event) {
+        .phase    = phase,
+        .kernel   = -1,
+        .device   = device,
+        .start    = start,
+        .duration = ccml_profile_time() - start
+    });
+}
+
+CCML_API double ccml_profile_total(ccml_profile * profile, ccml_phase phase) {
+    double total = 0;
+    for (int i = 0; i < profile->n_events; i++) {
+        if (profile->events[i].phase == phase) total += profile->events[i].duration;
+    }
+
+    return total;
+}
+
+CCML_API ccml_status ccml_profile_export(ccml_profile * profile, const char * path) {
+    FILE * file = fopen(path, "w");
+    if (file == NULL) {
+        ccml_message(CCML_LOG_ERROR, "failed to open %s", path);
+        return CCML_STATUS_IO_FAILED;
+    }
+
+    // chrome trace event format, complete events with timestamps in microseconds
+    fprintf(file, "{\"traceEvents\": [\n");
+    for (int i = 0; i < profile->n_events; i++) {
+        ccml_event * event = &profile->events[i];
+        fprintf(file, "\t{\"ph\": \"X\", \"pid\": 0, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, ",
+                event->device, event->start * 1e6, event->duration * 1e6);
+
+        if (event->kernel == -1) {
+            fprintf(file, "\"cat\": \"phase\", \"name\": \"%s\"}", ccml_phase_string(event->phase));
+        } else {
+            double flops = 0;
+            double bytes = 0;
+            for (int j = event->start_node; j < event->finish_node; j++) {
+                flops += profile->flops[j];
+                bytes += profile->bytes[j];
+            }
+            fprintf(file, "\"cat\": \"kernel\", \"name\": \"my_kernel_%d\", "
+                          "\"args\": {\"nodes\": \"%d-%d\", \"flops\": %.0f, \"bytes\": %.0f}}",
+                    event->kernel, event->start_node, event->finish_node, flops, bytes);
+        }
+        fprintf(file, i + 1 < profile->n_events ? ",\n" : "\n");
+    }
+    fprintf(file, "], \"otherData\": {\"dropped_events\": %d}}\n", profile->n_dropped);
+
+    return fclose(file) == 0 ? CCML_STATUS_OK : CCML_STATUS_IO_FAILED;
+}
+
 //
 //   ██████╗ ██████╗  █████╗ ██████╗ ██╗  ██╗
 //  ██╔════╝ ██╔══██╗██╔══██╗██╔══██╗██║  ██║
@@ -583,141 +1859,794 @@ CCML_API void ccml_hashmap_set(ccml_hashmap * map, void * key, int value) {
 //   ╚═════╝ ╚═╝  ╚═╝╚═╝  ╚═╝╚═╝     ╚═╝  ╚═╝
 //
 
+typedef enum ccml_flag {
+    CCML_FLAG_BUFFER   = 1 << 0,
+    CCML_FLAG_GRADIENT = 1 << 1,
+    CCML_FLAG_LEAF     = 1 << 2
+} ccml_flag;
+
+typedef struct ccml_table {
+    // traced nodes laid out as parallel arrays, sources are node handles instead of pointers.
+    // contracting, scheduling and lowering into kernels only read and rewrite these arrays, so
+    // tensors shared with other graphs are never changed. the backward pass builds tensors of
+    // its own and walks the tensors of the nodes, nodes[] maps handles back to them
+    ccml_oper opers[CCML_NODE_MAX];
+    ccml_type types[CCML_NODE_MAX];
+    int32_t srcs[CCML_NODE_MAX][CCML_SRCS_MAX];
+    int shapes[CCML_NODE_MAX][CCML_DIMS_MAX];
+    int strides[CCML_NODE_MAX][CCML_DIMS_MAX];
+    int offsets[CCML_NODE_MAX];
+    int axes[CCML_NODE_MAX];
+    uint8_t flags[CCML_NODE_MAX];
+    uint8_t needs[CCML_NODE_MAX]; // registers the values computed in a kernel for a node take, see ccml_graph_schedule
+    int32_t partners[CCML_NODE_MAX]; // the intermediary a reduction or fused op writes into, -1 for other nodes
+} ccml_table;
+
+typedef void (*ccml_ready_hook)(ccml_status status, void * user);
+
+// how kernels compute log, exp, sin, sqrt and reciprocals. the fast modes trade accuracy for speed,
+// the interpreter always stays precise
+typedef enum ccml_accuracy {
+    CCML_ACCURACY_PRECISE, // libm on cpus, the full precision builtins on gpus
+    CCML_ACCURACY_FAST,    // polynomials within ~2 ulp in cpu kernels, half_* on opencl, fast:: on metal
+    CCML_ACCURACY_NATIVE   // the same polynomials on cpus, native_* on opencl, fast:: on metal
+} ccml_accuracy;
+
+typedef struct ccml_graph_options {
+    bool inference;           // no gradients or backward pass, weights are read-only and mul/adds fuse into fmas
+    bool async_compile;       // interpret kernels still compiling instead of waiting, or return not ready if it can't
+    ccml_ready_hook on_ready; // called from a compiler thread whenever a kernel compile the graph started finishes
+    void * user;              // handed to on_ready
+    ccml_accuracy accuracy;   // transcendentals of the generated kernels
+} ccml_graph_options;
+
 typedef struct ccml_graph {
     int n_nodes;
     ccml_tensor * nodes[CCML_NODE_MAX];
     ccml_hashmap * map;
     ccml_context * context;
+    ccml_profile profile;
+    int versions[CCML_NODE_MAX];
+    uint64_t digests[CCML_NODE_MAX]; // hashes of the loads as of the last execution
+    int rows;
+    int n_outputs;
+    ccml_tensor * outputs[CCML_OUTPUT_MAX];
+    bool inference;
+    bool readonly[CCML_NODE_MAX];
+    ccml_table table;
+    bool async_compile;
+    ccml_ready_hook on_ready;
+    void * user;
+    ccml_accuracy accuracy;
+    void * backend; // what the backend keeps on its devices between executions, see ccml_graph_free
 } ccml_graph;
 
+CCML_API void ccml_table_set(ccml_graph * graph, int node, ccml_tensor * tensor) {
+    ccml_table * table = &graph->table;
+    table->opers[node]   = tensor->oper;
+    table->types[node]   = tensor->type;
+    table->offsets[node] = tensor->offset;
+    table->axes[node]    = tensor->axis;
+    table->flags[node] = (ccml_has_buffer(tensor) ? CCML_FLAG_BUFFER : 0) |
+                         (tensor->has_gradient ? CCML_FLAG_GRADIENT : 0) |
+                         (ccml_is_leaf(tensor) ? CCML_FLAG_LEAF : 0);
+
+    for (int i = 0; i < CCML_SRCS_MAX; i++) {
+        table->srcs[node][i] = ccml_hashmap_get(graph->map, tensor->src[i]);
+    }
+    for (int i = 0; i < CCML_DIMS_MAX; i++) {
+        table->shapes[node][i]  = tensor->shape[i];
+        table->strides[node][i] = tensor->stride[i];
+    }
+
+    // sources are set before the nodes reading them, so the op is there when its intermediary is
+    table->partners[node] = -1;
+    if (tensor->oper == CCML_OPER_INTR && table->srcs[node][0] != -1) table->partners[table->srcs[node][0]] = node;
+}
+
+CCML_API void ccml_table_move(ccml_table * table, ccml_table * from, int node, int to, int * moved) {
+    // copies a row of another table (or of the same one, to a row before it) to a new handle,
+    // moved maps the handles of the old table onto the new ones
+    table->opers[to]   = from->opers[node];
+    table->types[to]   = from->types[node];
+    table->offsets[to] = from->offsets[node];
+    table->axes[to]    = from->axes[node];
+    table->flags[to]   = from->flags[node];
+    table->needs[to]   = from->needs[node];
+    table->partners[to] = from->partners[node] != -1 ? moved[from->partners[node]] : -1;
+
+    for (int i = 0; i < CCML_SRCS_MAX; i++) {
+        table->srcs[to][i] = from->srcs[node][i] != -1 ? moved[from->srcs[node][i]] : -1;
+    }
+    for (int i = 0; i < CCML_DIMS_MAX; i++) {
+        table->shapes[to][i]  = from->shapes[node][i];
+        table->strides[to][i] = from->strides[node][i];
+    }
+}
+
+CCML_API int ccml_table_size(ccml_table * table, int node) {
+    int size = 1;
+    for (int i = 0; i < CCML_DIMS_MAX; i++) {
+        size *= table->shapes[node][i];
+    }
+
+    return size;
+}
+
+CCML_API double ccml_node_flops(ccml_table * table, int node) {
+    int * srcs = table->srcs[node];
+    switch (table->opers[node]) {
+        case CCML_OPER_LOG:
+        case CCML_OPER_EXP:
+        case CCML_OPER_SIN:
+        case CCML_OPER_REC:
+        case CCML_OPER_SQT:
+        case CCML_OPER_ADD:
+        case CCML_OPER_MUL:
+        case CCML_OPER_NEG:
+        case CCML_OPER_MAX:
+        case CCML_OPER_POW:
+        case CCML_OPER_CMPLT:
+        case CCML_OPER_WHERE:
+        case CCML_OPER_UNIFORM:
+        case CCML_OPER_NORMAL: return ccml_table_size(table, node);
+        case CCML_OPER_FMA: return 2.0 * ccml_table_size(table, node);
+        case CCML_OPER_SUM:
+        case CCML_OPER_RMAX:
+        case CCML_OPER_SCATTER_ADD: return ccml_table_size(table, srcs[0]);
+        case CCML_OPER_ATTN:
+        case CCML_OPER_ATTN_LSE:
+        case CCML_OPER_ATTN_DQ:
+        case CCML_OPER_ATTN_DK:
+        case CCML_OPER_ATTN_DV:
+            // every query row meets every key row, through a dot product and an update
+            return 4.0 * ccml_table_size(table, srcs[0]) * table->shapes[srcs[1]][table->axes[node] - 1];
+        case CCML_OPER_SOFTMAX:
+        case CCML_OPER_LOG_SOFTMAX:
+        case CCML_OPER_SOFTMAX_XENT: return 4.0 * ccml_table_size(table, srcs[0]);
+        default: return 0;
+    }
+}
+
+CCML_API double ccml_node_bytes(ccml_table * table, int node) {
+    // only buffer accesses count, everything else stays in registers of the fused kernel
+    int * srcs = table->srcs[node];
+    switch (table->opers[node]) {
+        case CCML_OPER_VIEW:
+        case CCML_OPER_STORE:
+        case CCML_OPER_LOAD:
+        case CCML_OPER_INTR:
+        case CCML_OPER_SAVE:
+        case CCML_OPER_GATHER: return ccml_table_size(table, node) * sizeof(float);
+        case CCML_OPER_SUM:
+        case CCML_OPER_RMAX:
+        case CCML_OPER_SCATTER_ADD: return 2 * ccml_table_size(table, srcs[0]) * sizeof(float);
+        case CCML_OPER_ATTN:
+        case CCML_OPER_ATTN_LSE:
+        case CCML_OPER_ATTN_DQ:
+        case CCML_OPER_ATTN_DK:
+        case CCML_OPER_ATTN_DV:
+        case CCML_OPER_SOFTMAX:
+        case CCML_OPER_LOG_SOFTMAX:
+        case CCML_OPER_SOFTMAX_XENT: {
+            double bytes = ccml_table_size(table, node);
+            for (int i = 0; i < CCML_SRCS_MAX && srcs[i] != -1; i++) bytes += ccml_table_size(table, srcs[i]);
+            return bytes * sizeof(float); }
+        default: return 0;
+    }
+}
+
 CCML_API void ccml_graph_forward(ccml_graph * graph, ccml_tensor * tensor, int * node_counter) {
     if (tensor == NULL) return;
-    if (ccml_hashmap_get(graph->map, tensor->src[0]) == -1) {
-        ccml_graph_forward(graph, tensor->src[0], node_counter);
-    }
-    if (ccml_hashmap_get(graph->map, tensor->src[1]) == -1) {
-        ccml_graph_forward(graph, tensor->src[1], node_counter);
+    for (int i = 0; i < CCML_SRCS_MAX; i++) {
+        if (ccml_hashmap_get(graph->map, tensor->src[i]) == -1) {
+            ccml_graph_forward(graph, tensor->src[i], node_counter);
+        }
     }
     if (ccml_hashmap_get(graph->map, tensor) == -1) {
         CCML_ASSERT(*node_counter < CCML_NODE_MAX - 1, "more nodes created than CCML_NODE_MAX");
         tensor->index = *node_counter;
         graph->nodes[*node_counter] = tensor;
-        ccml_hashmap_set(graph->map, tensor, (*node_counter)++);
+        ccml_hashmap_set(graph->map, tensor, *node_counter);
+        ccml_table_set(graph, (*node_counter)++, tensor);
     }
 }
 
-CCML_API void ccml_graph_backward(ccml_context * ctx, ccml_graph * graph, ccml_tensor * root) {
-    if (root->has_gradient == false) return;
-    root->grad = ccml_scalar(ctx, 1.0f);
+CCML_API ccml_tensor * ccml_grad_expand(ccml_context * ctx, ccml_tensor * grad, ccml_tensor * tensor) {
+    // gradients coming out of sums keep the reduced shape, most rules broadcast them anyway
+    if (ccml_context_failed(ctx)) return NULL;
+    for (int i = 0; i < CCML_DIMS_MAX; i++) {
+        if (grad->shape[i] != tensor->shape[i]) return ccml_expand(ctx, grad, tensor->shape);
+    }
 
-    ccml_tensor * queue[CCML_NODE_MAX] = {NULL};
-    int queue_start = 0;
-    int queue_end = 0;
-    queue[queue_end++] = root;
+    return grad;
+}
 
-    while (queue_end != queue_start) {
-        ccml_tensor * tensor = queue[queue_start++];
-        if (tensor->has_gradient == true) {
-            int n_dims_0 = 0;
-            int n_dims_1 = 0;
-            int dims_0[CCML_DIMS_MAX] = {1, 1, 1, 1};
-            int dims_1[CCML_DIMS_MAX] = {1, 1, 1, 1};
-            for (int i = 0; i < CCML_DIMS_MAX; i++) {
-                if (tensor->src[0] != NULL && tensor->src[0]->shape[i] == 1 && tensor->shape[i] != 1) {
-                    dims_0[n_dims_0++] = i;
-                }
-                if (tensor->src[1] != NULL && tensor->src[1]->shape[i] == 1 && tensor->shape[i] != 1) {
-                    dims_1[n_dims_1++] = i;
-                }
-            }
+CCML_API ccml_tensor * ccml_grad_reduce(ccml_context * ctx, ccml_tensor * grad, ccml_tensor * src) {
+    // sources broadcasted by an elementwise op get the gradient summed over the broadcasted dims
+    if (ccml_context_failed(ctx)) return NULL;
+    int n_dims = 0;
+    int dims[CCML_DIMS_MAX] = {0};
+    for (int i = 0; i < CCML_DIMS_MAX; i++) {
+        if (src->shape[i] == 1 && grad->shape[i] != 1) dims[n_dims++] = i;
+    }
 
-            // calculating partials
-            ccml_tensor * grads[CCML_SRCS_MAX] = {NULL};
-            switch (tensor->oper) {
-                case CCML_OPER_LOG:
-                    grads[0] = ccml_mul(ctx, tensor->grad, ccml_rec(ctx, tensor->src[0])); break;
-                case CCML_OPER_EXP:
-                    grads[0] = ccml_mul(ctx, tensor->grad, ccml_exp(ctx, tensor->src[0])); break;
-                case CCML_OPER_SIN:
-                    grads[0] = ccml_mul(ctx, tensor->grad, ccml_cos(ctx, tensor->src[0])); break;
-                case CCML_OPER_REC: {
-                    ccml_tensor * square = ccml_square(ctx, tensor->src[0]);
-                    grads[0] = ccml_mul(ctx, tensor->grad, ccml_neg(ctx, ccml_rec(ctx, square))); break; }
-                case CCML_OPER_SQT: {
-                    ccml_tensor * fraction = ccml_mul(ctx, ccml_scalar(ctx, 2.0f), ccml_sqrt(ctx, tensor->src[0]));
-                    grads[0] = ccml_mul(ctx, tensor->grad, ccml_rec(ctx, fraction)); break; }
-                case CCML_OPER_ADD:
-                    grads[0] = ccml_sum(ctx, tensor->grad, n_dims_0, dims_0);
-                    grads[1] = ccml_sum(ctx, tensor->grad, n_dims_1, dims_1); break;
-                case CCML_OPER_MUL:
-                    grads[0] = ccml_sum(ctx, ccml_mul(ctx, tensor->grad, tensor->src[1]), n_dims_0, dims_0);
-                    grads[1] = ccml_sum(ctx, ccml_mul(ctx, tensor->grad, tensor->src[0]), n_dims_1, dims_1); break;
-                case CCML_OPER_SUM:
-                case CCML_OPER_PER:
-                case CCML_OPER_RES:
-                    grads[0] = tensor->grad;
-                    break;
-                case CCML_OPER_LOAD:
-                    break;
-                case CCML_OPER_INTR:
-                case CCML_OPER_SAVE:
-                    grads[0] = tensor->grad;
-                    break;
-            }
+    return ccml_sum(ctx, grad, n_dims, dims);
+}
 
-            if (tensor->src[0] != NULL && tensor->src[0]->has_gradient) {
-                if (ccml_is_leaf(tensor->src[0])) {
-                    tensor->src[0]->grad = ccml_add(ctx, grads[0], tensor->src[0]->grad);
-                    ccml_fill(ctx, tensor->src[0]->grad, 0.0f);
-                } else {
-                    tensor->src[0]->grad = ccml_mul(ctx, grads[0], tensor->src[0]->grad);
-                    ccml_fill(ctx, tensor->src[0]->grad, 1.0f);
-                }
-                ccml_graph_forward(graph, tensor->src[0]->grad, &graph->n_nodes);
-                queue[queue_end++] = tensor->src[0];
-            }
-            if (tensor->src[1] != NULL && tensor->src[1]->has_gradient) {
-                if (ccml_is_leaf(tensor->src[1])) {
-                    tensor->src[1]->grad = ccml_add(ctx, grads[1], tensor->src[1]->grad);
-                    ccml_fill(ctx, tensor->src[1]->grad, 0.0f);
-                } else {
-                    tensor->src[1]->grad = ccml_mul(ctx, grads[1], tensor->src[1]->grad);
-                    ccml_fill(ctx, tensor->src[1]->grad, 1.0f);
-                }
-                ccml_graph_forward(graph, tensor->src[1]->grad, &graph->n_nodes);
-                queue[queue_end++] = tensor->src[1];
-            }
-        }
+CCML_API ccml_tensor * ccml_grad_view(ccml_context * ctx, ccml_tensor * grad, ccml_tensor * view) {
+    // the gradient of the buffer a view reads is stored back through the strides of the view,
+    // summed over its expanded dims first, into a buffer zeroed wherever the view doesn't reach.
+    // views covering their whole buffer in order are just a reshape of the gradient
+    if (ccml_context_failed(ctx)) return NULL;
+    ccml_tensor * buffer = view->src[0];
+    bool covers = ccml_size(view) == ccml_size(buffer);
+    if (covers && view->offset == 0 && ccml_is_contiguous(view)) {
+        return ccml_reshape(ctx, grad, buffer->shape);
     }
-}
 
-CCML_API void ccml_graph_allocate(ccml_context * ctx, ccml_graph * graph) {
+    int n_dims = 0;
+    int dims[CCML_DIMS_MAX] = {0};
+    for (int i = 0; i < CCML_DIMS_MAX; i++) {
+        if (view->stride[i] == 0 && view->shape[i] != 1) dims[n_dims++] = i;
+    }
+
+    // without expanded dims a view as large as its buffer reads every element exactly once
+    ccml_tensor * destination = ccml_new_tensor_impl(ctx, grad->type, CCML_OPER_INTR, buffer->shape);
+    if (destination == NULL) return NULL;
+
+    ccml_tensor * previous = destination;
+    if (!covers || n_dims != 0) {
+        ccml_tensor * zeros = ccml_expand(ctx, ccml_scalar(ctx, 0.0f), buffer->shape);
+        previous = ccml_new_store(ctx, zeros, previous, destination->stride, 0);
+    }
+    grad = n_dims != 0 ? ccml_sum(ctx, grad, n_dims, dims) : grad;
+    previous = ccml_new_store(ctx, grad, previous, view->stride, view->offset);
+
+    ccml_tensor * result = ccml_new_view(ctx, destination);
+    if (result == NULL) return NULL;
+
+    result->src[1] = previous;
+
+    return result;
+}
+
+CCML_API ccml_tensor * ccml_grad_attention(ccml_context * ctx, ccml_graph * graph, ccml_tensor * tensor,
+                                           ccml_tensor * grad) {
+    // the backward kernels recompute the probabilities from the log-sum-exp of each row, and
+    // need the dot product of every output row with its gradient. both go into the same
+    // buffer as the gradient, so every kernel reads the rows of the queries from one place
+    if (ccml_context_failed(ctx)) return NULL;
+    ccml_tensor * q = tensor->src[0];
+    ccml_tensor * k = tensor->src[1];
+    int axis = tensor->axis;
+
+    int shape[CCML_DIMS_MAX];
+    for (int i = 0; i < CCML_DIMS_MAX; i++) {
+        shape[i] = i == axis ? 1 : q->shape[i];
+    }
+
+    ccml_tensor * output = graph->nodes[graph->table.partners[tensor->index]];
+    ccml_tensor * lse = ccml_new_fused(ctx, CCML_OPER_ATTN_LSE, shape, axis, (ccml_tensor *[]){q, k}, 2);
+    ccml_tensor * delta = ccml_sum(ctx, ccml_mul(ctx, grad, output), 1, (int []){axis});
+
+    return ccml_concat(ctx, 3, (ccml_tensor *[]){grad, lse, delta}, axis);
+}
+
+CCML_API void ccml_graph_backward(ccml_context * ctx, ccml_graph * graph, int n_roots,
+                                  ccml_tensor ** roots, ccml_tensor ** seeds) {
+    // every root with a seed starts out with it as its gradient, roots without one don't
+    // contribute, so the gradients of the whole graph are the ones of the seeded sum of roots
+    bool seeded = false;
+    for (int i = 0; i < n_roots; i++) {
+        roots[i]->grad = NULL;
+    }
+    for (int i = 0; i < n_roots; i++) {
+        if (seeds == NULL || seeds[i] == NULL || roots[i]->has_gradient == false) continue;
+        CCML_ASSERT(ccml_can_broadcast(roots[i], seeds[i]), "seed doesn't broadcast to its output");
+        roots[i]->grad = roots[i]->grad == NULL ? seeds[i] : ccml_add(ctx, roots[i]->grad, seeds[i]);
+        seeded = true;
+    }
+    if (seeded == false) return;
+    ccml_tensor * zero = ccml_scalar(ctx, 0.0f);
+
+    // nodes come in topological order, so walking them backwards finishes the gradient of
+    // every node before it's passed on to the nodes it was computed from
+    int n_nodes = graph->n_nodes;
+    for (int n = n_nodes - 1; n >= 0 && !ccml_context_failed(ctx); n--) {
+        ccml_tensor * tensor = graph->nodes[n];
+        uint8_t flags = graph->table.flags[n];
+        if (!(flags & CCML_FLAG_GRADIENT) || (flags & CCML_FLAG_LEAF) || tensor->grad == NULL) continue;
+
+        ccml_tensor * grad = ccml_grad_expand(ctx, tensor->grad, tensor);
+
+        // calculating partials
+        ccml_tensor * grads[CCML_SRCS_MAX] = {NULL};
+        switch (tensor->oper) {
+            case CCML_OPER_LOG:
+                grads[0] = ccml_mul(ctx, grad, ccml_rec(ctx, tensor->src[0])); break;
+            case CCML_OPER_EXP:
+                grads[0] = ccml_mul(ctx, grad, ccml_exp(ctx, tensor->src[0])); break;
+            case CCML_OPER_SIN:
+                grads[0] = ccml_mul(ctx, grad, ccml_cos(ctx, tensor->src[0])); break;
+            case CCML_OPER_REC: {
+                ccml_tensor * square = ccml_square(ctx, tensor->src[0]);
+                grads[0] = ccml_mul(ctx, grad, ccml_neg(ctx, ccml_rec(ctx, square))); break; }
+            case CCML_OPER_SQT: {
+                ccml_tensor * fraction = ccml_mul(ctx, ccml_scalar(ctx, 2.0f), ccml_sqrt(ctx, tensor->src[0]));
+                grads[0] = ccml_mul(ctx, grad, ccml_rec(ctx, fraction)); break; }
+            case CCML_OPER_ADD:
+                grads[0] = ccml_grad_reduce(ctx, grad, tensor->src[0]);
+                grads[1] = ccml_grad_reduce(ctx, grad, tensor->src[1]); break;
+            case CCML_OPER_MUL:
+                grads[0] = ccml_grad_reduce(ctx, ccml_mul(ctx, grad, tensor->src[1]), tensor->src[0]);
+                grads[1] = ccml_grad_reduce(ctx, ccml_mul(ctx, grad, tensor->src[0]), tensor->src[1]); break;
+            case CCML_OPER_NEG:
+                grads[0] = ccml_neg(ctx, grad); break;
+            case CCML_OPER_MAX: {
+                // ties go to the lhs, so exactly one side gets the gradient of every element
+                ccml_tensor * rhs_wins = ccml_cmplt(ctx, tensor->src[0], tensor->src[1]);
+                grads[0] = ccml_grad_reduce(ctx, ccml_where(ctx, rhs_wins, zero, grad), tensor->src[0]);
+                grads[1] = ccml_grad_reduce(ctx, ccml_where(ctx, rhs_wins, grad, zero), tensor->src[1]); break; }
+            case CCML_OPER_POW: {
+                ccml_tensor * base = tensor->src[0];
+                ccml_tensor * exponent = tensor->src[1];
+                ccml_tensor * power = ccml_pow(ctx, base, ccml_add(ctx, exponent, ccml_scalar(ctx, -1.0f)));
+                grads[0] = ccml_grad_reduce(ctx, ccml_mul(ctx, grad, ccml_mul(ctx, exponent, power)), base);
+                if (exponent->has_gradient) {
+                    ccml_tensor * partial = ccml_mul(ctx, tensor, ccml_log(ctx, base));
+                    grads[1] = ccml_grad_reduce(ctx, ccml_mul(ctx, grad, partial), exponent);
+                }
+                break; }
+            case CCML_OPER_WHERE:
+                grads[1] = ccml_grad_reduce(ctx, ccml_where(ctx, tensor->src[0], grad, zero), tensor->src[1]);
+                grads[2] = ccml_grad_reduce(ctx, ccml_where(ctx, tensor->src[0], zero, grad), tensor->src[2]); break;
+            case CCML_OPER_FMA:
+                grads[0] = ccml_grad_reduce(ctx, ccml_mul(ctx, grad, tensor->src[1]), tensor->src[0]);
+                grads[1] = ccml_grad_reduce(ctx, ccml_mul(ctx, grad, tensor->src[0]), tensor->src[1]);
+                grads[2] = ccml_grad_reduce(ctx, grad, tensor->src[2]); break;
+            case CCML_OPER_RMAX: {
+                // every element equal to the maximum of its row gets the gradient of the row
+                ccml_tensor * below = ccml_cmplt(ctx, tensor->src[0], graph->nodes[graph->table.partners[n]]);
+                grads[0] = ccml_where(ctx, below, zero, grad); break; }
+            case CCML_OPER_GATHER:
+                // every row read adds its gradient back into the row it was read from
+                grads[0] = ccml_scatter_add(ctx, grad, tensor->src[1], tensor->src[0]->shape[0]); break;
+            case CCML_OPER_SCATTER_ADD:
+                grads[0] = ccml_gather(ctx, grad, tensor->src[1]); break;
+            case CCML_OPER_VIEW: {
+                // concatenations and stacks pass the gradient of their destination on to the parts
+                // stored into it, each reads its region back through the strides it was stored with
+                grads[0] = ccml_grad_view(ctx, grad, tensor);
+                for (ccml_tensor * store = tensor->src[1]; store != NULL && store->oper == CCML_OPER_STORE;
+                     store = store->src[1]) {
+                    ccml_tensor * part = store->src[0];
+                    if (!part->has_gradient) continue;
+
+                    ccml_tensor * region = ccml_new_view(ctx, grads[0]);
+                    if (region == NULL) break;
+
+                    region->offset += store->offset;
+                    for (int i = 0; i < CCML_DIMS_MAX; i++) {
+                        region->shape[i]  = store->shape[i];
+                        region->stride[i] = store->stride[i];
+                    }
+                    part->grad = part->grad == NULL ? region : ccml_add(ctx, part->grad, region);
+                }
+                break; }
+            case CCML_OPER_RES:
+                grads[0] = ccml_reshape(ctx, grad, tensor->src[0]->shape); break;
+            case CCML_OPER_PER: {
+                // permutes keep the strides of their buffer, which is how the dims are matched back
+                int perm[CCML_DIMS_MAX] = {0};
+                bool used[CCML_DIMS_MAX] = {false};
+                for (int i = 0; i < CCML_DIMS_MAX; i++) {
+                    for (int j = 0; j < CCML_DIMS_MAX; j++) {
+                        ccml_tensor * src = tensor->src[0];
+                        if (used[j] || src->shape[j] != tensor->shape[i] || src->stride[j] != tensor->stride[i]) continue;
+                        used[j] = true;
+                        perm[j] = i;
+                        break;
+                    }
+                }
+                grads[0] = ccml_permute(ctx, grad, perm); break; }
+            case CCML_OPER_ATTN: {
+                ccml_tensor * srcs[CCML_SRCS_MAX] = {tensor->src[0], tensor->src[1], tensor->src[2],
+                                                     ccml_grad_attention(ctx, graph, tensor, grad)};
+                for (int i = 0; i < 3; i++) {
+                    if (!srcs[i]->has_gradient) continue;
+                    grads[i] = ccml_new_fused(ctx, CCML_OPER_ATTN_DQ + i, srcs[i]->shape, tensor->axis, srcs, 4);
+                }
+                break; }
+            case CCML_OPER_SOFTMAX: {
+                ccml_tensor * output = graph->nodes[graph->table.partners[n]];
+                ccml_tensor * dot = ccml_sum(ctx, ccml_mul(ctx, grad, output), 1, &tensor->axis);
+                grads[0] = ccml_mul(ctx, output, ccml_sub(ctx, grad, dot)); break; }
+            case CCML_OPER_LOG_SOFTMAX: {
+                ccml_tensor * output = graph->nodes[graph->table.partners[n]];
+                ccml_tensor * total = ccml_sum(ctx, grad, 1, &tensor->axis);
+                grads[0] = ccml_sub(ctx, grad, ccml_mul(ctx, ccml_exp(ctx, output), total)); break; }
+            case CCML_OPER_SOFTMAX_XENT: {
+                // the softmax minus the targets for the logits, the negated log-softmax for the targets
+                ccml_tensor * logits = tensor->src[0];
+                ccml_tensor * target = tensor->src[1];
+                ccml_tensor * total = ccml_sum(ctx, target, 1, &tensor->axis);
+                ccml_tensor * probs = ccml_mul(ctx, ccml_softmax(ctx, logits, tensor->axis), total);
+                grads[0] = ccml_mul(ctx, grad, ccml_sub(ctx, probs, target));
+                if (target->has_gradient) {
+                    grads[1] = ccml_mul(ctx, grad, ccml_neg(ctx, ccml_log_softmax(ctx, logits, tensor->axis)));
+                }
+                break; }
+            case CCML_OPER_SUM:
+            case CCML_OPER_INTR:
+            case CCML_OPER_SAVE:
+                grads[0] = tensor->grad; break;
+            default:
+                break;
+        }
+
+        for (int i = 0; i < CCML_SRCS_MAX; i++) {
+            ccml_tensor * src = tensor->src[i];
+            if (src == NULL || grads[i] == NULL || !src->has_gradient) continue;
+            src->grad = src->grad == NULL ? grads[i] : ccml_add(ctx, src->grad, grads[i]);
+        }
+    }
+
+    // gradients of the leaves are what gets read back, so they're computed into buffers
+    for (int n = 0; n < n_nodes && !ccml_context_failed(ctx); n++) {
+        ccml_tensor * tensor = graph->nodes[n];
+        uint8_t flags = graph->table.flags[n];
+        if (!(flags & CCML_FLAG_GRADIENT) || !(flags & CCML_FLAG_LEAF) || tensor->grad == NULL) continue;
+
+        ccml_tensor * grad = ccml_grad_expand(ctx, tensor->grad, tensor);
+        if (grad == NULL) break;
+
+        tensor->grad = ccml_has_buffer(grad) ? grad : ccml_sum(ctx, grad, 0, NULL);
+        if (tensor->grad == NULL) break;
+
+        ccml_graph_forward(graph, tensor->grad, &graph->n_nodes);
+    }
+}
+
+typedef struct ccml_touch {
+    ccml_graph * graph;
+    bool * fresh;
+} ccml_touch;
+
+CCML_API void ccml_touch_buffers_task(void * arg, int worker, int n_workers) {
+    // cpu kernels hand every worker the same contiguous share of their rows, touching that
+    // share of a buffer first puts it on the numa node of the worker computing it
+    ccml_touch * touch = arg;
+    for (int i = 0; i < touch->graph->n_nodes; i++) {
+        if (!touch->fresh[i]) continue;
+
+        ccml_tensor * tensor = touch->graph->nodes[i];
+        int start = (long)ccml_size(tensor) * worker / n_workers;
+        int finish = (long)ccml_size(tensor) * (worker + 1) / n_workers;
+        if (start < finish) memset(tensor->data + start, 0, (finish - start) * sizeof(float));
+    }
+}
+
+CCML_API void ccml_graph_allocate(ccml_context * ctx, ccml_graph * graph) {
+    bool fresh[CCML_NODE_MAX] = {false};
     for (int i = 0; i < graph->n_nodes; i++) {
         ccml_tensor * tensor = graph->nodes[i];
         int size = ccml_size(tensor);
         if (ccml_has_buffer(tensor) && tensor->data == NULL) {
-            tensor->data = ccml_malloc(ctx, size * sizeof(float));
+            tensor->data = ccml_malloc_aligned(ctx, size * sizeof(float), ctx->alignment);
+            if (tensor->data == NULL) return;
+            fresh[i] = true;
         }
-        if (ccml_has_buffer(tensor) && tensor->has_gradient == true) {
+        if (ccml_has_buffer(tensor) && tensor->has_gradient == true && tensor->grad == NULL && !graph->inference) {
             tensor->grad = ccml_new_tensor_impl(ctx, tensor->type, CCML_OPER_INTR, tensor->shape);
         }
     }
+
+    if (ctx->first_touch && ctx->pool != NULL) {
+        ccml_pool_run(ctx->pool, ccml_touch_buffers_task, &(ccml_touch) {.graph = graph, .fresh = fresh});
+    }
 }
 
-CCML_API ccml_graph * ccml_new_graph(ccml_context * ctx, ccml_tensor * root) {
-    ccml_tensor * save = ccml_new_tensor_impl(ctx, root->type, CCML_OPER_SAVE, root->shape);
-    save->src[0] = root;
+CCML_API void ccml_graph_trace(ccml_graph * graph, int n_roots, ccml_tensor ** roots) {
+    // the outputs are traced after all of the roots, so they all end up next to each other
+    // at the end of the forward pass and can be stored by the same kernel
+    graph->n_nodes = 0;
+    graph->map = ccml_new_hashmap(graph->context);
+    if (graph->map == NULL) return;
+
+    for (int i = 0; i < n_roots; i++) {
+        ccml_graph_forward(graph, roots[i], &graph->n_nodes);
+    }
+    for (int i = 0; i < n_roots; i++) {
+        ccml_graph_forward(graph, graph->outputs[i], &graph->n_nodes);
+    }
+}
+
+CCML_API void ccml_graph_contract(ccml_graph * graph) {
+    // a product only read by a sum is folded into it as a fused multiply-add, which rounds
+    // once and saves an instruction. training graphs keep them apart since the backward
+    // pass was already built from the product. only the table is rewritten, the tensors
+    // stay the ops they were built as for every other graph reading them
+    ccml_table * table = &graph->table;
+    int reads[CCML_NODE_MAX] = {0};
+    for (int i = 0; i < graph->n_nodes; i++) {
+        for (int j = 0; j < CCML_SRCS_MAX; j++) {
+            if (table->srcs[i][j] != -1) reads[table->srcs[i][j]]++;
+        }
+    }
+
+    bool removed[CCML_NODE_MAX] = {false};
+    for (int i = 0; i < graph->n_nodes; i++) {
+        if (table->opers[i] != CCML_OPER_ADD || table->srcs[i][1] == -1) continue;
+
+        for (int j = 0; j < 2; j++) {
+            int product = table->srcs[i][j];
+            if (table->opers[product] != CCML_OPER_MUL || reads[product] != 1) continue;
+
+            int addend = table->srcs[i][1 - j];
+            table->srcs[i][0] = table->srcs[product][0];
+            table->srcs[i][1] = table->srcs[product][1];
+            table->srcs[i][2] = addend;
+            table->opers[i]   = CCML_OPER_FMA;
+            removed[product]  = true;
+            break;
+        }
+    }
+
+    // the folded products leave the graph and the nodes after them move up, every row only
+    // moves towards the front so the table is compacted in place
+    int moved[CCML_NODE_MAX];
+    int n_nodes = 0;
+    for (int i = 0; i < graph->n_nodes; i++) {
+        moved[i] = removed[i] ? -1 : n_nodes++;
+    }
+    for (int i = 0; i < graph->n_nodes; i++) {
+        ccml_tensor * tensor = graph->nodes[i];
+        ccml_hashmap_set(graph->map, tensor, moved[i]);
+        if (removed[i]) continue;
+
+        ccml_table_move(table, table, i, moved[i], moved);
+        graph->nodes[moved[i]] = tensor;
+        tensor->index = moved[i];
+    }
+    graph->n_nodes = n_nodes;
+}
+
+CCML_API void ccml_graph_readonly(ccml_graph * graph) {
+    // inputs nothing in the graph stores into are never written by its kernels, so every
+    // graph instance built over the same weights can read them from the same place
+    ccml_table * table = &graph->table;
+    for (int i = 0; i < graph->n_nodes; i++) {
+        graph->readonly[i] = table->opers[i] == CCML_OPER_LOAD;
+    }
+    for (int i = 0; i < graph->n_nodes; i++) {
+        int destination = i;
+        while (table->opers[destination] == CCML_OPER_STORE) destination = table->srcs[destination][1];
+        graph->readonly[destination] &= destination == i;
+    }
+}
+
+CCML_API int ccml_src_order(ccml_table * table, int node, int order[CCML_SRCS_MAX]) {
+    // the sources a kernel computes for a node, the ones needing the most registers first so
+    // that fewer values are held while the others are computed (sethi-ullman order). the
+    // destination of a store and the table of a gather are only read from memory
+    int n_order = 0;
+    if (ccml_reads_buffer(table->opers[node])) return 0;
+
+    int n_srcs = table->opers[node] == CCML_OPER_STORE ? 1 : CCML_SRCS_MAX;
+    for (int j = table->opers[node] == CCML_OPER_GATHER; j < n_srcs; j++) {
+        int src = table->srcs[node][j];
+        if (src == -1) continue;
+
+        int k = n_order++;
+        for (; k > 0 && table->needs[order[k - 1]] < table->needs[src]; k--) order[k] = order[k - 1];
+        order[k] = src;
+    }
+
+    return n_order;
+}
+
+CCML_API int ccml_schedule_unit(ccml_table * table, int n_nodes, int node) {
+    // kernels end in reductions, fused ops and stores, which are scheduled as units along
+    // with the buffer written after them. the outputs are one unit, so they share a kernel
+    ccml_oper oper = table->opers[node];
+    if (ccml_is_reduce(oper) || ccml_is_fused(oper) || oper == CCML_OPER_STORE) return node;
+    if (oper == CCML_OPER_INTR && table->srcs[node][0] != -1) return table->srcs[node][0];
+    if (oper != CCML_OPER_SAVE) return -1;
+
+    while (node > 0 && table->opers[node - 1] == CCML_OPER_SAVE) node--;
+    return node < n_nodes ? node : -1;
+}
+
+CCML_API void ccml_schedule_reach(ccml_table * table, int * units, int node, bool * reached, bool * visited) {
+    // the units a kernel depends on are those it reaches through the values it recomputes
+    for (int j = 0; j < CCML_SRCS_MAX; j++) {
+        int src = table->srcs[node][j];
+        if (src == -1 || visited[src]) continue;
+
+        visited[src] = true;
+        if (units[src] != -1) {
+            reached[src] = true;
+        } else {
+            ccml_schedule_reach(table, units, src, reached, visited);
+        }
+    }
+}
+
+CCML_API void ccml_schedule_place(ccml_table * table, int * units, int node, bool * placed, int * order, int * n_order) {
+    // the values a unit recomputes are placed right before it, after their own sources
+    for (int j = 0; j < CCML_SRCS_MAX; j++) {
+        int src = table->srcs[node][j];
+        if (src == -1 || placed[src] || units[src] != -1) continue;
+
+        ccml_schedule_place(table, units, src, placed, order, n_order);
+        placed[src] = true;
+        order[(*n_order)++] = src;
+    }
+}
+
+CCML_API void ccml_graph_schedule(ccml_graph * graph) {
+    // tracing leaves nodes in depth-first order with the backward pass appended, which keeps
+    // buffers around for much longer than needed. units are reordered greedily: of the ones
+    // whose inputs are ready, the one growing the set of buffers still waiting for readers
+    // the least goes first, ties keep the traced order. only dependencies order units, the
+    // stores of a concatenation are chained through them too
+    ccml_context * ctx = graph->context;
+    ccml_table * table = &graph->table;
+    int n_nodes = graph->n_nodes;
+    int used = ctx->used;
+
+    int units[CCML_NODE_MAX];
+    int bytes[CCML_NODE_MAX];
+    int readers[CCML_NODE_MAX] = {0};
+    bool * reached = ccml_malloc(ctx, n_nodes * n_nodes * sizeof(bool));
+    if (reached == NULL) return;
+
+    memset(reached, 0, n_nodes * n_nodes * sizeof(bool));
+    for (int i = 0; i < n_nodes; i++) {
+        units[i] = ccml_schedule_unit(table, n_nodes, i);
+        bytes[i] = sizeof(float);
+        for (int j = 0; j < CCML_DIMS_MAX; j++) bytes[i] *= table->shapes[i][j];
+    }
+
+    // reached[u * n_nodes + n] says unit u reads node n, which belongs to another unit
+    for (int u = 0; u < n_nodes; u++) {
+        if (units[u] != u) continue;
+
+        bool visited[CCML_NODE_MAX] = {false};
+        for (int i = u; i < n_nodes && units[i] == u; i++) {
+            ccml_schedule_reach(table, units, i, &reached[u * n_nodes], visited);
+        }
+        for (int i = 0; i < n_nodes; i++) {
+            if (reached[u * n_nodes + i] && units[i] != u && table->opers[i] == CCML_OPER_INTR) readers[i]++;
+            if (units[i] == u) reached[u * n_nodes + i] = false;
+        }
+    }
+
+    int order[CCML_NODE_MAX];
+    int n_order = 0;
+    bool placed[CCML_NODE_MAX] = {false};
+    while (true) {
+        int best = -1;
+        int best_growth = 0;
+        for (int u = 0; u < n_nodes; u++) {
+            if (units[u] != u || placed[u]) continue;
+
+            bool ready = true;
+            int growth = 0;
+            for (int i = 0; i < n_nodes && ready; i++) {
+                if (!reached[u * n_nodes + i]) continue;
+                ready = placed[units[i]];
+                if (table->opers[i] == CCML_OPER_INTR && readers[i] == 1) growth -= bytes[i];
+            }
+            if (u + 1 < n_nodes && units[u + 1] == u && table->opers[u + 1] == CCML_OPER_INTR && readers[u + 1] > 0) {
+                growth += bytes[u + 1];
+            }
+
+            if (ready && (best == -1 || growth < best_growth)) {
+                best = u;
+                best_growth = growth;
+            }
+        }
+        if (best == -1) break;
+
+        int finish = best;
+        while (finish < n_nodes && units[finish] == best) finish++;
+        for (int i = best; i < finish; i++) {
+            ccml_schedule_place(table, units, i, placed, order, &n_order);
+        }
+        for (int i = best; i < finish; i++) {
+            placed[i] = true;
+            order[n_order++] = i;
+        }
+        for (int i = 0; i < n_nodes; i++) {
+            if (reached[best * n_nodes + i] && table->opers[i] == CCML_OPER_INTR) readers[i]--;
+        }
+    }
+
+    // whatever no kernel depends on keeps its place at the end
+    for (int i = 0; i < n_nodes; i++) {
+        if (!placed[i]) order[n_order++] = i;
+    }
+    CCML_ASSERT(n_order == n_nodes, "every node is scheduled once");
+    ctx->used = used;
+
+    // the rows are permuted rather than set again from the tensors, which may not be the
+    // ops the table holds any more, see ccml_graph_contract
+    int moved[CCML_NODE_MAX];
+    for (int i = 0; i < n_nodes; i++) {
+        moved[order[i]] = i;
+    }
+
+    ccml_table from = *table;
+    ccml_tensor * nodes[CCML_NODE_MAX];
+    memcpy(nodes, graph->nodes, n_nodes * sizeof(ccml_tensor *));
+    for (int i = 0; i < n_nodes; i++) {
+        ccml_table_move(table, &from, order[i], i, moved);
+        graph->nodes[i] = nodes[order[i]];
+        graph->nodes[i]->index = i;
+        ccml_hashmap_set(graph->map, graph->nodes[i], i);
+    }
+
+    // needs are counted in registers over the values a kernel computes, a source read from
+    // memory takes one, an op takes the most of its sources, each one counted in order on
+    // top of the ones held before it (nodes come after their sources, so those are known)
+    for (int i = 0; i < n_nodes; i++) {
+        int srcs[CCML_SRCS_MAX];
+        int n_srcs = ccml_src_order(table, i, srcs);
+        int needs = 1;
+        for (int j = 0; j < n_srcs; j++) {
+            if (table->needs[srcs[j]] + j > needs) needs = table->needs[srcs[j]] + j;
+        }
+        table->needs[i] = needs < UINT8_MAX ? needs : UINT8_MAX;
+    }
+}
+
+CCML_API ccml_graph * ccml_new_graph_options(ccml_context * ctx, int n_roots, ccml_tensor ** roots,
+                                             ccml_tensor ** seeds, ccml_graph_options options) {
+    // every root is saved into its own output, seeds (either array or any of its entries can be
+    // NULL) are the gradients the roots start the backward pass from. all roots are traced into
+    // one graph, so whatever they share is only computed once per execution. graphs over an
+    // arena that ran out are NULL, the status of the context says why
+    if (ccml_context_failed(ctx)) return NULL;
+    CCML_ASSERT(n_roots >= 1 && n_roots <= CCML_OUTPUT_MAX, "invalid number of outputs");
     struct ccml_graph * graph = ccml_malloc(ctx, sizeof(struct ccml_graph));
+    if (graph == NULL) return NULL;
 
     *graph = (struct ccml_graph) {
-        .n_nodes = 0,
-        .nodes   = {NULL},
-        .map     = ccml_new_hashmap(ctx),
-        .context = ctx
+        .n_nodes       = 0,
+        .nodes         = {NULL},
+        .context       = ctx,
+        .profile       = {.origin = ccml_profile_time()},
+        .n_outputs     = n_roots,
+        .inference     = options.inference,
+        .async_compile = options.async_compile,
+        .on_ready      = options.on_ready,
+        .user          = options.user,
+        .accuracy      = options.accuracy,
+        .backend       = NULL
     };
 
-    ccml_graph_forward(graph, save, &graph->n_nodes);
-    ccml_graph_backward(ctx, graph, root);
+    for (int i = 0; i < n_roots; i++) {
+        graph->outputs[i] = ccml_new_tensor_impl(ctx, roots[i]->type, CCML_OPER_SAVE, roots[i]->shape);
+        if (graph->outputs[i] == NULL) return NULL;
+        graph->outputs[i]->src[0] = roots[i];
+    }
+
+    double start = ccml_profile_time();
+    ccml_graph_trace(graph, n_roots, roots);
+    if (graph->inference) ccml_graph_contract(graph);
+    ccml_profile_phase(&graph->profile, CCML_PHASE_TRACE, 0, start);
+
+    start = ccml_profile_time();
+    if (!graph->inference) ccml_graph_backward(ctx, graph, n_roots, roots, seeds);
+    ccml_profile_phase(&graph->profile, CCML_PHASE_BACKWARD, 0, start);
+    if (ccml_context_failed(ctx)) return NULL;
+
+    start = ccml_profile_time();
+    ccml_graph_schedule(graph);
+    ccml_profile_phase(&graph->profile, CCML_PHASE_SCHEDULE, 0, start);
+    if (graph->inference) ccml_graph_readonly(graph);
 
     for (int i = 0; i < graph->n_nodes; i++) {
         if (graph->nodes[i]->oper == CCML_OPER_LOAD && graph->nodes[i]->data == NULL) {
@@ -725,11 +2654,100 @@ CCML_API ccml_graph * ccml_new_graph(ccml_context * ctx, ccml_tensor * root) {
         }
     }
 
+    start = ccml_profile_time();
     ccml_graph_allocate(ctx, graph);
+    ccml_profile_phase(&graph->profile, CCML_PHASE_ALLOCATE, 0, start);
+    if (ccml_context_failed(ctx)) return NULL;
+
+    // nothing has been computed yet, so the first execution runs every kernel
+    for (int i = 0; i < CCML_NODE_MAX; i++) {
+        graph->versions[i] = -1;
+    }
+
+    for (int i = 0; i < graph->n_nodes; i++) {
+        graph->profile.flops[i] = ccml_node_flops(&graph->table, i);
+        graph->profile.bytes[i] = ccml_node_bytes(&graph->table, i);
+    }
+    graph->profile.n_built = graph->profile.n_events;
 
     return graph;
 };
 
+CCML_API ccml_graph * ccml_new_graph_outputs(ccml_context * ctx, int n_roots, ccml_tensor ** roots,
+                                             ccml_tensor ** seeds) {
+    return ccml_new_graph_options(ctx, n_roots, roots, seeds, (ccml_graph_options) {0});
+}
+
+CCML_API ccml_graph * ccml_new_graph(ccml_context * ctx, ccml_tensor * root) {
+    return ccml_new_graph_outputs(ctx, 1, &root, (ccml_tensor *[]){ccml_scalar(ctx, 1.0f)});
+}
+
+CCML_API ccml_graph * ccml_new_inference_graph(ccml_context * ctx, ccml_tensor * root) {
+    return ccml_new_graph_options(ctx, 1, &root, NULL, (ccml_graph_options) {.inference = true});
+}
+
+CCML_API ccml_tensor * ccml_graph_output_at(ccml_graph * graph, int index) {
+    CCML_ASSERT(index >= 0 && index < graph->n_outputs, "output index out of range");
+    return graph->outputs[index];
+}
+
+CCML_API ccml_tensor * ccml_graph_output(ccml_graph * graph) {
+    return ccml_graph_output_at(graph, 0);
+}
+
+CCML_API int ccml_bucket(int size) {
+    // buckets step through the powers of two and the midpoints between them, so a handful
+    // of compiled variants covers any size while padding at most a third of the rows
+    int bucket = 1;
+    while (bucket < size) {
+        if (bucket >= 2 && bucket + bucket / 2 >= size) return bucket + bucket / 2;
+        bucket *= 2;
+    }
+
+    return bucket;
+}
+
+CCML_API void ccml_graph_set_rows(ccml_graph * graph, int rows) {
+    // the leading dim can run short of the size the graph was traced with (usually a bucket),
+    // kernels then take the live row count as an argument and serve every count below it.
+    // that only holds when dim 0 is the outermost dim of every tensor that spans it
+    ccml_table * table = &graph->table;
+    int capacity = 1;
+    for (int i = 0; i < graph->n_nodes; i++) {
+        if (table->shapes[i][0] > capacity) capacity = table->shapes[i][0];
+    }
+    CCML_ASSERT(rows >= 1 && rows <= capacity, "row count outside of the traced leading dimension");
+
+    for (int i = 0; i < graph->n_nodes; i++) {
+        int * shape = table->shapes[i];
+        int * stride = table->strides[i];
+        if (shape[0] == 1) continue;
+
+        CCML_ASSERT(shape[0] == capacity, "leading dimension has to be either the rows or broadcasted");
+        for (int j = 1; j < CCML_DIMS_MAX; j++) {
+            CCML_ASSERT(shape[j] == 1 || stride[0] >= stride[j] * shape[j], "leading dimension has to be the outermost one");
+        }
+    }
+
+    // a full batch goes through the kernels specialised for the traced shape, any change
+    // between the two means every kernel has to run again
+    int live = rows == capacity ? 0 : rows;
+
+    // fused ops loop over their axis (attention over the keys, one dim before it) with the
+    // traced size, short batches would mix the padded rows into every live one
+    for (int i = 0; live != 0 && i < graph->n_nodes; i++) {
+        if (!ccml_is_fused(table->opers[i]) || table->shapes[i][0] == 1) continue;
+
+        int axis = table->axes[i];
+        bool keys = table->opers[i] >= CCML_OPER_ATTN && table->opers[i] <= CCML_OPER_ATTN_DV;
+        CCML_ASSERT((keys ? axis - 1 : axis) != 0, "fused ops can't run short along the dim they loop over");
+    }
+    for (int i = 0; live != graph->rows && i < CCML_NODE_MAX; i++) {
+        graph->versions[i] = -1;
+    }
+    graph->rows = live;
+}
+
 //
 //  ██╗███╗   ██╗██████╗ ███████╗██╗  ██╗██╗███╗   ██╗ ██████╗
 //  ██║████╗  ██║██╔══██╗██╔════╝╚██╗██╔╝██║████╗  ██║██╔════╝
@@ -739,542 +2757,3522 @@ CCML_API ccml_graph * ccml_new_graph(ccml_context * ctx, ccml_tensor * root) {
 //  ╚═╝╚═╝  ╚═══╝╚═════╝ ╚══════╝╚═╝  ╚═╝╚═╝╚═╝  ╚═══╝ ╚═════╝
 //
 
-CCML_API const char * ccml_new_index(ccml_context * ctx, ccml_tensor * parent, ccml_tensor * child) {
-    int size = CCML_CHAR_MAX;
-    char * index = ccml_malloc(ctx, size * sizeof(char));
-    *index = '\0';
-    strncat(index, "[", size);
+typedef struct ccml_index {
+    int stride[CCML_DIMS_MAX];
+    int offset;
+} ccml_index;
 
-    for (int i = 0; i < ccml_dim(child); i++) {
-        // fake dimension is a virtually broadcasted dimension (without actually duplicating/expanding it)
-        bool dim_is_fake = false;
-        if (parent != NULL) {
-            dim_is_fake = parent->shape[i] == 1 && child->shape[i] != 1;
-        }
+CCML_API ccml_index ccml_new_index(ccml_table * table, int node) {
+    ccml_index index = {.offset = table->offsets[node]};
 
-        snprintf(index + strlen(index), size - strlen(index), "%sid%d*%d*%d",
-                 i != 0 && i != ccml_dim(child) ? "+" : "", i, child->stride[i],
-                 dim_is_fake ? 0 : 1);
+    // size one dims always index the first element, which is how values broadcast
+    for (int i = 0; i < CCML_DIMS_MAX; i++) {
+        index.stride[i] = table->shapes[node][i] == 1 ? 0 : table->strides[node][i];
     }
 
-    strncat(index + strlen(index), "]", size - strlen(index));
-
     return index;
 }
 
 CCML_API void ccml_new_kernel_slice(ccml_graph * graph, int * n_kernels,
                                     int kernels[CCML_KERN_MAX][2]) {
-    kernels[*n_kernels][0] = 0;
-    // not sure yet what's the optimal strategy for kernel slicing,
-    // therefore for now everything is fused into a single kernel
-    kernels[*n_kernels][1] = graph->n_nodes;
-    *n_kernels += 1;
+    // everything is fused except for reductions, a sum ends its kernel so that the
+    // intermediary reading it back starts the next one once the sum is complete.
+    // outputs share a kernel as long as their shapes broadcast against each other.
+    // fused ops are lowered on their own, so stores coming before one end a kernel too
+    ccml_table * table = &graph->table;
+    int start = 0;
+    for (int i = 0; i < graph->n_nodes; i++) {
+        ccml_oper oper = table->opers[i];
+        bool pending = false;
+        for (int j = start; ccml_is_fused(oper) && j < i; j++) {
+            pending |= table->opers[j] == CCML_OPER_SAVE || table->opers[j] == CCML_OPER_STORE;
+        }
+        if (pending) {
+            CCML_ASSERT(*n_kernels < CCML_KERN_MAX, "more kernels created than CCML_KERN_MAX");
+            kernels[*n_kernels][0] = start;
+            kernels[*n_kernels][1] = i;
+            *n_kernels += 1;
+            start = i;
+        }
+        bool stores = ccml_is_reduce(oper) || oper == CCML_OPER_STORE || ccml_is_fused(oper);
+        bool cut = stores && i + 1 < graph->n_nodes;
+        bool outputs = oper == CCML_OPER_SAVE && i + 1 < graph->n_nodes && table->opers[i + 1] == CCML_OPER_SAVE;
+        for (int j = start; outputs && j <= i; j++) {
+            for (int k = 0; table->opers[j] == CCML_OPER_SAVE && k < CCML_DIMS_MAX; k++) {
+                int lhs = table->shapes[j][k];
+                int rhs = table->shapes[i + 1][k];
+                if (lhs != rhs && lhs != 1 && rhs != 1) cut = true;
+            }
+        }
+        if (cut || i + 1 == graph->n_nodes) {
+            CCML_ASSERT(*n_kernels < CCML_KERN_MAX, "more kernels created than CCML_KERN_MAX");
+            kernels[*n_kernels][0] = start;
+            kernels[*n_kernels][1] = i + 1;
+            *n_kernels += 1;
+            start = i + 1;
+        }
+    }
 }
 
 //
-//  ██████╗  █████╗  ██████╗██╗  ██╗███████╗███╗   ██╗██████╗
-//  ██╔══██╗██╔══██╗██╔════╝██║ ██╔╝██╔════╝████╗  ██║██╔══██╗
-//  ██████╔╝███████║██║     █████╔╝ █████╗  ██╔██╗ ██║██║  ██║
-//  ██╔══██╗██╔══██║██║     ██╔═██╗ ██╔══╝  ██║╚██╗██║██║  ██║
-//  ██████╔╝██║  ██║╚██████╗██║  ██╗███████╗██║ ╚████║██████╔╝
-//  ╚═════╝ ╚═╝  ╚═╝ ╚═════╝╚═╝  ╚═╝╚══════╝╚═╝  ╚═══╝╚═════╝
-//
-//  ███╗   ███╗███████╗████████╗ █████╗ ██╗
-//  ████╗ ████║██╔════╝╚══██╔══╝██╔══██╗██║
-//  ██╔████╔██║█████╗     ██║   ███████║██║
-//  ██║╚██╔╝██║██╔══╝     ██║   ██╔══██║██║
-//  ██║ ╚═╝ ██║███████╗   ██║   ██║  ██║███████╗
-//  ╚═╝     ╚═╝╚══════╝   ╚═╝   ╚═╝  ╚═╝╚══════╝
+//   ██████╗ ██████╗ ██████╗ ███████╗ ██████╗ ███████╗███╗   ██╗
+//  ██╔════╝██╔═══██╗██╔══██╗██╔════╝██╔════╝ ██╔════╝████╗  ██║
+//  ██║     ██║   ██║██║  ██║█████╗  ██║  ███╗█████╗  ██╔██╗ ██║
+//  ██║     ██║   ██║██║  ██║██╔══╝  ██║   ██║██╔══╝  ██║╚██╗██║
+//  ╚██████╗╚██████╔╝██████╔╝███████╗╚██████╔╝███████╗██║ ╚████║
+//   ╚═════╝ ╚═════╝ ╚═════╝ ╚══════╝ ╚═════╝ ╚══════╝╚═╝  ╚═══╝
 //
 
-#if defined(CCML_BACKEND_METAL)
+// the intermediate representation is a flat list of ops over typed SSA temporaries,
+// one per graph node, every backend lowers the same ir and only differs in the dialect
+// it's printed in, so adding a backend doesn't mean writing another emitter
+
+typedef enum ccml_dialect {
+    CCML_DIALECT_METAL,
+    CCML_DIALECT_OPENCL,
+    CCML_DIALECT_C
+} ccml_dialect;
+
+typedef struct ccml_ir_op {
+    ccml_oper oper;
+    ccml_type type;
+    int dst;
+    int src[CCML_SRCS_MAX];
+    int buffer;
+    ccml_index index;
+    int shape[CCML_DIMS_MAX];
+    int axis;
+    int pitch; // distance between the rows gathers and scatter-adds pick by index
+} ccml_ir_op;
+
+typedef enum ccml_shard {
+    CCML_SHARD_SPLIT,
+    CCML_SHARD_COPY,
+    CCML_SHARD_REDUCE,
+    CCML_SHARD_MAX
+} ccml_shard;
+
+typedef struct ccml_ir {
+    int n_kernel;
+    int start;
+    int finish;
+    int n_ops;
+    ccml_ir_op * ops;
+    int n_buffers;
+    int buffers[CCML_NODE_MAX];
+    ccml_type types[CCML_NODE_MAX];
+    int grid[CCML_DIMS_MAX];
+    int threads[3];
+    int width;
+    int n_shards;
+    ccml_shard shards[CCML_NODE_MAX];
+    bool uses_id[CCML_DIMS_MAX];
+    int rows;
+    ccml_accuracy accuracy;
+} ccml_ir;
+
+CCML_API bool ccml_is_pow2(int value) {
+    return value > 0 && (value & (value - 1)) == 0;
+}
 
-#import <Foundation/Foundation.h>
-#import <Metal/Metal.h>
+CCML_API int ccml_log2(int value) {
+    int result = 0;
+    while (value >>= 1) result++;
+    return result;
+}
 
-// wrapping in an ifdef block since metal backend is written in objective-C
+// a flat grid only spans the first two dims, which are the ones gid is decoded into
+CCML_API bool ccml_grid_is_flat(ccml_ir * ir) {
+    for (int i = 2; i < CCML_DIMS_MAX; i++) {
+        if (ir->grid[i] != 1) return false;
+    }
 
-CCML_API const char * ccml_oper_metal(ccml_tensor * tensor) {
-    switch (tensor->oper) {
-        case CCML_OPER_LOG: return "log";
-        case CCML_OPER_EXP: return "exp";
-        case CCML_OPER_SIN: return "sin";
-        case CCML_OPER_REC: return "1/";
-        case CCML_OPER_SQT: return "sqrt";
-        case CCML_OPER_ADD: return "+";
-        case CCML_OPER_MUL: return "*";
-        default: CCML_ASSERT(false, "no meaningful conversion to string exists");
+    return true;
+}
+
+// an access is linear when it walks the thread grid in order, so gid can index it directly
+CCML_API bool ccml_index_is_linear(ccml_ir * ir, ccml_index * index) {
+    return ccml_grid_is_flat(ir) && index->stride[1] == (ir->grid[1] == 1 ? 0 : 1) &&
+           index->stride[0] == (ir->grid[0] == 1 ? 0 : ir->grid[1]);
+}
+
+CCML_API bool ccml_index_is_scalar(ccml_index * index) {
+    for (int i = 0; i < CCML_DIMS_MAX; i++) {
+        if (index->stride[i] != 0) return false;
+    }
+
+    return true;
+}
+
+CCML_API ccml_ir_op * ccml_ir_fused(ccml_ir * ir) {
+    for (int i = 0; i < ir->n_ops; i++) {
+        if (ccml_is_fused(ir->ops[i].oper)) return &ir->ops[i];
+    }
+
+    return NULL;
+}
+
+CCML_API bool ccml_ir_op_is_indexed(ccml_ir_op * op) {
+    // random values are addressed by element like buffers are
+    return op->buffer != -1 || ccml_is_random(op->oper);
+}
+
+CCML_API void ccml_ir_find_ids(ccml_ir * ir) {
+    // fused ops address everything through the ids of the row they run for
+    bool fused = ccml_ir_fused(ir) != NULL;
+    for (int i = 0; i < CCML_DIMS_MAX; i++) {
+        ir->uses_id[i] = fused && ir->grid[i] != 1;
+    }
+    if (fused) return;
+
+    for (int i = 0; i < ir->n_ops; i++) {
+        ccml_ir_op * op = &ir->ops[i];
+        for (int j = 0; ccml_ir_op_is_indexed(op) && !ccml_index_is_linear(ir, &op->index) && j < CCML_DIMS_MAX; j++) {
+            if (op->index.stride[j] != 0) ir->uses_id[j] = true;
+        }
+    }
+}
+
+CCML_API void ccml_ir_push(ccml_ir * ir, ccml_graph * graph, int node, int * emitted) {
+    // emitted holds the op computing the value of every node pushed so far, nodes are handles
+    // into this graph, so tensors like weights can be traced by several graphs at once
+    if (emitted[node] != -1) return;
+    ccml_table * table = &graph->table;
+    ccml_oper oper = table->opers[node];
+
+    // only buffers carry over between kernels, values computed by an earlier kernel
+    // are recomputed here from the buffers they came from. the destination of a store
+    // is only where its value goes, it isn't computed by the kernel
+    int order[CCML_SRCS_MAX];
+    int n_order = ccml_src_order(table, node, order);
+    for (int j = 0; j < n_order; j++) {
+        ccml_ir_push(ir, graph, order[j], emitted);
+    }
+
+    ccml_ir_op * op = &ir->ops[ir->n_ops++];
+    *op = (ccml_ir_op) {
+        .oper   = oper,
+        .type   = table->types[node],
+        .dst    = node,
+        .buffer = -1,
+        .index  = ccml_new_index(table, node),
+        .axis   = table->axes[node]
+    };
+
+    for (int j = 0; j < CCML_SRCS_MAX; j++) {
+        int src = table->srcs[node][j];
+        op->src[j] = src != -1 && emitted[src] != -1 ? emitted[src] : src;
+    }
+    for (int j = 0; j < CCML_DIMS_MAX; j++) {
+        op->shape[j] = table->shapes[node][j];
+    }
+
+    int destination = table->srcs[node][1];
+    switch (oper) {
+        case CCML_OPER_SUM:
+        case CCML_OPER_RMAX:
+            // sums accumulate straight into the buffer of the intermediary that follows them
+            // and are addressed with the strides of the result, reduced dims collapse onto one element
+            op->buffer = table->partners[node];
+            op->index  = ccml_new_index(table, node);
+            break;
+        case CCML_OPER_ATTN:
+        case CCML_OPER_ATTN_LSE:
+        case CCML_OPER_ATTN_DQ:
+        case CCML_OPER_ATTN_DK:
+        case CCML_OPER_ATTN_DV:
+        case CCML_OPER_SOFTMAX:
+        case CCML_OPER_LOG_SOFTMAX:
+        case CCML_OPER_SOFTMAX_XENT:
+            op->buffer = table->partners[node];
+            break;
+        case CCML_OPER_SCATTER_ADD:
+            // scatter-adds go over their values, the row of every one of them is its index
+            op->buffer = table->partners[node];
+            op->pitch  = table->strides[node][0];
+            op->index.stride[0] = 0;
+            for (int j = 0; j < CCML_DIMS_MAX; j++) {
+                op->shape[j] = table->shapes[table->srcs[node][0]][j];
+            }
+            break;
+        case CCML_OPER_GATHER: {
+            // gathers read the table buffer directly, along the rows of their indices
+            int source = table->srcs[node][0];
+            op->buffer = source;
+            op->src[0] = -1;
+            op->pitch  = table->strides[source][0];
+            op->index  = ccml_new_index(table, source);
+            op->index.stride[0] = 0;
+            break; }
+        case CCML_OPER_VIEW:
+            // views read the buffer they were taken from, the rest is only there for ordering
+            op->buffer = op->src[0];
+            op->src[1] = -1;
+            break;
+        case CCML_OPER_STORE:
+            while (table->opers[destination] == CCML_OPER_STORE) destination = table->srcs[destination][1];
+            op->buffer = destination;
+            op->src[1] = -1;
+            break;
+        case CCML_OPER_RES:
+        case CCML_OPER_PER:
+        case CCML_OPER_LOAD:
+        case CCML_OPER_INTR:
+        case CCML_OPER_SAVE:
+            op->buffer = node;
+            break;
+        default:
+            break;
+    }
+
+    // elementwise ops of the same values compute the same value, which happens a lot
+    // with backward passes recomputing the values of the forward pass
+    for (int i = 0; op->buffer == -1 && i < ir->n_ops - 1; i++) {
+        ccml_ir_op * other = &ir->ops[i];
+        if (other->oper != oper || other->buffer != -1 || other->axis != op->axis) continue;
+        if (memcmp(other->src, op->src, sizeof(op->src)) != 0) continue;
+        if (memcmp(&other->index, &op->index, sizeof(op->index)) != 0) continue;
+
+        emitted[node] = other->dst;
+        ir->n_ops--;
+        return;
+    }
+    emitted[node] = node;
+
+    for (int j = 0; j < CCML_DIMS_MAX; j++) {
+        if (ir->grid[j] < op->shape[j]) ir->grid[j] = op->shape[j];
+    }
+}
+
+CCML_API void ccml_ir_collapse(ccml_ir * ir) {
+    // adjacent dims that every buffer walks contiguously (or that are unit dims) are merged
+    // into one, so most kernels end up flat no matter how many dims their tensors have.
+    // the leading dim is left alone since rows and shards are both defined over it
+    for (int i = 1; i < CCML_DIMS_MAX - 1;) {
+        bool mergeable = ir->grid[i] == 1 || ir->grid[i + 1] == 1;
+        for (int j = 0; !mergeable && j < ir->n_ops; j++) {
+            ccml_index * index = &ir->ops[j].index;
+            if (ccml_ir_op_is_indexed(&ir->ops[j]) && index->stride[i] != index->stride[i + 1] * ir->grid[i + 1]) break;
+            if (j + 1 == ir->n_ops) mergeable = true;
+        }
+
+        bool padding = true;
+        for (int j = i + 1; j < CCML_DIMS_MAX; j++) {
+            if (ir->grid[j] != 1) padding = false;
+        }
+
+        if (!mergeable || padding) {
+            i++;
+            continue;
+        }
+
+        for (int j = 0; j < ir->n_ops; j++) {
+            int * stride = ir->ops[j].index.stride;
+            stride[i] = ir->grid[i + 1] == 1 ? stride[i] : stride[i + 1];
+            for (int k = i + 1; k < CCML_DIMS_MAX - 1; k++) stride[k] = stride[k + 1];
+            stride[CCML_DIMS_MAX - 1] = 0;
+        }
+
+        ir->grid[i] *= ir->grid[i + 1];
+        for (int k = i + 1; k < CCML_DIMS_MAX - 1; k++) ir->grid[k] = ir->grid[k + 1];
+        ir->grid[CCML_DIMS_MAX - 1] = 1;
+    }
+}
+
+CCML_API ccml_ir * ccml_new_ir(ccml_context * ctx, ccml_graph * graph,
+                               int n_kernel, int start, int finish) {
+    ccml_ir * ir = ccml_malloc(ctx, sizeof(ccml_ir));
+    ccml_ir_op * ops = ccml_malloc(ctx, graph->n_nodes * sizeof(ccml_ir_op));
+    if (ops == NULL) return NULL;
+
+    *ir = (ccml_ir) {
+        .n_kernel  = n_kernel,
+        .start     = start,
+        .finish    = finish,
+        .n_ops     = 0,
+        .ops       = ops,
+        .n_buffers = 0,
+        .width     = 1,
+        .n_shards  = 1,
+        .accuracy  = graph->accuracy
+    };
+
+    for (int i = 0; i < CCML_DIMS_MAX; i++) {
+        ir->grid[i] = 1;
+    }
+
+    // kernel parameters are all the buffers of the graph
+    for (int i = 0; i < graph->n_nodes; i++) {
+        if (graph->table.flags[i] & CCML_FLAG_BUFFER) {
+            ir->types[ir->n_buffers] = graph->table.types[i];
+            ir->buffers[ir->n_buffers++] = i;
+        }
+    }
+
+    // kernels are pulled from the nodes writing to buffers, so whatever they don't depend on
+    // (like the other parts of a concatenation) stays out of both the kernel and its grid
+    int emitted[CCML_NODE_MAX];
+    for (int i = 0; i < graph->n_nodes; i++) {
+        emitted[i] = -1;
+    }
+    for (int i = start; i < finish; i++) {
+        ccml_oper oper = graph->table.opers[i];
+        if (ccml_is_reduce(oper) || oper == CCML_OPER_STORE || oper == CCML_OPER_SAVE || ccml_is_fused(oper)) {
+            ccml_ir_push(ir, graph, i, emitted);
+        }
+    }
+
+    // fused ops run a thread per row of their result, their sources are only read in loops.
+    // they always go over every row, since the rows they loop over could be short too
+    ccml_ir_op * fused = ccml_ir_fused(ir);
+    for (int i = 0; fused != NULL && i < CCML_DIMS_MAX; i++) {
+        ir->grid[i] = i == fused->axis ? 1 : fused->shape[i];
+    }
+
+    // kernels spanning the leading dim of a graph running short only go over the live rows
+    if (graph->rows != 0 && ir->grid[0] != 1 && fused == NULL) ir->rows = graph->rows;
+
+    if (fused == NULL) ccml_ir_collapse(ir);
+
+    // whatever is left past the third dim is folded into the last dispatch dim
+    ir->threads[0] = (ir->rows != 0 ? ir->rows : ir->grid[0]) * ir->grid[1];
+    ir->threads[1] = ir->grid[2];
+    ir->threads[2] = 1;
+    for (int i = 3; i < CCML_DIMS_MAX; i++) {
+        ir->threads[2] *= ir->grid[i];
+    }
+
+    ccml_ir_find_ids(ir);
+
+    return ir;
+}
+
+CCML_API bool ccml_ir_shard(ccml_ir * ir, ccml_graph * graph, int n_shards) {
+    // data parallelism splits the leading dim, buffers spanning it are split between
+    // shards, the ones broadcasted along it and the tables gathers pick rows from are copied,
+    // and the ones a sum, max or scatter-add reduces it into hold partial results that are
+    // added up or maxed on the host before anything else reads them. buffers the kernel
+    // doesn't touch are left out, they're only parameters. kernels run whole on the first
+    // device when they reshape or store, when a buffer has another leading dim, and when
+    // they hold fused ops or random values, which is logged since it's the kernel as a whole
+    if (n_shards <= 1 || ir->rows != 0 || ir->grid[0] % n_shards != 0) return false;
+
+    bool touched[CCML_NODE_MAX] = {false};
+    bool copied[CCML_NODE_MAX] = {false};
+    bool scattered[CCML_NODE_MAX] = {false};
+    const char * reason = NULL;
+    for (int i = 0; i < ir->n_ops; i++) {
+        ccml_ir_op * op = &ir->ops[i];
+        if (op->buffer != -1) touched[op->buffer] = true;
+        if (op->oper == CCML_OPER_GATHER) copied[op->buffer] = true;
+        if (op->oper == CCML_OPER_SCATTER_ADD) scattered[op->buffer] = true;
+
+        if (op->oper == CCML_OPER_RES || op->oper == CCML_OPER_PER) return false;
+        if (op->oper == CCML_OPER_VIEW || op->oper == CCML_OPER_STORE) return false;
+        // a thread walks a whole row of a fused op, random values are keyed by the index
+        // of the element in the whole tensor
+        if (ccml_is_fused(op->oper)) reason = "fused ops aren't split";
+        if (ccml_is_random(op->oper)) reason = "random values aren't split";
+    }
+    if (reason != NULL) {
+        ccml_message(CCML_LOG_WARN, "kernel %d runs on one of %d devices, %s", ir->n_kernel, n_shards, reason);
+        return false;
+    }
+
+    for (int i = 0; i < ir->n_buffers; i++) {
+        int buffer = ir->buffers[i];
+        int rows = graph->table.shapes[buffer][0];
+        if (!touched[buffer] || scattered[buffer]) continue;
+        if (!copied[buffer] && rows != 1 && rows != ir->grid[0]) return false;
+        ir->shards[buffer] = copied[buffer] || rows == 1 ? CCML_SHARD_COPY : CCML_SHARD_SPLIT;
+    }
+
+    // partial results can only be stored as they are, anything else would need them whole.
+    // scatter-adds are partial whatever they reduce, their rows come from the indices
+    ccml_shard partial[CCML_NODE_MAX] = {CCML_SHARD_SPLIT};
+    for (int i = 0; i < ir->n_ops; i++) {
+        ccml_ir_op * op = &ir->ops[i];
+        ccml_shard reads = CCML_SHARD_SPLIT;
+        for (int j = 0; j < CCML_SRCS_MAX; j++) {
+            if (op->src[j] != -1 && partial[op->src[j]] != CCML_SHARD_SPLIT) reads = partial[op->src[j]];
+        }
+
+        bool reduces = op->oper == CCML_OPER_SUM || op->oper == CCML_OPER_RMAX;
+        if (reads != CCML_SHARD_SPLIT && op->oper != CCML_OPER_INTR && op->oper != CCML_OPER_SAVE) {
+            return false;
+        } else if ((reduces && op->index.stride[0] == 0) || op->oper == CCML_OPER_SCATTER_ADD) {
+            partial[op->dst] = op->oper == CCML_OPER_RMAX ? CCML_SHARD_MAX : CCML_SHARD_REDUCE;
+            ir->shards[op->buffer] = partial[op->dst];
+        } else if (reads != CCML_SHARD_SPLIT) {
+            partial[op->dst] = reads;
+            ir->shards[op->buffer] = reads;
+        }
+    }
+
+    ir->n_shards = n_shards;
+    ir->grid[0] /= n_shards;
+    ir->threads[0] = ir->grid[0] * ir->grid[1];
+    ccml_ir_find_ids(ir);
+
+    return true;
+}
+
+CCML_API int ccml_ir_op_reads(ccml_ir_op * op) {
+    switch (op->oper) {
+        case CCML_OPER_VIEW:
+        case CCML_OPER_LOAD:
+        case CCML_OPER_INTR:
+        case CCML_OPER_GATHER: return op->buffer;
+        case CCML_OPER_RES:
+        case CCML_OPER_PER: return op->src[0];
+        default: return -1;
+    }
+}
+
+CCML_API int ccml_ir_op_writes(ccml_ir_op * op) {
+    switch (op->oper) {
+        case CCML_OPER_SUM:
+        case CCML_OPER_RMAX:
+        case CCML_OPER_SCATTER_ADD:
+        case CCML_OPER_STORE:
+        case CCML_OPER_SAVE: return op->buffer;
+        default: return ccml_is_fused(op->oper) ? op->buffer : -1;
+    }
+}
+
+CCML_API bool ccml_ir_uses(ccml_ir * ir, int buffer) {
+    for (int i = 0; i < ir->n_ops; i++) {
+        if (ccml_ir_op_reads(&ir->ops[i]) == buffer || ccml_ir_op_writes(&ir->ops[i]) == buffer) return true;
+    }
+
+    return false;
+}
+
+CCML_API void ccml_graph_check_loads(ccml_graph * graph) {
+    // loads written to through their data pointer without ccml_invalidate would keep the
+    // results computed from what they held before, so every load is hashed along with its
+    // pointer and changes count as a new version. that's one read of the loads per execution
+    for (int i = 0; i < graph->n_nodes; i++) {
+        ccml_tensor * tensor = graph->nodes[i];
+        if (graph->table.opers[i] != CCML_OPER_LOAD) continue;
+
+        uint64_t digest = ccml_hash_data(tensor->data, ccml_size(tensor) * sizeof(float)) ^ (uintptr_t)tensor->data;
+        if (digest != graph->digests[i]) tensor->version++;
+        graph->digests[i] = digest;
+    }
+}
+
+CCML_API bool ccml_ir_is_dirty(ccml_ir * ir, ccml_graph * graph) {
+    // a kernel reruns when any buffer it reads changed since the last execution, or
+    // when one of its results was never computed in the first place
+    for (int i = 0; i < ir->n_ops; i++) {
+        int read = ccml_ir_op_reads(&ir->ops[i]);
+        int written = ccml_ir_op_writes(&ir->ops[i]);
+        if (read != -1 && graph->nodes[read]->version != graph->versions[read]) return true;
+        if (written != -1 && graph->versions[written] == -1) return true;
+    }
+
+    return false;
+}
+
+CCML_API void ccml_ir_commit(ccml_ir * ir, ccml_graph * graph) {
+    // rerunning a kernel changes its results, which in turn dirties the kernels reading them
+    for (int i = 0; i < ir->n_ops; i++) {
+        int written = ccml_ir_op_writes(&ir->ops[i]);
+        if (written != -1) graph->nodes[written]->version++;
+    }
+}
+
+CCML_API void ccml_clear_sums(ccml_ir * ir, ccml_graph * graph) {
+    // sums and scatter-adds accumulate into their buffer, which has to start out from zero
+    // on every run, max reductions start out from -inf
+    for (int i = 0; i < ir->n_ops; i++) {
+        if (ir->ops[i].oper == CCML_OPER_SUM || ir->ops[i].oper == CCML_OPER_SCATTER_ADD) {
+            ccml_tensor * tensor = graph->nodes[ir->ops[i].buffer];
+            memset(tensor->data, 0, ccml_size(tensor) * sizeof(float));
+        }
+        if (ir->ops[i].oper == CCML_OPER_RMAX) {
+            ccml_tensor * tensor = graph->nodes[ir->ops[i].buffer];
+            for (int j = 0; j < ccml_size(tensor); j++) tensor->data[j] = -INFINITY;
+        }
+    }
+}
+
+CCML_API int ccml_new_dirty_irs(ccml_context * ctx, ccml_graph * graph, ccml_ir ** irs) {
+    int n_kernels = 0;
+    int kernels[CCML_KERN_MAX][2];
+    ccml_new_kernel_slice(graph, &n_kernels, kernels);
+
+    int n_irs = 0;
+    for (int i = 0; i < n_kernels; i++) {
+        ccml_ir * ir = ccml_new_ir(ctx, graph, i, kernels[i][0], kernels[i][1]);
+        if (ir == NULL) break;
+        if (ccml_ir_is_dirty(ir, graph)) {
+            ccml_ir_commit(ir, graph);
+            irs[n_irs++] = ir;
+        }
+    }
+
+    return n_irs;
+}
+
+CCML_API int ccml_ir_tail(ccml_ir * ir) {
+    return ir->grid[0] * ir->grid[1] % ir->width;
+}
+
+CCML_API void ccml_ir_vectorize(ccml_ir * ir, int width) {
+    // only elementwise kernels are vectorised, each thread then handles width consecutive elements.
+    // when rows split evenly into vectors any access contiguous (or broadcasted) along rows works,
+    // otherwise accesses have to be linear or scalars and one extra thread does the tail
+    // kernels over a live row count have no fixed tail, so they need rows that split evenly
+    int size = ir->grid[0] * ir->grid[1];
+    bool rows = ir->grid[1] % width == 0;
+    if (width <= 1 || !ccml_grid_is_flat(ir) || size < width) return;
+    if (ir->rows != 0 && !rows) return;
+
+    for (int i = 0; i < ir->n_ops; i++) {
+        ccml_ir_op * op = &ir->ops[i];
+        switch (op->oper) {
+            case CCML_OPER_LOG:
+            case CCML_OPER_EXP:
+            case CCML_OPER_SIN:
+            case CCML_OPER_REC:
+            case CCML_OPER_SQT:
+            case CCML_OPER_ADD:
+            case CCML_OPER_MUL:
+            case CCML_OPER_NEG:
+            case CCML_OPER_MAX:
+            case CCML_OPER_POW:
+            case CCML_OPER_FMA:
+                break;
+            case CCML_OPER_VIEW:
+            case CCML_OPER_LOAD:
+            case CCML_OPER_INTR:
+                if (rows && op->index.stride[1] > 1) return;
+                if (!rows && !ccml_index_is_linear(ir, &op->index) && !ccml_index_is_scalar(&op->index)) return;
+                break;
+            case CCML_OPER_STORE:
+            case CCML_OPER_SAVE:
+                if (rows && op->index.stride[1] != 1) return;
+                if (!rows && !ccml_index_is_linear(ir, &op->index)) return;
+                break;
+            default:
+                return;
+        }
+    }
+
+    ir->width = width;
+    ir->threads[0] = ir->rows != 0 ? ir->rows * ir->grid[1] / width : size / width + (size % width != 0);
+}
+
+// random tensors use philox4x32-10, a counter-based generator, with the seed as its key and the
+// stream and element index as its counter. the kernels get the same function as the host
+CCML_API float ccml_random(uint32_t seed, uint32_t stream, uint32_t counter, bool normal) {
+    uint32_t c0 = counter, c1 = 0, c2 = stream, c3 = 0, k0 = seed, k1 = 0;
+    for (int i = 0; i < 10; i++) {
+        uint64_t p0 = (uint64_t)0xD2511F53u * c0, p1 = (uint64_t)0xCD9E8D57u * c2;
+        c0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0; c1 = (uint32_t)p1;
+        c2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1; c3 = (uint32_t)p0;
+        k0 += 0x9E3779B9u; k1 += 0xBB67AE85u;
+    }
+
+    // uniforms come from the top 24 bits, normals from a box-muller transform of two of them
+    float u0 = (c0 >> 8) * (1.0f / 16777216.0f);
+    float u1 = ((c1 >> 8) + 1) * (1.0f / 16777216.0f);
+    return normal ? sqrtf(-2.0f * logf(u1)) * cosf(6.28318531f * u0) : u0;
+}
+
+static const char * ccml_random_source =
+    "float ccml_random(uint seed, uint stream, uint counter, int normal) {\n"
+    "\tuint c0 = counter, c1 = 0, c2 = stream, c3 = 0, k0 = seed, k1 = 0;\n"
+    "\tfor (int i = 0; i < 10; i++) {\n"
+    "\t\tulong p0 = (ulong)0xD2511F53u * c0, p1 = (ulong)0xCD9E8D57u * c2;\n"
+    "\t\tc0 = (uint)(p1 >> 32) ^ c1 ^ k0; c1 = (uint)p1;\n"
+    "\t\tc2 = (uint)(p0 >> 32) ^ c3 ^ k1; c3 = (uint)p0;\n"
+    "\t\tk0 += 0x9E3779B9u; k1 += 0xBB67AE85u;\n"
+    "\t}\n"
+    "\tfloat u0 = (c0 >> 8) * (1.0f / 16777216.0f);\n"
+    "\tfloat u1 = ((c1 >> 8) + 1) * (1.0f / 16777216.0f);\n"
+    "\treturn normal ? sqrt(-2.0f * log(u1)) * cos(6.28318531f * u0) : u0;\n"
+    "}\n\n";
+
+// vector approximations for the fast modes of c kernels: cephes polynomials whose range reductions
+// and special values (nan, inf, subnormals) are lane masks, so they compile to straight-line simd.
+// against a double reference exp is within 1.0 ulp, log 0.8, sqrt 1.1 and sin 2.1 for |x| <= 8192
+// (1e-7 absolute near its zeros). ccml_floatv is typedefed to the width of the kernels
+static const char * ccml_fast_math_source =
+    "#define ccml_bits(v) ((ccml_intv)(v))\n"
+    "#define ccml_select(mask, a, b) ((ccml_floatv)((ccml_bits(a) & (mask)) | (ccml_bits(b) & ~(mask))))\n"
+    "\n"
+    "// exp(x) = 2^k exp(r) with |r| <= ln2/2, 2^k is applied in two halves so that results\n"
+    "// overflow into inf and fade through the subnormals instead of wrapping around\n"
+    "static inline ccml_floatv ccml_vexp(ccml_floatv x) {\n"
+    "\tccml_floatv c = ccml_select(x > -104.0f, x, (ccml_floatv){0} - 104.0f);\n"
+    "\tc = ccml_select(c < 89.0f, c, (ccml_floatv){0} + 89.0f);\n"
+    "\tccml_floatv t = c * 1.44269504f;\n"
+    "\tccml_intv k = __builtin_convertvector(t + ccml_select(t < 0.0f, (ccml_floatv){0} - 0.5f, (ccml_floatv){0} + 0.5f), ccml_intv);\n"
+    "\tccml_floatv n = __builtin_convertvector(k, ccml_floatv);\n"
+    "\tccml_floatv r = c - n * 0.693359375f + n * 2.12194440e-4f;\n"
+    "\tccml_floatv p = ((((1.9875691500e-4f * r + 1.3981999507e-3f) * r + 8.3334519073e-3f) * r + 4.1665795894e-2f) * r\n"
+    "\t               + 1.6666665459e-1f) * r + 5.0000001201e-1f;\n"
+    "\tccml_floatv lo = (ccml_floatv)(((k >> 1) + 127) << 23);\n"
+    "\tccml_floatv hi = (ccml_floatv)(((k - (k >> 1)) + 127) << 23);\n"
+    "\treturn ccml_select(x == x, (p * r * r + r + 1.0f) * lo * hi, x);\n"
+    "}\n"
+    "\n"
+    "// log(x) = e log(2) + log(m) with m in [sqrt(1/2), sqrt(2)), subnormals are scaled up first\n"
+    "static inline ccml_floatv ccml_vlog(ccml_floatv x) {\n"
+    "\tccml_intv subnormal = x < 1.17549435e-38f;\n"
+    "\tccml_intv u = ccml_bits(ccml_select(subnormal, x * 8388608.0f, x));\n"
+    "\tccml_intv e = ((u >> 23) & 0xff) - 126 + (subnormal & -23);\n"
+    "\tccml_floatv m = (ccml_floatv)((u & 0x007fffff) | 0x3f000000);\n"
+    "\tccml_intv small = m < 0.707106781f;\n"
+    "\tccml_floatv f = ccml_select(small, m + m, m) - 1.0f;\n"
+    "\tccml_floatv n = __builtin_convertvector(e + small, ccml_floatv);\n"
+    "\tccml_floatv z = f * f;\n"
+    "\tccml_floatv y = ((((((((7.0376836292e-2f * f - 1.1514610310e-1f) * f + 1.1676998740e-1f) * f - 1.2420140846e-1f) * f\n"
+    "\t               + 1.4249322787e-1f) * f - 1.6668057665e-1f) * f + 2.0000714765e-1f) * f - 2.4999993993e-1f) * f\n"
+    "\t               + 3.3333331174e-1f) * f * z;\n"
+    "\ty = f + (y - n * 2.12194440e-4f - 0.5f * z) + n * 0.693359375f;\n"
+    "\ty = ccml_select(x == 0.0f, (ccml_floatv){0} - __builtin_inff(), y);\n"
+    "\ty = ccml_select(x == __builtin_inff(), x, y);\n"
+    "\treturn ccml_select(x >= 0.0f, y, (ccml_floatv){0} + __builtin_nanf(\"\"));\n"
+    "}\n"
+    "\n"
+    "// sin(x) over octants of pi/4, taken off in three parts so |x| up to 8192 keeps its accuracy\n"
+    "static inline ccml_floatv ccml_vsin(ccml_floatv x) {\n"
+    "\tccml_floatv a = (ccml_floatv)(ccml_bits(x) & 0x7fffffff);\n"
+    "\tccml_intv valid = a < 1.0e9f;\n"
+    "\ta = ccml_select(valid, a, (ccml_floatv){0});\n"
+    "\tccml_intv j = __builtin_convertvector(a * 1.27323954f, ccml_intv);\n"
+    "\tj += j & 1;\n"
+    "\tccml_floatv n = __builtin_convertvector(j, ccml_floatv);\n"
+    "\tccml_floatv r = ((a - n * 0.78515625f) - n * 2.4187564849853515625e-4f) - n * 3.77489497744594108e-8f;\n"
+    "\tccml_floatv z = r * r;\n"
+    "\tccml_floatv s = ((-1.9515295891e-4f * z + 8.3321608736e-3f) * z - 1.6666654611e-1f) * z * r + r;\n"
+    "\tccml_floatv c = ((2.443315711809948e-5f * z - 1.388731625493765e-3f) * z + 4.166664568298827e-2f) * z * z - 0.5f * z + 1.0f;\n"
+    "\tccml_floatv y = ccml_select((j & 2) != 0, c, s);\n"
+    "\ty = (ccml_floatv)(ccml_bits(y) ^ ((j << 29) & 0x80000000) ^ (ccml_bits(x) & 0x80000000));\n"
+    "\treturn ccml_select(valid, y, x - x);\n"
+    "}\n"
+    "\n"
+    "// x/sqrt(x) from the bit estimate of the reciprocal root, refined by newton steps\n"
+    "static inline ccml_floatv ccml_vsqrt(ccml_floatv x) {\n"
+    "\tccml_intv subnormal = x < 1.17549435e-38f;\n"
+    "\tccml_floatv s = ccml_select(subnormal, x * 16777216.0f, x);\n"
+    "\tccml_floatv y = (ccml_floatv)(0x5f375a86 - (ccml_bits(s) >> 1));\n"
+    "\ty = y * (1.5f - 0.5f * s * y * y);\n"
+    "\ty = y * (1.5f - 0.5f * s * y * y);\n"
+    "\ty = y * (1.5f - 0.5f * s * y * y);\n"
+    "\tccml_floatv r = s * y;\n"
+    "\tr = r + 0.5f * (s - r * r) * y;\n"
+    "\tr = ccml_select(subnormal, r * 2.44140625e-4f, r);\n"
+    "\tr = ccml_select((x == 0.0f) | (x == __builtin_inff()), x, r);\n"
+    "\treturn ccml_select(x >= 0.0f, r, (ccml_floatv){0} + __builtin_nanf(\"\"));\n"
+    "}\n"
+    "\n"
+    "// scalar code and fused ops take the first lane\n"
+    "static inline float ccml_sexp(float x) { return ccml_vexp((ccml_floatv){x})[0]; }\n"
+    "static inline float ccml_slog(float x) { return ccml_vlog((ccml_floatv){x})[0]; }\n"
+    "static inline float ccml_ssin(float x) { return ccml_vsin((ccml_floatv){x})[0]; }\n"
+    "static inline float ccml_ssqrt(float x) { return ccml_vsqrt((ccml_floatv){x})[0]; }\n\n";
+
+CCML_API const char * ccml_oper_string(ccml_oper oper) {
+    switch (oper) {
+        case CCML_OPER_LOG: return "log";
+        case CCML_OPER_EXP: return "exp";
+        case CCML_OPER_SIN: return "sin";
+        case CCML_OPER_REC: return "1/";
+        case CCML_OPER_SQT: return "sqrt";
+        case CCML_OPER_ADD: return "+";
+        case CCML_OPER_MUL: return "*";
+        case CCML_OPER_NEG: return "-";
+        case CCML_OPER_MAX: return "fmax";
+        case CCML_OPER_POW: return "pow";
+        case CCML_OPER_FMA: return "fma";
+        default: CCML_ASSERT(false, "no meaningful conversion to string exists");
+    }
+}
+
+// the math function a kernel calls for an unary op under the accuracy of its graph. c calls the
+// scalar forms of the prelude in the fast modes, vector c kernels call it on whole vectors
+CCML_API const char * ccml_math_string(ccml_oper oper, ccml_accuracy accuracy, ccml_dialect dialect) {
+    bool fast = accuracy != CCML_ACCURACY_PRECISE;
+    bool native = accuracy == CCML_ACCURACY_NATIVE;
+    switch (dialect) {
+        case CCML_DIALECT_METAL:
+            // metal compiles with fast math by default, so precise kernels have to ask for it
+            switch (oper) {
+                case CCML_OPER_LOG: return fast ? "fast::log" : "precise::log";
+                case CCML_OPER_EXP: return fast ? "fast::exp" : "precise::exp";
+                case CCML_OPER_SIN: return fast ? "fast::sin" : "precise::sin";
+                case CCML_OPER_SQT: return fast ? "fast::sqrt" : "precise::sqrt";
+                default: return ccml_oper_string(oper);
+            }
+        case CCML_DIALECT_OPENCL:
+            if (!fast) return ccml_oper_string(oper);
+            switch (oper) {
+                case CCML_OPER_LOG: return native ? "native_log" : "half_log";
+                case CCML_OPER_EXP: return native ? "native_exp" : "half_exp";
+                case CCML_OPER_SIN: return native ? "native_sin" : "half_sin";
+                case CCML_OPER_REC: return native ? "native_recip" : "half_recip";
+                case CCML_OPER_SQT: return native ? "native_sqrt" : "half_sqrt";
+                default: return ccml_oper_string(oper);
+            }
+        default:
+            if (!fast) return ccml_oper_string(oper);
+            switch (oper) {
+                case CCML_OPER_LOG: return "ccml_slog";
+                case CCML_OPER_EXP: return "ccml_sexp";
+                case CCML_OPER_SIN: return "ccml_ssin";
+                case CCML_OPER_SQT: return "ccml_ssqrt";
+                default: return ccml_oper_string(oper);
+            }
+    }
+}
+
+CCML_API const char * ccml_type_string(ccml_type type) {
+    switch (type) {
+        case CCML_TYPE_FP32: return "float ";
+        case CCML_TYPE_INT32: return "int ";
+        default: CCML_ASSERT(false, "unknown variant of ccml_type");
+    }
+}
+
+CCML_API void ccml_print_type(ccml_string * string, ccml_type type, int width) {
+    switch (type) {
+        case CCML_TYPE_FP32: ccml_string_append(string, width > 1 ? "float%d " : "float ", width); break;
+        case CCML_TYPE_INT32: ccml_string_append(string, width > 1 ? "int%d " : "int ", width); break;
+        default: CCML_ASSERT(false, "unknown variant of ccml_type");
+    }
+}
+
+CCML_API const char * ccml_pointer_string(ccml_dialect dialect) {
+    switch (dialect) {
+        case CCML_DIALECT_METAL: return "device ";
+        case CCML_DIALECT_OPENCL: return "__global ";
+        case CCML_DIALECT_C: return "";
+        default: CCML_ASSERT(false, "unknown variant of ccml_dialect");
+    }
+}
+
+CCML_API void ccml_print_offset(ccml_string * string, ccml_ir * ir, ccml_index * index) {
+    // constants are folded, so broadcasted dims and unit strides cost nothing
+    bool linear = ccml_index_is_linear(ir, index);
+    int n_terms = linear;
+    if (linear) ccml_string_append(string, "gid");
+
+    for (int i = 0; !linear && i < CCML_DIMS_MAX; i++) {
+        if (index->stride[i] == 0) continue;
+        ccml_string_append(string, n_terms++ != 0 ? "+id%d" : "id%d", i);
+        if (index->stride[i] != 1) ccml_string_append(string, "*%d", index->stride[i]);
+    }
+
+    // views start wherever their storage offset puts them
+    if (index->offset != 0 || n_terms == 0) {
+        ccml_string_append(string, n_terms != 0 ? "+%d" : "%d", index->offset);
+    }
+}
+
+CCML_API void ccml_print_index(ccml_string * string, ccml_ir * ir, ccml_index * index) {
+    ccml_string_append(string, "[");
+    ccml_print_offset(string, ir, index);
+    ccml_string_append(string, "]");
+}
+
+CCML_API void ccml_print_ids(ccml_string * string, ccml_ir * ir, ccml_dialect dialect) {
+    // the first two dims are decoded from the linear thread id, the grid is known
+    // at this point so the divisor is a constant and a shift/mask for powers of two
+    // vectorised kernels over whole rows have a thread per width elements of a row
+    const char * type = dialect == CCML_DIALECT_METAL ? "uint" : "int";
+    int grid = ir->grid[1] / ir->width;
+    int width = ir->width;
+
+    if (ir->uses_id[0] && grid == 1) {
+        ccml_string_append(string, "\t%s id0 = gid;\n", type);
+    } else if (ir->uses_id[0] && ccml_is_pow2(grid)) {
+        ccml_string_append(string, "\t%s id0 = gid >> %d;\n", type, ccml_log2(grid));
+    } else if (ir->uses_id[0]) {
+        ccml_string_append(string, "\t%s id0 = gid / %d;\n", type, grid);
+    }
+
+    if (ir->uses_id[1] && grid == 1) {
+        ccml_string_append(string, "\t%s id1 = 0;\n", type);
+    } else if (ir->uses_id[1] && ccml_is_pow2(grid)) {
+        ccml_string_append(string, width > 1 ? "\t%s id1 = (gid & %d)*%d;\n" : "\t%s id1 = gid & %d;\n",
+                           type, grid - 1, width);
+    } else if (ir->uses_id[1]) {
+        ccml_string_append(string, width > 1 ? "\t%s id1 = (gid %% %d)*%d;\n" : "\t%s id1 = gid %% %d;\n",
+                           type, grid, width);
+    }
+
+    // the third dim has its own dispatch dim, the ones after it share the last one
+    const char * ids[] = {
+        [CCML_DIALECT_METAL]  = "tid.z",
+        [CCML_DIALECT_OPENCL] = "get_global_id(2)"
+    };
+
+    for (int i = 2; i < CCML_DIMS_MAX && dialect != CCML_DIALECT_C; i++) {
+        int inner = 1;
+        for (int j = i + 1; j < CCML_DIMS_MAX; j++) inner *= ir->grid[j];
+
+        if (!ir->uses_id[i]) {
+            continue;
+        } else if (i == 2 && dialect == CCML_DIALECT_METAL) {
+            ccml_string_append(string, "\tuint id2 = tid.y;\n");
+        } else if (i == 2) {
+            ccml_string_append(string, "\tint id2 = get_global_id(1);\n");
+        } else {
+            ccml_string_append(string, "\t%s id%d = %s", type, i, ids[dialect]);
+            if (inner != 1) ccml_string_append(string, " / %d", inner);
+            if (i != 3) ccml_string_append(string, " %% %d", ir->grid[i]);
+            ccml_string_append(string, ";\n");
+        }
+    }
+
+    ccml_string_append(string, "\n");
+}
+
+CCML_API void ccml_print_guard(ccml_string * string, ccml_ir * ir, ccml_dialect dialect) {
+    // work-groups pad the dispatch past the grid, those extra threads exit straight away
+    const char * ids[3][2] = {{"gid", "gid"}, {"tid.y", "get_global_id(1)"}, {"tid.z", "get_global_id(2)"}};
+
+    if (ir->rows != 0) {
+        ccml_string_append(string, "\tif (gid >= rows * %d", ir->grid[1] / ir->width);
+    } else {
+        ccml_string_append(string, "\tif (gid >= %d", ir->threads[0]);
+    }
+    for (int i = 1; i < 3; i++) {
+        if (ir->threads[i] != 1) {
+            ccml_string_append(string, " || %s >= %d", ids[i][dialect == CCML_DIALECT_OPENCL], ir->threads[i]);
+        }
+    }
+    ccml_string_append(string, ") return;\n");
+}
+
+CCML_API void ccml_print_header(ccml_string * string, ccml_ir * ir, ccml_dialect dialect) {
+    // the n_kernel parameter specifies the id of the kernel being generated
+    switch (dialect) {
+        case CCML_DIALECT_METAL:
+            ccml_string_append(string, "kernel void my_kernel_%d(", ir->n_kernel);
+            for (int i = 0; i < ir->n_buffers; i++) {
+                ccml_string_append(string, "%sdevice %s* data_%d [[buffer(%d)]]", i != 0 ? ", " : "",
+                                   ccml_type_string(ir->types[i]), ir->buffers[i], i);
+            }
+            if (ir->rows != 0) {
+                ccml_string_append(string, ", constant int & rows [[buffer(%d)]]", ir->n_buffers);
+            }
+            ccml_string_append(string, ", uint3 tid [[thread_position_in_grid]]) {\n\tuint gid = tid.x;\n");
+            ccml_print_guard(string, ir, dialect);
+            if (ccml_ir_tail(ir) != 0) {
+                ccml_string_append(string, "\tif (gid < %d) {\n", ir->grid[0] * ir->grid[1] / ir->width);
+            }
+            break;
+        case CCML_DIALECT_OPENCL:
+            ccml_string_append(string, "__kernel void my_kernel_%d(", ir->n_kernel);
+            for (int i = 0; i < ir->n_buffers; i++) {
+                ccml_string_append(string, "%s__global %s* data_%d", i != 0 ? ", " : "",
+                                   ccml_type_string(ir->types[i]), ir->buffers[i]);
+            }
+            ccml_string_append(string, "%s) {\n\tint gid = get_global_id(0);\n", ir->rows != 0 ? ", int rows" : "");
+            ccml_print_guard(string, ir, dialect);
+            if (ccml_ir_tail(ir) != 0) {
+                ccml_string_append(string, "\tif (gid < %d) {\n", ir->grid[0] * ir->grid[1] / ir->width);
+            }
+            break;
+        case CCML_DIALECT_C:
+            // the c kernel runs the [start, finish) range of the flattened first two grid dims
+            if (ir->width > 1) {
+                ccml_string_append(string, "typedef float float%d __attribute__((vector_size(%d), aligned(4)));\n\n",
+                                   ir->width, ir->width * (int)sizeof(float));
+            }
+            ccml_string_append(string, "void my_kernel_%d(float ** data, int start, int finish) {\n",
+                               ir->n_kernel);
+            for (int i = 0; i < ir->n_buffers; i++) {
+                // every buffer of the graph is passed, only the ones the kernel touches are
+                // named. index buffers are passed along with the float ones
+                if (!ccml_ir_uses(ir, ir->buffers[i])) continue;
+                const char * format = ir->types[i] == CCML_TYPE_FP32 ? "\t%s* data_%d = data[%d];\n" :
+                                                                       "\t%s* data_%d = (void *)data[%d];\n";
+                ccml_string_append(string, format, ccml_type_string(ir->types[i]), ir->buffers[i], i);
+            }
+            if (ir->width > 1) {
+                ccml_string_append(string, "\n\tfor (int gid = start; gid < finish && gid < %d; gid++)",
+                                   ir->grid[0] * ir->grid[1] / ir->width);
+            } else {
+                ccml_string_append(string, "\n\tfor (int gid = start; gid < finish; gid++)");
+            }
+            for (int i = 2; i < CCML_DIMS_MAX; i++) {
+                if (ir->grid[i] != 1) {
+                    ccml_string_append(string, "\n\tfor (int id%d = 0; id%d < %d; id%d++)", i, i, ir->grid[i], i);
+                }
+            }
+            ccml_string_append(string, " {\n");
+            break;
+        default:
+            CCML_ASSERT(false, "unknown variant of ccml_dialect");
+    }
+
+    ccml_print_ids(string, ir, dialect);
+}
+
+#define CCML_TILE_SIZE 16
+
+CCML_API ccml_ir_op * ccml_ir_find(ccml_ir * ir, int dst) {
+    for (int i = 0; i < ir->n_ops; i++) {
+        if (ir->ops[i].dst == dst) return &ir->ops[i];
+    }
+
+    return NULL;
+}
+
+CCML_API void ccml_print_row(ccml_string * string, const char * name, ccml_ir_op * op, int axis,
+                             int dim, const char * row) {
+    // rows start wherever the ids of the thread put them, except along the dim that's
+    // addressed through the row variable instead, the axis is walked by the kernel's loops
+    int n_terms = 0;
+    ccml_string_append(string, "int %s = ", name);
+    for (int i = 0; i < CCML_DIMS_MAX; i++) {
+        if (i == axis || op->index.stride[i] == 0) continue;
+        if (n_terms++ != 0) ccml_string_append(string, "+");
+        if (i == dim) {
+            ccml_string_append(string, "%s", row);
+        } else {
+            ccml_string_append(string, "id%d", i);
+        }
+        if (op->index.stride[i] != 1) ccml_string_append(string, "*%d", op->index.stride[i]);
+    }
+    if (op->index.offset != 0 || n_terms == 0) {
+        ccml_string_append(string, n_terms != 0 ? "+%d" : "%d", op->index.offset);
+    }
+    ccml_string_append(string, ";");
+}
+
+CCML_API void ccml_print_at(ccml_string * string, ccml_ir_op * op, int axis, const char * row,
+                            const char * var, int position) {
+    // elements along the axis are either at the position in a variable or at a constant one
+    int buffer = ccml_ir_op_reads(op) != -1 ? ccml_ir_op_reads(op) : op->buffer;
+    int stride = op->index.stride[axis];
+    ccml_string_append(string, "data_%d[%s", buffer, row);
+    if (var != NULL && stride == 1) {
+        ccml_string_append(string, "+%s", var);
+    } else if (var != NULL && stride != 0) {
+        ccml_string_append(string, "+%s*%d", var, stride);
+    } else if (var == NULL && position * stride != 0) {
+        ccml_string_append(string, "+%d", position * stride);
+    }
+    ccml_string_append(string, "]");
+}
+
+CCML_API void ccml_print_attention(ccml_string * string, ccml_ir * ir, ccml_ir_op * op, ccml_dialect dialect) {
+    // the sources are addressed with the indices of the ops reading them, which never print
+    // anything themselves. everything runs in scalar loops with sizes known at this point
+    ccml_ir_op * q = ccml_ir_find(ir, op->src[0]);
+    ccml_ir_op * k = ccml_ir_find(ir, op->src[1]);
+    ccml_ir_op * v = op->src[2] != -1 ? ccml_ir_find(ir, op->src[2]) : NULL;
+    ccml_ir_op * g = op->src[3] != -1 ? ccml_ir_find(ir, op->src[3]) : NULL;
+    int axis = op->axis;
+    int rows = axis - 1;
+
+    char id[16];
+    snprintf(id, sizeof(id), "id%d", rows);
+    int n_q = q->shape[rows];
+    int n_k = k->shape[rows];
+    int n_d = q->shape[axis];
+    int n_v = v != NULL ? v->shape[axis] : 0;
+    int n_o = op->shape[axis];
+    int tile = n_k < CCML_TILE_SIZE ? n_k : CCML_TILE_SIZE;
+    char scale[32];
+    snprintf(scale, sizeof(scale), "%.9ef", 1.0 / sqrt(n_d));
+    const char * exp_fn = ccml_math_string(CCML_OPER_EXP, ir->accuracy, dialect);
+    const char * log_fn = ccml_math_string(CCML_OPER_LOG, ir->accuracy, dialect);
+
+    ccml_string_append(string, "\t");
+    ccml_print_row(string, "o_row", op, axis, rows, id);
+    ccml_string_append(string, "\n\tfloat acc[%d];\n\tfor (int d = 0; d < %d; d++) acc[d] = 0.0f;\n", n_o, n_o);
+
+    if (op->oper == CCML_OPER_ATTN || op->oper == CCML_OPER_ATTN_LSE) {
+        // keys go by in tiles, the running max only rescales the sums once per tile
+        ccml_string_append(string, "\t");
+        ccml_print_row(string, "q_row", q, axis, rows, id);
+        ccml_string_append(string, "\n\tfloat m = -3.402823466e+38f;\n\tfloat l = 0.0f;\n");
+        ccml_string_append(string, "\tfor (int tile = 0; tile < %d; tile += %d) {\n", n_k, tile);
+        ccml_string_append(string, "\t\tfloat s[%d];\n\t\tfloat tile_max = m;\n", tile);
+        ccml_string_append(string, "\t\tfor (int t = 0; t < %d && tile + t < %d; t++) {\n\t\t\t", tile, n_k);
+        ccml_print_row(string, "k_row", k, axis, rows, "(tile + t)");
+        ccml_string_append(string, "\n\t\t\tfloat dot = 0.0f;\n\t\t\tfor (int d = 0; d < %d; d++) dot += ", n_d);
+        ccml_print_at(string, q, axis, "q_row", "d", 0);
+        ccml_string_append(string, " * ");
+        ccml_print_at(string, k, axis, "k_row", "d", 0);
+        ccml_string_append(string, ";\n\t\t\ts[t] = dot * %s;\n", scale);
+        ccml_string_append(string, "\t\t\ttile_max = s[t] > tile_max ? s[t] : tile_max;\n\t\t}\n");
+        ccml_string_append(string, "\t\tfloat correction = %s(m - tile_max);\n\t\tl *= correction;\n", exp_fn);
+        if (op->oper == CCML_OPER_ATTN) {
+            ccml_string_append(string, "\t\tfor (int d = 0; d < %d; d++) acc[d] *= correction;\n", n_o);
+        }
+        ccml_string_append(string, "\t\tfor (int t = 0; t < %d && tile + t < %d; t++) {\n", tile, n_k);
+        ccml_string_append(string, "\t\t\tfloat p = %s(s[t] - tile_max);\n\t\t\tl += p;\n", exp_fn);
+        if (op->oper == CCML_OPER_ATTN) {
+            ccml_string_append(string, "\t\t\t");
+            ccml_print_row(string, "v_row", v, axis, rows, "(tile + t)");
+            ccml_string_append(string, "\n\t\t\tfor (int d = 0; d < %d; d++) acc[d] += p * ", n_o);
+            ccml_print_at(string, v, axis, "v_row", "d", 0);
+            ccml_string_append(string, ";\n");
+        }
+        ccml_string_append(string, "\t\t}\n\t\tm = tile_max;\n\t}\n");
+        if (op->oper == CCML_OPER_ATTN) {
+            ccml_string_append(string, "\tfor (int d = 0; d < %d; d++) acc[d] /= l;\n", n_o);
+        } else {
+            ccml_string_append(string, "\tacc[0] = m + %s(l);\n", log_fn);
+        }
+    } else {
+        // the gradients recompute the probabilities from the log-sum-exp stored after the
+        // gradient of each output row, and the dot product of the two stored after that
+        bool queries = op->oper == CCML_OPER_ATTN_DQ;
+        const char * loop = queries ? "j" : "i";
+        ccml_string_append(string, "\t");
+        ccml_print_row(string, queries ? "q_row" : "k_row", queries ? q : k, axis, rows, id);
+        ccml_string_append(string, "\n\t");
+        ccml_print_row(string, queries ? "g_row" : "v_row", queries ? g : v, axis, rows, id);
+        ccml_string_append(string, "\n\tfor (int %s = 0; %s < %d; %s++) {\n\t\t", loop, loop, queries ? n_k : n_q, loop);
+        ccml_print_row(string, queries ? "k_row" : "q_row", queries ? k : q, axis, rows, loop);
+        ccml_string_append(string, "\n\t\t");
+        ccml_print_row(string, queries ? "v_row" : "g_row", queries ? v : g, axis, rows, loop);
+        ccml_string_append(string, "\n\t\tfloat dot = 0.0f;\n\t\tfor (int d = 0; d < %d; d++) dot += ", n_d);
+        ccml_print_at(string, q, axis, "q_row", "d", 0);
+        ccml_string_append(string, " * ");
+        ccml_print_at(string, k, axis, "k_row", "d", 0);
+        ccml_string_append(string, ";\n\t\tfloat p = %s(dot * %s - ", exp_fn, scale);
+        ccml_print_at(string, g, axis, "g_row", NULL, n_v);
+        ccml_string_append(string, ");\n");
+        if (op->oper == CCML_OPER_ATTN_DV) {
+            ccml_string_append(string, "\t\tfor (int d = 0; d < %d; d++) acc[d] += p * ", n_o);
+            ccml_print_at(string, g, axis, "g_row", "d", 0);
+            ccml_string_append(string, ";\n\t}\n");
+        } else {
+            ccml_string_append(string, "\t\tfloat dp = 0.0f;\n\t\tfor (int d = 0; d < %d; d++) dp += ", n_v);
+            ccml_print_at(string, g, axis, "g_row", "d", 0);
+            ccml_string_append(string, " * ");
+            ccml_print_at(string, v, axis, "v_row", "d", 0);
+            ccml_string_append(string, ";\n\t\tfloat ds = p * (dp - ");
+            ccml_print_at(string, g, axis, "g_row", NULL, n_v + 1);
+            ccml_string_append(string, ") * %s;\n\t\tfor (int d = 0; d < %d; d++) acc[d] += ds * ", scale, n_o);
+            ccml_print_at(string, queries ? k : q, axis, queries ? "k_row" : "q_row", "d", 0);
+            ccml_string_append(string, ";\n\t}\n");
+        }
+    }
+
+    ccml_string_append(string, "\tfor (int d = 0; d < %d; d++) ", n_o);
+    ccml_print_at(string, op, axis, "o_row", "d", 0);
+    ccml_string_append(string, " = acc[d];\n");
+}
+
+CCML_API void ccml_print_softmax(ccml_string * string, ccml_ir * ir, ccml_ir_op * op, ccml_dialect dialect) {
+    // the log-sum-exp of a row comes out of a single pass over it in tiles, each tile only
+    // rescales the running sum once, then the row is normalised or reduced against the targets
+    ccml_ir_op * x = ccml_ir_find(ir, op->src[0]);
+    ccml_ir_op * t = op->src[1] != -1 ? ccml_ir_find(ir, op->src[1]) : NULL;
+    int axis = op->axis;
+    int n = x->shape[axis];
+    int tile = n < CCML_TILE_SIZE ? n : CCML_TILE_SIZE;
+    const char * exp_fn = ccml_math_string(CCML_OPER_EXP, ir->accuracy, dialect);
+    const char * log_fn = ccml_math_string(CCML_OPER_LOG, ir->accuracy, dialect);
+
+    ccml_string_append(string, "\t");
+    ccml_print_row(string, "x_row", x, axis, -1, NULL);
+    ccml_string_append(string, "\n\t");
+    ccml_print_row(string, "o_row", op, axis, -1, NULL);
+    ccml_string_append(string, "\n\tfloat m = -3.402823466e+38f;\n\tfloat l = 0.0f;\n");
+    ccml_string_append(string, "\tfor (int tile = 0; tile < %d; tile += %d) {\n\t\tfloat tile_max = m;\n", n, tile);
+    ccml_string_append(string, "\t\tfor (int t = 0; t < %d && tile + t < %d; t++) {\n\t\t\tfloat x = ", tile, n);
+    ccml_print_at(string, x, axis, "x_row", "(tile + t)", 0);
+    ccml_string_append(string, ";\n\t\t\ttile_max = x > tile_max ? x : tile_max;\n\t\t}\n");
+    ccml_string_append(string, "\t\tl *= %s(m - tile_max);\n", exp_fn);
+    ccml_string_append(string, "\t\tfor (int t = 0; t < %d && tile + t < %d; t++) l += %s(", tile, n, exp_fn);
+    ccml_print_at(string, x, axis, "x_row", "(tile + t)", 0);
+    ccml_string_append(string, " - tile_max);\n\t\tm = tile_max;\n\t}\n\tfloat lse = m + %s(l);\n", log_fn);
+
+    switch (op->oper) {
+        case CCML_OPER_SOFTMAX:
+        case CCML_OPER_LOG_SOFTMAX:
+            ccml_string_append(string, "\tfor (int d = 0; d < %d; d++) ", n);
+            ccml_print_at(string, op, axis, "o_row", "d", 0);
+            ccml_string_append(string, op->oper == CCML_OPER_SOFTMAX ? " = %s(" : " = ", exp_fn);
+            ccml_print_at(string, x, axis, "x_row", "d", 0);
+            ccml_string_append(string, op->oper == CCML_OPER_SOFTMAX ? " - lse);\n" : " - lse;\n");
+            break;
+        case CCML_OPER_SOFTMAX_XENT:
+            // -sum(t*log_softmax(x)) is lse*sum(t) - sum(t*x), targets don't have to add up to one
+            ccml_string_append(string, "\t");
+            ccml_print_row(string, "t_row", t, axis, -1, NULL);
+            ccml_string_append(string, "\n\tfloat target = 0.0f;\n\tfloat dot = 0.0f;\n");
+            ccml_string_append(string, "\tfor (int d = 0; d < %d; d++) {\n\t\ttarget += ", n);
+            ccml_print_at(string, t, axis, "t_row", "d", 0);
+            ccml_string_append(string, ";\n\t\tdot += ");
+            ccml_print_at(string, t, axis, "t_row", "d", 0);
+            ccml_string_append(string, " * ");
+            ccml_print_at(string, x, axis, "x_row", "d", 0);
+            ccml_string_append(string, ";\n\t}\n\t");
+            ccml_print_at(string, op, axis, "o_row", NULL, 0);
+            ccml_string_append(string, " = lse * target - dot;\n");
+            break;
+        default:
+            CCML_ASSERT(false, "not a softmax");
+    }
+}
+
+CCML_API void ccml_print_op(ccml_string * string, ccml_ir * ir, ccml_ir_op * op, ccml_dialect dialect) {
+    switch (op->oper) {
+        case CCML_OPER_LOG:
+        case CCML_OPER_EXP:
+        case CCML_OPER_SIN:
+        case CCML_OPER_REC:
+        case CCML_OPER_SQT:
+        case CCML_OPER_NEG:
+            ccml_string_append(string, "\t%stemp_%d = %s(temp_%d);\n", ccml_type_string(op->type),
+                               op->dst, ccml_math_string(op->oper, ir->accuracy, dialect), op->src[0]);
+            break;
+        case CCML_OPER_ADD:
+        case CCML_OPER_MUL:
+            ccml_string_append(string, "\t%stemp_%d = temp_%d %s temp_%d;\n", ccml_type_string(op->type),
+                               op->dst, op->src[0], ccml_oper_string(op->oper), op->src[1]);
+            break;
+        case CCML_OPER_MAX:
+        case CCML_OPER_POW:
+            ccml_string_append(string, "\t%stemp_%d = %s(temp_%d, temp_%d);\n", ccml_type_string(op->type),
+                               op->dst, ccml_oper_string(op->oper), op->src[0], op->src[1]);
+            break;
+        case CCML_OPER_FMA:
+            ccml_string_append(string, "\t%stemp_%d = fma(temp_%d, temp_%d, temp_%d);\n", ccml_type_string(op->type),
+                               op->dst, op->src[0], op->src[1], op->src[2]);
+            break;
+        case CCML_OPER_CMPLT:
+            ccml_string_append(string, "\t%stemp_%d = temp_%d < temp_%d ? 1.0f : 0.0f;\n", ccml_type_string(op->type),
+                               op->dst, op->src[0], op->src[1]);
+            break;
+        case CCML_OPER_WHERE:
+            ccml_string_append(string, "\t%stemp_%d = temp_%d != 0.0f ? temp_%d : temp_%d;\n", ccml_type_string(op->type),
+                               op->dst, op->src[0], op->src[1], op->src[2]);
+            break;
+        case CCML_OPER_SUM:
+            ccml_string_append(string, "\tdata_%d", op->buffer);
+            ccml_print_index(string, ir, &op->index);
+            ccml_string_append(string, " += temp_%d;\n", op->src[0]);
+            break;
+        case CCML_OPER_RMAX:
+            ccml_string_append(string, "\tdata_%d", op->buffer);
+            ccml_print_index(string, ir, &op->index);
+            ccml_string_append(string, " = fmax(data_%d", op->buffer);
+            ccml_print_index(string, ir, &op->index);
+            ccml_string_append(string, ", temp_%d);\n", op->src[0]);
+            break;
+        case CCML_OPER_SCATTER_ADD: {
+            // values of repeated indices add into the same row, so gpu threads do it atomically
+            const char * formats[][2] = {
+                [CCML_DIALECT_METAL]  = {"\tatomic_fetch_add_explicit((device atomic_float *)&data_%d[temp_%d*%d+",
+                                         "], temp_%d, memory_order_relaxed);\n"},
+                [CCML_DIALECT_OPENCL] = {"\tccml_atomic_add(&data_%d[temp_%d*%d+", "], temp_%d);\n"},
+                [CCML_DIALECT_C]      = {"\tdata_%d[temp_%d*%d+", "] += temp_%d;\n"}
+            };
+            ccml_string_append(string, formats[dialect][0], op->buffer, op->src[1], op->pitch);
+            ccml_print_offset(string, ir, &op->index);
+            ccml_string_append(string, formats[dialect][1], op->src[0]);
+            break; }
+        case CCML_OPER_UNIFORM:
+        case CCML_OPER_NORMAL:
+            ccml_string_append(string, "\t%stemp_%d = ccml_random(temp_%d, %d, ", ccml_type_string(op->type),
+                               op->dst, op->src[0], op->axis);
+            ccml_print_offset(string, ir, &op->index);
+            ccml_string_append(string, ", %d);\n", op->oper == CCML_OPER_NORMAL);
+            break;
+        case CCML_OPER_GATHER:
+            ccml_string_append(string, "\t%stemp_%d = data_%d[temp_%d*%d+", ccml_type_string(op->type),
+                               op->dst, op->buffer, op->src[1], op->pitch);
+            ccml_print_offset(string, ir, &op->index);
+            ccml_string_append(string, "];\n");
+            break;
+        case CCML_OPER_RES:
+        case CCML_OPER_PER:
+            ccml_string_append(string, "\t%s%s* data_%d = data_%d;\n\t%stemp_%d = data_%d",
+                               ccml_pointer_string(dialect), ccml_type_string(op->type), op->buffer,
+                               op->src[0], ccml_type_string(op->type), op->dst, op->buffer);
+            ccml_print_index(string, ir, &op->index);
+            ccml_string_append(string, ";\n");
+            break;
+        case CCML_OPER_VIEW:
+        case CCML_OPER_LOAD:
+        case CCML_OPER_INTR:
+            ccml_string_append(string, "\t%stemp_%d = data_%d", ccml_type_string(op->type), op->dst, op->buffer);
+            ccml_print_index(string, ir, &op->index);
+            ccml_string_append(string, ";\n");
+            break;
+        case CCML_OPER_STORE:
+        case CCML_OPER_SAVE:
+            ccml_string_append(string, "\tdata_%d", op->buffer);
+            ccml_print_index(string, ir, &op->index);
+            ccml_string_append(string, " = temp_%d;\n", op->src[0]);
+            break;
+        case CCML_OPER_ATTN:
+        case CCML_OPER_ATTN_LSE:
+        case CCML_OPER_ATTN_DQ:
+        case CCML_OPER_ATTN_DK:
+        case CCML_OPER_ATTN_DV:
+            ccml_print_attention(string, ir, op, dialect);
+            break;
+        case CCML_OPER_SOFTMAX:
+        case CCML_OPER_LOG_SOFTMAX:
+        case CCML_OPER_SOFTMAX_XENT:
+            ccml_print_softmax(string, ir, op, dialect);
+            break;
+        default:
+            CCML_ASSERT(false, "unknown variant of ccml_oper");
+    }
+}
+
+CCML_API void ccml_print_vector_offset(ccml_string * string, ccml_ir * ir, ccml_index * index) {
+    if (ccml_index_is_linear(ir, index)) {
+        ccml_string_append(string, index->offset != 0 ? "gid*%d+%d" : "gid*%d", ir->width, index->offset);
+    } else {
+        ccml_print_offset(string, ir, index);
+    }
+}
+
+CCML_API void ccml_print_vector_op(ccml_string * string, ccml_ir * ir, ccml_ir_op * op, ccml_dialect dialect) {
+    int width = ir->width;
+    ccml_string_append(string, "\t");
+    if (op->oper != CCML_OPER_SAVE && op->oper != CCML_OPER_STORE) {
+        ccml_print_type(string, op->type, width);
+    }
+
+    switch (op->oper) {
+        case CCML_OPER_LOG:
+        case CCML_OPER_EXP:
+        case CCML_OPER_SIN:
+        case CCML_OPER_SQT:
+            // libm has no vector overloads in c, so the lanes are unrolled by the compiler. the fast
+            // modes call the approximations of the prelude on the whole vector instead
+            if (dialect == CCML_DIALECT_C && ir->accuracy != CCML_ACCURACY_PRECISE) {
+                ccml_string_append(string, "temp_%d = ccml_v%s(temp_%d);\n", op->dst, ccml_oper_string(op->oper),
+                                   op->src[0]);
+                break;
+            }
+            if (dialect == CCML_DIALECT_C) {
+                ccml_string_append(string, "temp_%d;\n\tfor (int lane = 0; lane < %d; lane++) "
+                                   "temp_%d[lane] = %s(temp_%d[lane]);\n", op->dst, width, op->dst,
+                                   ccml_oper_string(op->oper), op->src[0]);
+                break;
+            }
+            // fallthrough
+        case CCML_OPER_REC:
+        case CCML_OPER_NEG:
+            ccml_string_append(string, "temp_%d = %s(temp_%d);\n", op->dst,
+                               ccml_math_string(op->oper, ir->accuracy, dialect), op->src[0]);
+            break;
+        case CCML_OPER_ADD:
+        case CCML_OPER_MUL:
+            ccml_string_append(string, "temp_%d = temp_%d %s temp_%d;\n", op->dst, op->src[0],
+                               ccml_oper_string(op->oper), op->src[1]);
+            break;
+        case CCML_OPER_MAX:
+        case CCML_OPER_POW:
+            if (dialect == CCML_DIALECT_C) {
+                ccml_string_append(string, "temp_%d;\n\tfor (int lane = 0; lane < %d; lane++) "
+                                   "temp_%d[lane] = %s(temp_%d[lane], temp_%d[lane]);\n", op->dst, width, op->dst,
+                                   ccml_oper_string(op->oper), op->src[0], op->src[1]);
+                break;
+            }
+            ccml_string_append(string, "temp_%d = %s(temp_%d, temp_%d);\n", op->dst, ccml_oper_string(op->oper),
+                               op->src[0], op->src[1]);
+            break;
+        case CCML_OPER_FMA:
+            // c vectors contract the multiply and add into one instruction by themselves
+            if (dialect == CCML_DIALECT_C) {
+                ccml_string_append(string, "temp_%d = temp_%d * temp_%d + temp_%d;\n", op->dst, op->src[0],
+                                   op->src[1], op->src[2]);
+                break;
+            }
+            ccml_string_append(string, "temp_%d = fma(temp_%d, temp_%d, temp_%d);\n", op->dst, op->src[0],
+                               op->src[1], op->src[2]);
+            break;
+        case CCML_OPER_VIEW:
+        case CCML_OPER_LOAD:
+        case CCML_OPER_INTR:
+            // values broadcasted along rows are splatted, everything else is a contiguous vector
+            ccml_string_append(string, "temp_%d = ", op->dst);
+            if (op->index.stride[1] == 0 && !ccml_index_is_linear(ir, &op->index)) {
+                switch (dialect) {
+                    case CCML_DIALECT_METAL: ccml_string_append(string, "float%d(data_%d", width, op->buffer); break;
+                    case CCML_DIALECT_OPENCL: ccml_string_append(string, "(float%d)(data_%d", width, op->buffer); break;
+                    case CCML_DIALECT_C: ccml_string_append(string, "(float%d){0} + (data_%d", width, op->buffer); break;
+                }
+                ccml_print_index(string, ir, &op->index);
+                ccml_string_append(string, ");\n");
+                break;
+            }
+            switch (dialect) {
+                case CCML_DIALECT_METAL: ccml_string_append(string, "*(device packed_float%d *)(data_%d + ", width, op->buffer); break;
+                case CCML_DIALECT_OPENCL: ccml_string_append(string, "vload%d(0, data_%d + ", width, op->buffer); break;
+                case CCML_DIALECT_C: ccml_string_append(string, "*(float%d *)(data_%d + ", width, op->buffer); break;
+            }
+            ccml_print_vector_offset(string, ir, &op->index);
+            ccml_string_append(string, ");\n");
+            break;
+        case CCML_OPER_STORE:
+        case CCML_OPER_SAVE:
+            switch (dialect) {
+                case CCML_DIALECT_METAL: ccml_string_append(string, "*(device packed_float%d *)(data_%d + ", width, op->buffer); break;
+                case CCML_DIALECT_OPENCL: ccml_string_append(string, "vstore%d(temp_%d, 0, data_%d + ", width, op->src[0], op->buffer); break;
+                case CCML_DIALECT_C: ccml_string_append(string, "*(float%d *)(data_%d + ", width, op->buffer); break;
+            }
+            ccml_print_vector_offset(string, ir, &op->index);
+            if (dialect == CCML_DIALECT_OPENCL) {
+                ccml_string_append(string, ");\n");
+            } else {
+                ccml_string_append(string, ") = temp_%d;\n", op->src[0]);
+            }
+            break;
+        default:
+            CCML_ASSERT(false, "op can't be vectorised");
+    }
+}
+
+CCML_API const char * ccml_new_kernel(ccml_context * ctx, ccml_ir * ir, ccml_dialect dialect) {
+    // roughly one line per op, the string grows if that's not enough
+    ccml_string * string = ccml_new_string(ctx, 64 * (2 * ir->n_ops + ir->n_buffers + 8));
+    if (string == NULL) return NULL;
+
+    ccml_print_header(string, ir, dialect);
+    ccml_ir_op * fused = ccml_ir_fused(ir);
+    for (int i = 0; i < ir->n_ops; i++) {
+        if (fused != NULL && &ir->ops[i] != fused) continue;
+        if (ir->width > 1) {
+            ccml_print_vector_op(string, ir, &ir->ops[i], dialect);
+        } else {
+            ccml_print_op(string, ir, &ir->ops[i], dialect);
+        }
+    }
+
+    // the remainder that doesn't fill a whole vector runs through the scalar ops
+    int tail = ccml_ir_tail(ir);
+    if (tail != 0) {
+        int size = ir->grid[0] * ir->grid[1];
+        ccml_string_append(string, dialect == CCML_DIALECT_C ? "\t}\n\tif (finish > %d) " : "\t} else ", size / ir->width);
+        ccml_string_append(string, "for (int gid = %d; gid < %d; gid++) {\n", size - tail, size);
+        for (int i = 0; i < ir->n_ops; i++) {
+            ccml_print_op(string, ir, &ir->ops[i], dialect);
+        }
+    }
+
+    ccml_string_append(string, dialect == CCML_DIALECT_C || tail != 0 ? "\t}\n}\n" : "}\n");
+
+    return ccml_context_failed(ctx) ? NULL : string->data;
+}
+
+CCML_API const char * ccml_new_program(ccml_context * ctx, ccml_ir ** irs, int n_irs, ccml_dialect dialect) {
+    // programs that ran out of memory halfway through are NULL
+    ccml_string * string = ccml_new_string(ctx, 256);
+    if (string == NULL) return NULL;
+
+    // tgmath keeps the float temporaries of c kernels on the float variants of the math functions
+    switch (dialect) {
+        case CCML_DIALECT_METAL: ccml_string_append(string, "#include <metal_stdlib>\nusing namespace metal;\n"); break;
+        case CCML_DIALECT_C: ccml_string_append(string, "#include <tgmath.h>\n\n"); break;
+        default: break;
+    }
+
+    // opencl has no atomic float add, scatter-adds retry a compare-and-swap until it goes through
+    bool scatters = false;
+    bool random = false;
+    int fast_width = 0;
+    for (int i = 0; i < n_irs; i++) {
+        for (int j = 0; j < irs[i]->n_ops; j++) {
+            ccml_oper oper = irs[i]->ops[j].oper;
+            if (oper == CCML_OPER_SCATTER_ADD) scatters = true;
+            if (ccml_is_random(oper)) random = true;
+            bool math = oper == CCML_OPER_LOG || oper == CCML_OPER_EXP || oper == CCML_OPER_SIN || oper == CCML_OPER_SQT;
+            if (irs[i]->accuracy != CCML_ACCURACY_PRECISE && (math || ccml_is_fused(oper)) && irs[i]->width > fast_width) {
+                fast_width = irs[i]->width;
+            }
+        }
+    }
+    if (dialect == CCML_DIALECT_OPENCL && scatters) {
+        ccml_string_append(string, "void ccml_atomic_add(volatile __global float * address, float value) {\n"
+                           "\tunion { unsigned int bits; float value; } old, next;\n\tdo {\n"
+                           "\t\told.value = *address;\n\t\tnext.value = old.value + value;\n"
+                           "\t} while (atomic_cmpxchg((volatile __global unsigned int *)address, old.bits, next.bits) != old.bits);\n"
+                           "}\n\n");
+    }
+    if (random) {
+        if (dialect == CCML_DIALECT_C) ccml_string_append(string, "typedef unsigned int uint;\ntypedef unsigned long long ulong;\n\n");
+        ccml_string_append(string, "%s", ccml_random_source);
+    }
+    if (dialect == CCML_DIALECT_C && fast_width != 0) {
+        ccml_string_append(string, "typedef float ccml_floatv __attribute__((vector_size(%d)));\n", fast_width * 4);
+        ccml_string_append(string, "typedef int ccml_intv __attribute__((vector_size(%d)));\n\n", fast_width * 4);
+        ccml_string_append(string, "%s", ccml_fast_math_source);
+    }
+
+    for (int i = 0; i < n_irs; i++) {
+        ccml_string_append(string, "%s%s", i != 0 ? "\n" : "", ccml_new_kernel(ctx, irs[i], dialect));
+    }
+
+    return ccml_context_failed(ctx) ? NULL : string->data;
+}
+
+//
+//  ██████╗ ██╗███████╗██████╗  █████╗ ████████╗ ██████╗██╗  ██╗
+//  ██╔══██╗██║██╔════╝██╔══██╗██╔══██╗╚══██╔══╝██╔════╝██║  ██║
+//  ██║  ██║██║███████╗██████╔╝███████║   ██║   ██║     ███████║
+//  ██║  ██║██║╚════██║██╔═══╝ ██╔══██║   ██║   ██║     ██╔══██║
+//  ██████╔╝██║███████║██║     ██║  ██║   ██║   ╚██████╗██║  ██║
+//  ╚═════╝ ╚═╝╚══════╝╚═╝     ╚═╝  ╚═╝   ╚═╝    ╚═════╝╚═╝  ╚═╝
+//
+
+#if !defined(CCML_AUTOTUNE_FILE)
+    #define CCML_AUTOTUNE_FILE "ccml_autotune.txt"
+#endif
+
+#define CCML_TUNE_MAX 8
+#define CCML_TUNE_RUNS 3
+
+typedef struct ccml_dispatch {
+    size_t global[3];
+    size_t local[3];
+} ccml_dispatch;
+
+CCML_API ccml_dispatch ccml_new_dispatch(ccml_ir * ir, int local_x, int max_local) {
+    // local_x threads go along the first dim and whatever is left of max_local
+    // spreads over the other two, the global size is padded to whole work-groups
+    ccml_dispatch dispatch = {0};
+    int budget = max_local;
+
+    for (int i = 0; i < 3; i++) {
+        int local = i == 0 ? local_x : budget;
+        if (local > ir->threads[i]) local = ir->threads[i];
+        if (local > budget) local = budget;
+        if (local < 1) local = 1;
+
+        budget /= local;
+        dispatch.local[i] = local;
+        dispatch.global[i] = (ir->threads[i] + local - 1) / local * local;
+    }
+
+    return dispatch;
+}
+
+CCML_API int ccml_plan_local(ccml_ir * ir, int max_local, int multiple) {
+    // the biggest multiple of the simd width up to 256 threads, unless the kernel
+    // is too small to give every compute unit a group of that size anyway
+    int local_x = max_local < 256 ? max_local : 256;
+    if (multiple > 0 && local_x >= multiple) local_x = local_x / multiple * multiple;
+    while (local_x > multiple && local_x / 2 >= ir->threads[0]) local_x /= 2;
+
+    return local_x;
+}
+
+CCML_API int ccml_tune_candidates(int max_local, int multiple, int candidates[CCML_TUNE_MAX]) {
+    int n_candidates = 0;
+    for (int local_x = multiple > 0 ? multiple : 1; local_x <= max_local && n_candidates < CCML_TUNE_MAX; local_x *= 2) {
+        candidates[n_candidates++] = local_x;
+    }
+
+    return n_candidates;
+}
+
+// tuned local sizes persist across runs as "hash local_x" lines, the hash
+// covers the kernel source and the device so every pair is only tuned once
+
+CCML_API int ccml_autotune_load(uint64_t hash) {
+    FILE * file = fopen(CCML_AUTOTUNE_FILE, "r");
+    if (file == NULL) return 0;
+
+    unsigned long long key = 0;
+    int local_x = 0;
+    int result = 0;
+    while (fscanf(file, "%llx %d", &key, &local_x) == 2) {
+        if (key == hash) result = local_x;
+    }
+
+    fclose(file);
+    return result;
+}
+
+CCML_API void ccml_autotune_save(uint64_t hash, int local_x) {
+    FILE * file = fopen(CCML_AUTOTUNE_FILE, "a");
+    if (file == NULL) {
+        ccml_message(CCML_LOG_WARN, "failed to save tuning results to %s", CCML_AUTOTUNE_FILE);
+        return;
+    }
+
+    fprintf(file, "%016llx %d\n", (unsigned long long)hash, local_x);
+    fclose(file);
+}
+
+//
+//   ██████╗ █████╗  ██████╗██╗  ██╗███████╗
+//  ██╔════╝██╔══██╗██╔════╝██║  ██║██╔════╝
+//  ██║     ███████║██║     ███████║█████╗
+//  ██║     ██╔══██║██║     ██╔══██║██╔══╝
+//  ╚██████╗██║  ██║╚██████╗██║  ██║███████╗
+//   ╚═════╝╚═╝  ╚═╝ ╚═════╝╚═╝  ╚═╝╚══════╝
+//
+
+#if !defined(CCML_CACHE_MAX)
+    #define CCML_CACHE_MAX 256
+#endif
+
+// compiles are separate processes on cpus and driver builds on gpus, a few of them at a time
+// is all it takes to keep every core busy
+#if !defined(CCML_COMPILE_THREADS)
+    #define CCML_COMPILE_THREADS 4
+#endif
+
+// a backend compiles kernel sources for a target (an opencl device, nothing on cpus) into
+// programs, and releases them once they're dropped from the cache
+typedef void * (*ccml_compile_fn)(const char * source, void * target, ccml_status * status);
+typedef void (*ccml_release_fn)(void * program);
+
+// compiled kernels stay loaded for the lifetime of the process (or of their target), keyed by
+// the hash of their source. the source is all a kernel depends on, so re-executions, identical
+// graphs and every row count of a bucket share one compiled program, once full new ones are
+// compiled every time. entries exist from the moment their compile is queued, so a kernel is
+// only ever compiled once
+typedef enum ccml_cache_status {
+    CCML_CACHE_EMPTY,
+    CCML_CACHE_PENDING,
+    CCML_CACHE_READY,
+    CCML_CACHE_FAILED
+} ccml_cache_status;
+
+typedef struct ccml_compile_job {
+    int entry;
+    char * source;
+    ccml_compile_fn compile;
+    void * target;
+    ccml_ready_hook on_ready;
+    void * user;
+} ccml_compile_job;
+
+typedef struct ccml_kernel_cache {
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    pthread_cond_t queued;
+    int n_entries;
+    uint64_t hashes[CCML_CACHE_MAX];
+    void * targets[CCML_CACHE_MAX];
+    void * programs[CCML_CACHE_MAX];
+    ccml_release_fn releases[CCML_CACHE_MAX];
+    ccml_cache_status statuses[CCML_CACHE_MAX];
+    ccml_status errors[CCML_CACHE_MAX];
+    // every pending entry has one job waiting for or running on the compile pool
+    int head;
+    int n_queued;
+    ccml_compile_job * jobs[CCML_CACHE_MAX];
+    bool started;
+    bool stopping;
+    ccml_pool pool;
+} ccml_kernel_cache;
+
+static ccml_kernel_cache ccml_cache_state = {
+    .lock   = PTHREAD_MUTEX_INITIALIZER,
+    .done   = PTHREAD_COND_INITIALIZER,
+    .queued = PTHREAD_COND_INITIALIZER
+};
+
+CCML_API void ccml_compile_task(ccml_compile_job * job) {
+    ccml_status status = CCML_STATUS_OK;
+    void * program = job->compile(job->source, job->target, &status);
+
+    // the program is published in one step, executions either see it whole or not at all
+    pthread_mutex_lock(&ccml_cache_state.lock);
+    ccml_cache_state.programs[job->entry] = program;
+    ccml_cache_state.errors[job->entry] = status;
+    ccml_cache_state.statuses[job->entry] = program != NULL ? CCML_CACHE_READY : CCML_CACHE_FAILED;
+    pthread_cond_broadcast(&ccml_cache_state.done);
+    pthread_mutex_unlock(&ccml_cache_state.lock);
+
+    if (job->on_ready != NULL) job->on_ready(status, job->user);
+    free(job->source);
+    free(job);
+}
+
+CCML_API void ccml_compile_worker(void * arg, int worker, int n_workers) {
+    // the workers of the compile pool take jobs off the queue until ccml_cache_free stops
+    // them, the jobs queued by then are finished first
+    (void)arg;
+    (void)worker;
+    (void)n_workers;
+
+    pthread_mutex_lock(&ccml_cache_state.lock);
+    while (true) {
+        while (ccml_cache_state.n_queued == 0 && !ccml_cache_state.stopping) {
+            pthread_cond_wait(&ccml_cache_state.queued, &ccml_cache_state.lock);
+        }
+        if (ccml_cache_state.n_queued == 0) break;
+
+        ccml_compile_job * job = ccml_cache_state.jobs[ccml_cache_state.head];
+        ccml_cache_state.head = (ccml_cache_state.head + 1) % CCML_CACHE_MAX;
+        ccml_cache_state.n_queued--;
+
+        pthread_mutex_unlock(&ccml_cache_state.lock);
+        ccml_compile_task(job);
+        pthread_mutex_lock(&ccml_cache_state.lock);
+    }
+    pthread_mutex_unlock(&ccml_cache_state.lock);
+}
+
+CCML_API int ccml_cache_request(uint64_t hash, const char * source, ccml_compile_fn compile, ccml_release_fn release,
+                                void * target, ccml_ready_hook on_ready, void * user) {
+    // the entry of the kernel, whose compile is queued on the compile pool unless it's compiled
+    // or compiling already. failed compiles are retried, -1 means the cache is full
+    pthread_mutex_lock(&ccml_cache_state.lock);
+    int entry = -1;
+    int empty = -1;
+    for (int i = 0; i < ccml_cache_state.n_entries && entry == -1; i++) {
+        bool used = ccml_cache_state.statuses[i] != CCML_CACHE_EMPTY;
+        if (used && ccml_cache_state.hashes[i] == hash && ccml_cache_state.targets[i] == target) entry = i;
+        if (!used && empty == -1) empty = i;
+    }
+
+    if (entry == -1 && empty == -1 && ccml_cache_state.n_entries < CCML_CACHE_MAX) {
+        empty = ccml_cache_state.n_entries++;
+    }
+    bool queue = entry == -1 ? empty != -1 : ccml_cache_state.statuses[entry] == CCML_CACHE_FAILED;
+    if (entry == -1 && queue) {
+        entry = empty;
+        ccml_cache_state.hashes[entry] = hash;
+        ccml_cache_state.targets[entry] = target;
+        ccml_cache_state.releases[entry] = release;
+    }
+
+    if (queue) {
+        ccml_compile_job * job = malloc(sizeof(ccml_compile_job));
+        CCML_ASSERT(job != NULL, "failed to allocate a compile job");
+        *job = (ccml_compile_job) {
+            .entry    = entry,
+            .source   = strdup(source),
+            .compile  = compile,
+            .target   = target,
+            .on_ready = on_ready,
+            .user     = user
+        };
+
+        // the pool is started by the first compile and shared by every graph and backend
+        if (!ccml_cache_state.started) {
+            ccml_pool_init(&ccml_cache_state.pool, CCML_COMPILE_THREADS, false);
+            ccml_pool_start(&ccml_cache_state.pool, ccml_compile_worker, NULL);
+            ccml_cache_state.started = true;
+        }
+
+        int tail = (ccml_cache_state.head + ccml_cache_state.n_queued++) % CCML_CACHE_MAX;
+        ccml_cache_state.jobs[tail] = job;
+        ccml_cache_state.statuses[entry] = CCML_CACHE_PENDING;
+        pthread_cond_signal(&ccml_cache_state.queued);
+    }
+    pthread_mutex_unlock(&ccml_cache_state.lock);
+
+    return entry;
+}
+
+CCML_API void * ccml_cache_wait(int entry, bool block, ccml_status * status) {
+    // without blocking a kernel that's still compiling comes back as NULL with no error
+    pthread_mutex_lock(&ccml_cache_state.lock);
+    while (block && ccml_cache_state.statuses[entry] == CCML_CACHE_PENDING) {
+        pthread_cond_wait(&ccml_cache_state.done, &ccml_cache_state.lock);
+    }
+
+    ccml_cache_status state = ccml_cache_state.statuses[entry];
+    void * program = state == CCML_CACHE_READY ? ccml_cache_state.programs[entry] : NULL;
+    *status = state == CCML_CACHE_FAILED ? ccml_cache_state.errors[entry] : CCML_STATUS_OK;
+    pthread_mutex_unlock(&ccml_cache_state.lock);
+
+    return program;
+}
+
+CCML_API int ccml_cache_count(void) {
+    // programs compiled or still compiling, one for every kernel source and target
+    pthread_mutex_lock(&ccml_cache_state.lock);
+    int count = 0;
+    for (int i = 0; i < ccml_cache_state.n_entries; i++) {
+        count += ccml_cache_state.statuses[i] != CCML_CACHE_EMPTY;
+    }
+    pthread_mutex_unlock(&ccml_cache_state.lock);
+
+    return count;
+}
+
+CCML_API void ccml_cache_forget(void * target) {
+    // the programs of a target that goes away are released and their entries reused, the
+    // ones still compiling finish first
+    pthread_mutex_lock(&ccml_cache_state.lock);
+    for (int i = 0; i < ccml_cache_state.n_entries; i++) {
+        if (ccml_cache_state.statuses[i] == CCML_CACHE_EMPTY || ccml_cache_state.targets[i] != target) continue;
+
+        while (ccml_cache_state.statuses[i] == CCML_CACHE_PENDING) {
+            pthread_cond_wait(&ccml_cache_state.done, &ccml_cache_state.lock);
+        }
+        if (ccml_cache_state.statuses[i] == CCML_CACHE_READY) ccml_cache_state.releases[i](ccml_cache_state.programs[i]);
+        ccml_cache_state.statuses[i] = CCML_CACHE_EMPTY;
+    }
+    pthread_mutex_unlock(&ccml_cache_state.lock);
+}
+
+CCML_API void ccml_cache_clear(void) {
+    // no graph may be executing while the programs are released, compiles still running finish first
+    pthread_mutex_lock(&ccml_cache_state.lock);
+    for (int i = 0; i < ccml_cache_state.n_entries; i++) {
+        while (ccml_cache_state.statuses[i] == CCML_CACHE_PENDING) {
+            pthread_cond_wait(&ccml_cache_state.done, &ccml_cache_state.lock);
+        }
+        if (ccml_cache_state.statuses[i] == CCML_CACHE_READY) ccml_cache_state.releases[i](ccml_cache_state.programs[i]);
+        ccml_cache_state.statuses[i] = CCML_CACHE_EMPTY;
+    }
+    ccml_cache_state.n_entries = 0;
+    pthread_mutex_unlock(&ccml_cache_state.lock);
+}
+
+CCML_API void ccml_cache_free(void) {
+    // stops and joins the compile pool once the queued compiles are done, then releases every
+    // program. no graph may be executing meanwhile, the next compile starts the pool again
+    pthread_mutex_lock(&ccml_cache_state.lock);
+    bool started = ccml_cache_state.started;
+    ccml_cache_state.stopping = true;
+    pthread_cond_broadcast(&ccml_cache_state.queued);
+    pthread_mutex_unlock(&ccml_cache_state.lock);
+
+    if (started) {
+        ccml_pool_wait(&ccml_cache_state.pool);
+        ccml_pool_free(&ccml_cache_state.pool);
+    }
+
+    pthread_mutex_lock(&ccml_cache_state.lock);
+    ccml_cache_state.started = false;
+    ccml_cache_state.stopping = false;
+    pthread_mutex_unlock(&ccml_cache_state.lock);
+    ccml_cache_clear();
+}
+
+//
+//  ██████╗  █████╗  ██████╗██╗  ██╗███████╗███╗   ██╗██████╗
+//  ██╔══██╗██╔══██╗██╔════╝██║ ██╔╝██╔════╝████╗  ██║██╔══██╗
+//  ██████╔╝███████║██║     █████╔╝ █████╗  ██╔██╗ ██║██║  ██║
+//  ██╔══██╗██╔══██║██║     ██╔═██╗ ██╔══╝  ██║╚██╗██║██║  ██║
+//  ██████╔╝██║  ██║╚██████╗██║  ██╗███████╗██║ ╚████║██████╔╝
+//  ╚═════╝ ╚═╝  ╚═╝ ╚═════╝╚═╝  ╚═╝╚══════╝╚═╝  ╚═══╝╚═════╝
+//
+//  ███╗   ███╗███████╗████████╗ █████╗ ██╗
+//  ████╗ ████║██╔════╝╚══██╔══╝██╔══██╗██║
+//  ██╔████╔██║█████╗     ██║   ███████║██║
+//  ██║╚██╔╝██║██╔══╝     ██║   ██╔══██║██║
+//  ██║ ╚═╝ ██║███████╗   ██║   ██║  ██║███████╗
+//  ╚═╝     ╚═╝╚══════╝   ╚═╝   ╚═╝  ╚═╝╚══════╝
+//
+
+#if defined(CCML_BACKEND_METAL)
+
+#import <Foundation/Foundation.h>
+#import <Metal/Metal.h>
+
+// wrapping in an ifdef block since metal backend is written in objective-C
+
+CCML_API const char * ccml_new_kernel_metal(ccml_context * ctx, struct ccml_graph * graph,
+                                            int n_kernel, int start, int finish) {
+    ccml_ir * ir = ccml_new_ir(ctx, graph, n_kernel, start, finish);
+    return ccml_new_program(ctx, &ir, 1, CCML_DIALECT_METAL);
+}
+
+CCML_API double ccml_run_metal(id<MTLCommandQueue> command_queue, id<MTLComputePipelineState> pipeline_state,
+                               ccml_graph * graph, ccml_ir * ir, id<MTLBuffer> * buffers, ccml_dispatch dispatch) {
+    // command buffer and compute command encoder
+    id<MTLCommandBuffer> command_buffer = [command_queue commandBuffer];
+    id<MTLComputeCommandEncoder> compute_encoder = [command_buffer computeCommandEncoder];
+
+    [compute_encoder setComputePipelineState:pipeline_state];
+
+    int buffer_counter = 0;
+    for (int i = 0; i < graph->n_nodes; i++) {
+        ccml_tensor * tensor = graph->nodes[i];
+        if (tensor != NULL && ccml_has_buffer(tensor)) {
+            [compute_encoder setBuffer:buffers[i] offset:0 atIndex:buffer_counter++];
+        }
+    }
+
+    // the live row count follows the buffers for kernels compiled against a symbolic leading dim
+    if (ir->rows != 0) {
+        [compute_encoder setBytes:&ir->rows length:sizeof(int) atIndex:buffer_counter];
+    }
+
+    MTLSize grid_size = MTLSizeMake(dispatch.global[0], dispatch.global[1], dispatch.global[2]);
+    MTLSize thread_group_size = MTLSizeMake(dispatch.local[0], dispatch.local[1], dispatch.local[2]);
+    [compute_encoder dispatchThreads:grid_size threadsPerThreadgroup:thread_group_size];
+
+    // end encoding and commit command buffer
+    [compute_encoder endEncoding];
+    [command_buffer commit];
+    [command_buffer waitUntilCompleted];
+
+    return command_buffer.GPUEndTime - command_buffer.GPUStartTime;
+}
+
+CCML_API int ccml_tune_metal(id<MTLCommandQueue> command_queue, id<MTLComputePipelineState> pipeline_state,
+                             ccml_graph * graph, id<MTLBuffer> * buffers, ccml_ir * ir, int max_local, int multiple) {
+    int candidates[CCML_TUNE_MAX];
+    int n_candidates = ccml_tune_candidates(max_local, multiple, candidates);
+    int best_local = candidates[0];
+    double best_time = INFINITY;
+
+    for (int i = 0; i < n_candidates; i++) {
+        ccml_dispatch dispatch = ccml_new_dispatch(ir, candidates[i], max_local);
+        for (int j = 0; j < CCML_TUNE_RUNS; j++) {
+            double time = ccml_run_metal(command_queue, pipeline_state, graph, ir, buffers, dispatch);
+            if (time < best_time) {
+                best_time = time;
+                best_local = candidates[i];
+            }
+        }
+    }
+
+    return best_local;
+}
+
+CCML_API void * ccml_compile_metal(const char * source, void * target, ccml_status * status) {
+    // every kernel is a library of its own built for the device it runs on. this runs on
+    // compiler threads, so nothing here may touch the arena of a context
+    *status = CCML_STATUS_OK;
+    @autoreleasepool {
+        NSError * error = nil;
+        id<MTLDevice> device = (__bridge id<MTLDevice>)target;
+        id<MTLLibrary> library = [device newLibraryWithSource:[NSString stringWithUTF8String:source] options:nil
+                                                        error:&error];
+        if (!library) {
+            ccml_message(CCML_LOG_ERROR, "failed to create MTLLibrary: %s", [[error localizedDescription] UTF8String]);
+            *status = CCML_STATUS_COMPILE_FAILED;
+            return NULL;
+        }
+
+        return (__bridge void *)library;
+    }
+}
+
+CCML_API void ccml_release_metal(void * library) {
+    CFRelease(library);
+}
+
+CCML_API ccml_status ccml_execute_graph_metal(ccml_context * ctx, ccml_graph * graph) {
+    // only the kernels downstream of changed inputs run, the rest of the results are
+    // still cached on the host from the last execution
+    double start = ccml_profile_time();
+    ccml_ir * irs[CCML_KERN_MAX];
+    int n_irs = ccml_new_dirty_irs(ctx, graph, irs);
+    if (ccml_context_failed(ctx)) return ctx->status;
+    if (n_irs == 0) return CCML_STATUS_OK;
+
+    const char * sources[CCML_KERN_MAX];
+    for (int k = 0; k < n_irs; k++) {
+        ccml_ir_vectorize(irs[k], 4);
+        sources[k] = ccml_new_program(ctx, &irs[k], 1, CCML_DIALECT_METAL);
+        if (sources[k] == NULL) return ctx->status;
+        ccml_message(CCML_LOG_DEBUG, "kernel source:\n%s", sources[k]);
+    }
+    ccml_profile_phase(&graph->profile, CCML_PHASE_CODEGEN, 0, start);
+
+    @autoreleasepool {
+        // Errors
+        NSError * error = nil;
+
+        // initialise metal
+        start = ccml_profile_time();
+        id<MTLDevice> device = MTLCreateSystemDefaultDevice();
+        if (!device) {
+            ccml_message(CCML_LOG_ERROR, "no metal device found");
+            return CCML_STATUS_NO_DEVICE;
+        }
+
+        // libraries are built on the compile pool and shared through the kernel cache like
+        // the other backends, all of them are queued before any is waited for. nothing stands
+        // in for one still building, so async graphs run nothing until all of them are built
+        ccml_status status = CCML_STATUS_OK;
+        int entries[CCML_KERN_MAX];
+        for (int k = 0; k < n_irs; k++) {
+            entries[k] = ccml_cache_request(ccml_hash_string(sources[k]), sources[k], ccml_compile_metal,
+                                            ccml_release_metal, (__bridge void *)device, graph->on_ready, graph->user);
+        }
+
+        void * libraries[CCML_KERN_MAX] = {NULL};
+        bool owned[CCML_KERN_MAX] = {false};
+        for (int k = 0; k < n_irs && status == CCML_STATUS_OK; k++) {
+            if (entries[k] == -1) {
+                libraries[k] = ccml_compile_metal(sources[k], (__bridge void *)device, &status);
+                owned[k] = libraries[k] != NULL;
+            } else {
+                libraries[k] = ccml_cache_wait(entries[k], !graph->async_compile, &status);
+            }
+            if (libraries[k] == NULL && status == CCML_STATUS_OK) status = CCML_STATUS_NOT_READY;
+        }
+
+        // create compute functions and GPU pipelines, one per kernel
+        id<MTLComputePipelineState> pipeline_states[CCML_KERN_MAX] = {nil};
+        for (int k = 0; k < n_irs && status == CCML_STATUS_OK; k++) {
+            id<MTLLibrary> library = (__bridge id<MTLLibrary>)libraries[k];
+            NSString * name = [NSString stringWithFormat:@"my_kernel_%d", irs[k]->n_kernel];
+            id<MTLFunction> function = [library newFunctionWithName:name];
+            pipeline_states[k] = [device newComputePipelineStateWithFunction:function error:&error];
+            if (!pipeline_states[k]) {
+                ccml_message(CCML_LOG_ERROR, "failed to create pipeline: %s", [[error localizedDescription] UTF8String]);
+                status = CCML_STATUS_COMPILE_FAILED;
+            }
+        }
+        for (int k = 0; k < n_irs; k++) {
+            if (owned[k]) ccml_release_metal(libraries[k]);
+        }
+        if (status != CCML_STATUS_OK) return status;
+
+        id<MTLCommandQueue> command_queue = [device newCommandQueue];
+        ccml_profile_phase(&graph->profile, CCML_PHASE_COMPILE, 0, start);
+
+        // sums start out from zero and max reductions from -inf in the buffers copied over
+        for (int k = 0; k < n_irs; k++) {
+            ccml_clear_sums(irs[k], graph);
+        }
+
+        // data for buffers
+        start = ccml_profile_time();
+        id<MTLBuffer> buffers[CCML_NODE_MAX] = {NULL};
+        for (int i = 0; i < graph->n_nodes; i++) {
+            ccml_tensor * tensor = graph->nodes[i];
+            if (tensor != NULL && ccml_has_buffer(tensor)) {
+                buffers[i] = [device newBufferWithBytes:tensor->data length:ccml_size(tensor) * sizeof(float)
+                                                options:MTLResourceStorageModeShared];
+            }
+        }
+        ccml_profile_phase(&graph->profile, CCML_PHASE_UPLOAD, 0, start);
+
+        // the pipeline's thread limit already accounts for the kernel's register use
+        int local[CCML_KERN_MAX];
+        int limit[CCML_KERN_MAX];
+        for (int k = 0; k < n_irs; k++) {
+            limit[k] = (int)pipeline_states[k].maxTotalThreadsPerThreadgroup;
+            int multiple = (int)pipeline_states[k].threadExecutionWidth;
+            local[k] = ccml_plan_local(irs[k], limit[k], multiple);
+
+#if defined(CCML_AUTOTUNE)
+            uint64_t hash = ccml_hash_string(sources[k]) ^ ccml_hash_string([[device name] UTF8String]) ^
+                            irs[k]->n_kernel;
+
+            local[k] = ccml_autotune_load(hash);
+            if (local[k] == 0) {
+                local[k] = ccml_tune_metal(command_queue, pipeline_states[k], graph, buffers, irs[k], limit[k], multiple);
+                ccml_autotune_save(hash, local[k]);
+
+                // tuning runs accumulate into the intermediary buffers, so the inputs are copied again
+                for (int i = 0; i < graph->n_nodes; i++) {
+                    ccml_tensor * tensor = graph->nodes[i];
+                    if (ccml_has_buffer(tensor)) {
+                        memcpy([buffers[i] contents], tensor->data, ccml_size(tensor) * sizeof(float));
+                    }
+                }
+            }
+#endif
+        }
+
+        // dispatch threads, the gpu time leaves out the command buffer's scheduling overhead
+        for (int k = 0; k < n_irs; k++) {
+            start = ccml_profile_time();
+            double duration = ccml_run_metal(command_queue, pipeline_states[k], graph, irs[k], buffers,
+                                             ccml_new_dispatch(irs[k], local[k], limit[k]));
+            ccml_profile_event(&graph->profile, (ccml_event) {
+                .phase       = CCML_PHASE_RUN,
+                .kernel      = irs[k]->n_kernel,
+                .device      = 0,
+                .start_node  = irs[k]->start,
+                .finish_node = irs[k]->finish,
+                .start       = start,
+                .duration    = duration
+            });
+        }
+
+        // copy everything the kernels wrote back into the tensors, intermediaries included
+        // so that kernels skipped by later executions find their inputs on the host
+        start = ccml_profile_time();
+        for (int k = 0; k < n_irs; k++) {
+            for (int i = 0; i < irs[k]->n_ops; i++) {
+                int written = ccml_ir_op_writes(&irs[k]->ops[i]);
+                if (written == -1) continue;
+
+                ccml_tensor * tensor = graph->nodes[written];
+                memcpy(tensor->data, [buffers[written] contents], ccml_size(tensor) * sizeof(float));
+            }
+        }
+        ccml_profile_phase(&graph->profile, CCML_PHASE_DOWNLOAD, 0, start);
+    }
+
+    return CCML_STATUS_OK;
+}
+
+#else
+
+CCML_API const char * ccml_new_kernel_metal(ccml_context *, ccml_graph *, int, int, int);
+CCML_API ccml_status ccml_execute_graph_metal(ccml_context *, ccml_graph *);
+
+#endif /* defined(__APPLE__) */
+
+//
+//  ██████╗  █████╗  ██████╗██╗  ██╗███████╗███╗   ██╗██████╗
+//  ██╔══██╗██╔══██╗██╔════╝██║ ██╔╝██╔════╝████╗  ██║██╔══██╗
+//  ██████╔╝███████║██║     █████╔╝ █████╗  ██╔██╗ ██║██║  ██║
+//  ██╔══██╗██╔══██║██║     ██╔═██╗ ██╔══╝  ██║╚██╗██║██║  ██║
+//  ██████╔╝██║  ██║╚██████╗██║  ██╗███████╗██║ ╚████║██████╔╝
+//  ╚═════╝ ╚═╝  ╚═╝ ╚═════╝╚═╝  ╚═╝╚══════╝╚═╝  ╚═══╝╚═════╝
+//
+//   ██████╗ ██████╗ ███████╗███╗   ██╗ ██████╗██╗
+//  ██╔═══██╗██╔══██╗██╔════╝████╗  ██║██╔════╝██║
+//  ██║   ██║██████╔╝█████╗  ██╔██╗ ██║██║     ██║
+//  ██║   ██║██╔═══╝ ██╔══╝  ██║╚██╗██║██║     ██║
+//  ╚██████╔╝██║     ███████╗██║ ╚████║╚██████╗███████╗
+//   ╚═════╝ ╚═╝     ╚══════╝╚═╝  ╚═══╝ ╚═════╝╚══════╝
+//
+
+#if defined(CCML_BACKEND_OPENCL)
+
+#if defined(__APPLE__)
+    #include <OpenCL/opencl.h>
+#else
+    #include <CL/cl.h>
+#endif
+
+CCML_API const char * ccml_new_kernel_opencl(ccml_context * ctx, struct ccml_graph * graph,
+                                             int n_kernel, int start, int finish) {
+    ccml_ir * ir = ccml_new_ir(ctx, graph, n_kernel, start, finish);
+    return ccml_new_program(ctx, &ir, 1, CCML_DIALECT_OPENCL);
+}
+
+CCML_API ccml_status ccml_check_error_opencl(cl_int err, const char * operation) {
+    if (err != CL_SUCCESS) {
+        ccml_message(CCML_LOG_ERROR, "error during operation '%s': %d", operation, err);
+        return CCML_STATUS_BACKEND_FAILED;
+    }
+
+    return CCML_STATUS_OK;
+}
+
+// every opencl call in a function goes through this, failures release what was created so far
+#define CCML_CHECK_OPENCL(err, operation) do {                                             \
+    status = ccml_check_error_opencl(err, operation);                                      \
+    if (status != CCML_STATUS_OK) goto cleanup;                                            \
+} while (0)
+
+CCML_API ccml_status ccml_tune_opencl(cl_command_queue command_queue, cl_kernel kernel,
+                                      ccml_ir * ir, int max_local, int multiple, int * best_local) {
+    ccml_status status = CCML_STATUS_OK;
+    int candidates[CCML_TUNE_MAX];
+    int n_candidates = ccml_tune_candidates(max_local, multiple, candidates);
+    double best_time = INFINITY;
+    *best_local = candidates[0];
+
+    for (int i = 0; i < n_candidates; i++) {
+        ccml_dispatch dispatch = ccml_new_dispatch(ir, candidates[i], max_local);
+        for (int j = 0; j < CCML_TUNE_RUNS; j++) {
+            double start = ccml_time();
+            cl_int ret = clEnqueueNDRangeKernel(command_queue, kernel, 3, NULL, dispatch.global,
+                                                dispatch.local, 0, NULL, NULL);
+            CCML_CHECK_OPENCL(ret, "clEnqueueNDRangeKernel");
+            clFinish(command_queue);
+
+            double time = ccml_time() - start;
+            if (time < best_time) {
+                best_time = time;
+                *best_local = candidates[i];
+            }
+        }
+    }
+
+cleanup:
+    return status;
+}
+
+typedef struct ccml_device_opencl {
+    cl_device_id device;
+    cl_context context;
+    cl_command_queue command_queue;
+    cl_mem buffers[CCML_NODE_MAX];
+} ccml_device_opencl;
+
+// what a graph keeps on its devices between executions. results stay wherever their kernel
+// left them and only move when the host or a kernel sharded differently needs them
+typedef struct ccml_state_opencl {
+    int n_devices;
+    ccml_device_opencl devices[CCML_DEVICE_MAX];
+    ccml_tensor * tensors[CCML_NODE_MAX]; // the tensors the buffers of each node were created for
+    int versions[CCML_NODE_MAX];          // tensor versions as of the end of the last execution
+    bool on_device[CCML_NODE_MAX];        // the devices hold the latest values, laid out as below
+    bool on_host[CCML_NODE_MAX];          // the host holds them as well
+    ccml_shard shards[CCML_NODE_MAX];
+    int n_shards[CCML_NODE_MAX];
+} ccml_state_opencl;
+
+CCML_API int ccml_get_devices_opencl(cl_device_id * devices) {
+    cl_platform_id platforms[CCML_DEVICE_MAX];
+    cl_uint n_platforms = 0;
+    cl_int ret = clGetPlatformIDs(CCML_DEVICE_MAX, platforms, &n_platforms);
+    if (ccml_check_error_opencl(ret, "clGetPlatformIDs") != CCML_STATUS_OK || n_platforms == 0) return 0;
+
+#if defined(CCML_MULTI_DEVICE)
+    // every device of every platform gets a shard, cpu devices are further split
+    // into their numa nodes so that each shard works out of its local memory
+    int n_devices = 0;
+    for (int i = 0; i < (int)n_platforms && n_devices < CCML_DEVICE_MAX; i++) {
+        cl_device_id found[CCML_DEVICE_MAX];
+        cl_uint n_found = 0;
+        if (clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_ALL, CCML_DEVICE_MAX, found, &n_found) != CL_SUCCESS) continue;
+
+        for (int j = 0; j < (int)n_found && n_devices < CCML_DEVICE_MAX; j++) {
+            cl_device_type type = 0;
+            clGetDeviceInfo(found[j], CL_DEVICE_TYPE, sizeof(type), &type, NULL);
+
+            cl_device_id subdevices[CCML_DEVICE_MAX];
+            cl_uint n_subdevices = 0;
+        #if defined(CCML_SUBDEVICE_UNITS)
+            cl_device_partition_property properties[] = {
+                CL_DEVICE_PARTITION_EQUALLY, CCML_SUBDEVICE_UNITS, 0
+            };
+        #else
+            cl_device_partition_property properties[] = {
+                CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN, CL_DEVICE_AFFINITY_DOMAIN_NUMA, 0
+            };
+        #endif
+            if (type & CL_DEVICE_TYPE_CPU) {
+                ret = clCreateSubDevices(found[j], properties, CCML_DEVICE_MAX, subdevices, &n_subdevices);
+                if (ret != CL_SUCCESS) n_subdevices = 0;
+            }
+
+            if (n_subdevices > 1) {
+                for (int k = 0; k < (int)n_subdevices && n_devices < CCML_DEVICE_MAX; k++) {
+                    devices[n_devices++] = subdevices[k];
+                }
+            } else {
+                devices[n_devices++] = found[j];
+            }
+        }
+    }
+
+    return n_devices;
+#else
+    ret = clGetDeviceIDs(platforms[0], CL_DEVICE_TYPE_DEFAULT, 1, devices, NULL);
+    return ccml_check_error_opencl(ret, "clGetDeviceIDs") == CCML_STATUS_OK;
+#endif
+}
+
+CCML_API void ccml_free_graph_opencl(ccml_graph * graph) {
+    ccml_state_opencl * state = graph->backend;
+    if (state == NULL) return;
+
+    for (int d = 0; d < state->n_devices; d++) {
+        ccml_device_opencl * device = &state->devices[d];
+        for (int i = 0; i < CCML_NODE_MAX; i++) {
+            if (device->buffers[i] != NULL) clReleaseMemObject(device->buffers[i]);
+        }
+
+        // programs are cached per device and go with their context
+        ccml_cache_forget(device);
+        if (device->command_queue != NULL) clReleaseCommandQueue(device->command_queue);
+        if (device->context != NULL) clReleaseContext(device->context);
+    }
+
+    free(state);
+    graph->backend = NULL;
+}
+
+CCML_API ccml_status ccml_new_state_opencl(ccml_graph * graph) {
+    // the devices are set up by the first execution and kept until the graph is freed
+    cl_device_id device_ids[CCML_DEVICE_MAX];
+    int n_devices = ccml_get_devices_opencl(device_ids);
+    if (n_devices == 0) {
+        ccml_message(CCML_LOG_ERROR, "no opencl devices found");
+        return CCML_STATUS_NO_DEVICE;
+    }
+
+    ccml_state_opencl * state = calloc(1, sizeof(ccml_state_opencl));
+    CCML_ASSERT(state != NULL, "failed to allocate the opencl state");
+    graph->backend = state;
+
+    ccml_status status = CCML_STATUS_OK;
+    for (int d = 0; d < n_devices; d++) {
+        ccml_device_opencl * device = &state->devices[state->n_devices++];
+        device->device = device_ids[d];
+
+        cl_int ret;
+        device->context = clCreateContext(NULL, 1, &device->device, NULL, NULL, &ret);
+        CCML_CHECK_OPENCL(ret, "clCreateContext");
+
+        cl_command_queue_properties properties = CCML_PROFILE_ENABLED ? CL_QUEUE_PROFILING_ENABLE : 0;
+        device->command_queue = clCreateCommandQueue(device->context, device->device, properties, &ret);
+        CCML_CHECK_OPENCL(ret, "clCreateCommandQueue");
+    }
+
+cleanup:
+    if (status != CCML_STATUS_OK) ccml_free_graph_opencl(graph);
+    return status;
+}
+
+CCML_API void ccml_sync_opencl(ccml_state_opencl * state, ccml_graph * graph) {
+    // retracing can put another tensor behind a node, which then gets buffers of its own.
+    // tensors whose version moved since the last execution were written on the host
+    for (int i = 0; i < graph->n_nodes; i++) {
+        ccml_tensor * tensor = graph->nodes[i];
+        if (!ccml_has_buffer(tensor)) continue;
+
+        if (state->tensors[i] != tensor) {
+            for (int d = 0; d < state->n_devices; d++) {
+                if (state->devices[d].buffers[i] != NULL) clReleaseMemObject(state->devices[d].buffers[i]);
+                state->devices[d].buffers[i] = NULL;
+            }
+            state->tensors[i] = tensor;
+            state->versions[i] = -1;
+        }
+
+        if (state->versions[i] != tensor->version) {
+            state->on_device[i] = false;
+            state->on_host[i] = true;
+        }
+    }
+}
+
+CCML_API ccml_status ccml_alloc_opencl(ccml_state_opencl * state, ccml_graph * graph, int d) {
+    // a device only gets buffers once a kernel runs on it, every one of them is the whole
+    // tensor and shards of split ones sit at its start
+    ccml_status status = CCML_STATUS_OK;
+    ccml_device_opencl * device = &state->devices[d];
+    for (int i = 0; i < graph->n_nodes; i++) {
+        ccml_tensor * tensor = graph->nodes[i];
+        if (!ccml_has_buffer(tensor) || device->buffers[i] != NULL) continue;
+
+        cl_int ret;
+        cl_mem_flags flags = tensor->oper == CCML_OPER_SAVE ? CL_MEM_WRITE_ONLY :
+                             graph->readonly[i] ? CL_MEM_READ_ONLY : CL_MEM_READ_WRITE;
+        device->buffers[i] = clCreateBuffer(device->context, flags, ccml_size(tensor) * sizeof(float), NULL, &ret);
+        CCML_CHECK_OPENCL(ret, "clCreateBuffer");
+    }
+
+cleanup:
+    return status;
+}
+
+CCML_API ccml_status ccml_download_opencl(ccml_context * ctx, ccml_state_opencl * state, ccml_graph * graph, int node) {
+    // split values are gathered back into place, partial sums are added up on the host and
+    // partial maxima maxed
+    ccml_status status = CCML_STATUS_OK;
+    ccml_tensor * tensor = graph->nodes[node];
+    ccml_shard shard = state->shards[node];
+    bool reduce = shard == CCML_SHARD_REDUCE || shard == CCML_SHARD_MAX;
+    int n_shards = shard == CCML_SHARD_COPY ? 1 : state->n_shards[node];
+    int size = shard == CCML_SHARD_SPLIT ? ccml_size(tensor) / n_shards : ccml_size(tensor);
+    float * partial = reduce ? ccml_malloc(ctx, size * sizeof(float)) : NULL;
+    if (reduce && partial == NULL) return ctx->status;
+
+    for (int d = 0; d < n_shards; d++) {
+        float * data = tensor->data;
+        if (shard == CCML_SHARD_SPLIT) data += d * size;
+        if (reduce && d != 0) data = partial;
+
+        cl_int ret = clEnqueueReadBuffer(state->devices[d].command_queue, state->devices[d].buffers[node], CL_TRUE,
+                                         0, size * sizeof(float), data, 0, NULL, NULL);
+        CCML_CHECK_OPENCL(ret, "clEnqueueReadBuffer");
+
+        for (int j = 0; data == partial && j < size; j++) {
+            tensor->data[j] = shard == CCML_SHARD_MAX ? fmaxf(tensor->data[j], partial[j]) : tensor->data[j] + partial[j];
+        }
+    }
+    state->on_host[node] = true;
+
+cleanup:
+    return status;
+}
+
+CCML_API ccml_status ccml_upload_opencl(ccml_state_opencl * state, ccml_graph * graph, int node,
+                                        ccml_shard shard, int n_shards) {
+    // every device gets its slice of split values and the whole of copied ones, partial results
+    // carry on from the values on the first device and start out from zero or -inf on the others
+    ccml_status status = CCML_STATUS_OK;
+    ccml_tensor * tensor = graph->nodes[node];
+    int size = shard == CCML_SHARD_SPLIT ? ccml_size(tensor) / n_shards : ccml_size(tensor);
+
+    for (int d = 0; d < n_shards; d++) {
+        ccml_device_opencl * device = &state->devices[d];
+        if ((shard == CCML_SHARD_REDUCE || shard == CCML_SHARD_MAX) && d != 0) {
+            float value = shard == CCML_SHARD_MAX ? -INFINITY : 0.0f;
+            cl_int ret = clEnqueueFillBuffer(device->command_queue, device->buffers[node], &value, sizeof(float), 0,
+                                             size * sizeof(float), 0, NULL, NULL);
+            CCML_CHECK_OPENCL(ret, "clEnqueueFillBuffer");
+        } else {
+            float * data = shard == CCML_SHARD_SPLIT ? tensor->data + d * size : tensor->data;
+            cl_int ret = clEnqueueWriteBuffer(device->command_queue, device->buffers[node], CL_TRUE, 0,
+                                              size * sizeof(float), data, 0, NULL, NULL);
+            CCML_CHECK_OPENCL(ret, "clEnqueueWriteBuffer");
+        }
+    }
+
+    state->on_device[node] = true;
+    state->shards[node] = shard;
+    state->n_shards[node] = n_shards;
+
+cleanup:
+    return status;
+}
+
+CCML_API ccml_status ccml_place_opencl(ccml_context * ctx, ccml_state_opencl * state, ccml_graph * graph,
+                                       int node, ccml_shard shard, int n_shards) {
+    // a single shard is the whole buffer on the first device whatever it's labelled, which
+    // copied values are as well. any other change of layout goes through the host
+    if (n_shards == 1) shard = CCML_SHARD_SPLIT;
+    bool whole = state->shards[node] == CCML_SHARD_COPY || state->n_shards[node] == 1;
+    bool same = state->shards[node] == shard && state->n_shards[node] == n_shards;
+    if (state->on_device[node] && (same || (n_shards == 1 && whole))) return CCML_STATUS_OK;
+
+    if (!state->on_host[node]) {
+        ccml_status status = ccml_download_opencl(ctx, state, graph, node);
+        if (status != CCML_STATUS_OK) return status;
+    }
+
+    return ccml_upload_opencl(state, graph, node, shard, n_shards);
+}
+
+CCML_API ccml_status ccml_prepare_opencl(ccml_context * ctx, ccml_state_opencl * state, ccml_graph * graph, ccml_ir * ir) {
+    // whatever a kernel reads is put where its shards expect it, stores included since they
+    // only write their part of the buffer. sums start out from zero, max reductions from -inf
+    ccml_status status = CCML_STATUS_OK;
+    bool written[CCML_NODE_MAX] = {false};
+    for (int i = 0; i < ir->n_ops; i++) {
+        ccml_ir_op * op = &ir->ops[i];
+        int read = op->oper == CCML_OPER_STORE ? op->buffer : ccml_ir_op_reads(op);
+        int write = ccml_ir_op_writes(op);
+        if (read != -1 && !written[read]) {
+            status = ccml_place_opencl(ctx, state, graph, read, ir->shards[read], ir->n_shards);
+            if (status != CCML_STATUS_OK) goto cleanup;
+        }
+
+        bool reduce = op->oper == CCML_OPER_SUM || op->oper == CCML_OPER_RMAX || op->oper == CCML_OPER_SCATTER_ADD;
+        for (int d = 0; reduce && !written[write] && d < ir->n_shards; d++) {
+            float value = op->oper == CCML_OPER_RMAX ? -INFINITY : 0.0f;
+            cl_int ret = clEnqueueFillBuffer(state->devices[d].command_queue, state->devices[d].buffers[write], &value,
+                                             sizeof(float), 0, ccml_size(graph->nodes[write]) * sizeof(float), 0, NULL, NULL);
+            CCML_CHECK_OPENCL(ret, "clEnqueueFillBuffer");
+        }
+        if (write != -1) written[write] = true;
+    }
+
+cleanup:
+    return status;
+}
+
+CCML_API void * ccml_compile_opencl(const char * source, void * target, ccml_status * status) {
+    // every kernel is a program of its own built for one device, so kernels left out by one
+    // execution are still built for the next. this runs on compiler threads
+    ccml_device_opencl * device = target;
+    cl_int ret;
+    cl_program program = clCreateProgramWithSource(device->context, 1, &source, NULL, &ret);
+    *status = ccml_check_error_opencl(ret, "clCreateProgramWithSource");
+    if (*status != CCML_STATUS_OK) return NULL;
+
+    ret = clBuildProgram(program, 1, &device->device, NULL, NULL, NULL);
+    if (ret != CL_SUCCESS) {
+        char buffer[2048] = {0};
+        clGetProgramBuildInfo(program, device->device, CL_PROGRAM_BUILD_LOG, sizeof(buffer) - 1, buffer, NULL);
+        ccml_message(CCML_LOG_ERROR, "build error: %s", buffer);
+        clReleaseProgram(program);
+        *status = CCML_STATUS_COMPILE_FAILED;
+        return NULL;
+    }
+
+    return program;
+}
+
+CCML_API void ccml_release_opencl(void * program) {
+    clReleaseProgram(program);
+}
+
+CCML_API ccml_status ccml_execute_graph_opencl(ccml_context * ctx, ccml_graph * graph) {
+    // only the kernels downstream of changed inputs run. their results stay on the devices,
+    // the host only gets the outputs and the gradients of the leaves back
+    ccml_status status = CCML_STATUS_OK;
+    if (graph->backend == NULL) {
+        status = ccml_new_state_opencl(graph);
+        if (status != CCML_STATUS_OK) return status;
+    }
+
+    ccml_state_opencl * state = graph->backend;
+    ccml_sync_opencl(state, graph);
+
+    double start = ccml_profile_time();
+    ccml_ir * irs[CCML_KERN_MAX];
+    int n_irs = ccml_new_dirty_irs(ctx, graph, irs);
+    if (ccml_context_failed(ctx)) return ctx->status;
+
+    // each kernel splits its batch between the devices if it allows it, and otherwise runs
+    // on the first one
+    const char * sources[CCML_KERN_MAX];
+    for (int k = 0; k < n_irs; k++) {
+        ccml_ir_shard(irs[k], graph, state->n_devices);
+        ccml_ir_vectorize(irs[k], 4);
+        sources[k] = ccml_new_program(ctx, &irs[k], 1, CCML_DIALECT_OPENCL);
+        if (sources[k] == NULL) return ctx->status;
+        ccml_message(CCML_LOG_DEBUG, "kernel source:\n%s", sources[k]);
+    }
+    ccml_profile_phase(&graph->profile, CCML_PHASE_CODEGEN, 0, start);
+
+    // every program is built on the compile pool for each device its kernel runs on, all of
+    // them are queued before any is waited for so the builds overlap each other and the
+    // kernels already enqueued
+    int entries[CCML_KERN_MAX][CCML_DEVICE_MAX];
+    for (int k = 0; k < n_irs; k++) {
+        for (int d = 0; d < irs[k]->n_shards; d++) {
+            entries[k][d] = ccml_cache_request(ccml_hash_string(sources[k]), sources[k], ccml_compile_opencl,
+                                               ccml_release_opencl, &state->devices[d], graph->on_ready, graph->user);
+        }
+    }
+
+    // kernels are enqueued one after the other and only wait for each other when a buffer
+    // has to be laid out again, the devices of a sharded kernel run it concurrently
+    cl_event events[CCML_KERN_MAX][CCML_DEVICE_MAX] = {{NULL}};
+    cl_kernel kernels[CCML_KERN_MAX][CCML_DEVICE_MAX] = {{NULL}};
+    cl_program owned[CCML_KERN_MAX][CCML_DEVICE_MAX] = {{NULL}};
+    double enqueued[CCML_KERN_MAX];
+
+    // nothing stands in for a program still building on a gpu, so async graphs run nothing
+    // until all of them are built and say so, on_ready tells when to execute again
+    for (int k = 0; k < n_irs && graph->async_compile && status == CCML_STATUS_OK; k++) {
+        for (int d = 0; d < irs[k]->n_shards && status == CCML_STATUS_OK; d++) {
+            if (entries[k][d] == -1 || ccml_cache_wait(entries[k][d], false, &status) != NULL) continue;
+            if (status == CCML_STATUS_OK) status = CCML_STATUS_NOT_READY;
+        }
+    }
+    if (status != CCML_STATUS_OK) goto cleanup;
+    for (int k = 0; k < n_irs; k++) {
+        ccml_ir * ir = irs[k];
+        int local[CCML_DEVICE_MAX];
+        int limit[CCML_DEVICE_MAX];
+
+        for (int d = 0; d < ir->n_shards; d++) {
+            ccml_device_opencl * device = &state->devices[d];
+
+            // programs that don't fit in the cache are built here and belong to this execution
+            start = ccml_profile_time();
+            cl_program program = NULL;
+            if (entries[k][d] == -1) {
+                program = owned[k][d] = ccml_compile_opencl(sources[k], device, &status);
+            } else {
+                program = ccml_cache_wait(entries[k][d], true, &status);
+            }
+            if (program == NULL) goto cleanup;
+            ccml_profile_phase(&graph->profile, CCML_PHASE_COMPILE, d, start);
+
+            char name[32];
+            snprintf(name, sizeof(name), "my_kernel_%d", ir->n_kernel);
+            cl_int ret;
+            kernels[k][d] = clCreateKernel(program, name, &ret);
+            CCML_CHECK_OPENCL(ret, "clCreateKernel");
+
+            status = ccml_alloc_opencl(state, graph, d);
+            if (status != CCML_STATUS_OK) goto cleanup;
+
+            int buffer_index = 0;
+            for (int i = 0; i < graph->n_nodes; i++) {
+                if (ccml_has_buffer(graph->nodes[i])) {
+                    cl_int ret = clSetKernelArg(kernels[k][d], buffer_index++, sizeof(cl_mem), (void *)&device->buffers[i]);
+                    CCML_CHECK_OPENCL(ret, "clSetKernelArg");
+                }
+            }
+
+            // the live row count follows the buffers for kernels compiled against a symbolic leading dim
+            if (ir->rows != 0) {
+                cl_int ret = clSetKernelArg(kernels[k][d], buffer_index, sizeof(int), (void *)&ir->rows);
+                CCML_CHECK_OPENCL(ret, "clSetKernelArg");
+            }
+        }
+
+        start = ccml_profile_time();
+        status = ccml_prepare_opencl(ctx, state, graph, ir);
+        if (status != CCML_STATUS_OK) goto cleanup;
+        ccml_profile_phase(&graph->profile, CCML_PHASE_UPLOAD, 0, start);
+
+        // devices are planned separately since they can be of different kinds
+        for (int d = 0; d < ir->n_shards; d++) {
+            ccml_device_opencl * device = &state->devices[d];
+
+            // the kernel work-group size already accounts for the device limit and the kernel's register use
+            size_t max_local = 1;
+            size_t multiple = 1;
+            cl_int ret = clGetKernelWorkGroupInfo(kernels[k][d], device->device, CL_KERNEL_WORK_GROUP_SIZE,
+                                                  sizeof(size_t), &max_local, NULL);
+            CCML_CHECK_OPENCL(ret, "clGetKernelWorkGroupInfo");
+            ret = clGetKernelWorkGroupInfo(kernels[k][d], device->device, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE,
+                                           sizeof(size_t), &multiple, NULL);
+            CCML_CHECK_OPENCL(ret, "clGetKernelWorkGroupInfo");
+
+            local[d] = ccml_plan_local(ir, max_local, multiple);
+            limit[d] = max_local;
+
+        #if defined(CCML_AUTOTUNE)
+            char device_name[256] = {0};
+            clGetDeviceInfo(device->device, CL_DEVICE_NAME, sizeof(device_name) - 1, device_name, NULL);
+            uint64_t hash = ccml_hash_string(sources[k]) ^ ccml_hash_string(device_name) ^ ir->n_kernel;
+
+            local[d] = ccml_autotune_load(hash);
+            if (local[d] == 0) {
+                status = ccml_tune_opencl(device->command_queue, kernels[k][d], ir, max_local, multiple, &local[d]);
+                if (status != CCML_STATUS_OK) goto cleanup;
+                ccml_autotune_save(hash, local[d]);
+
+                // tuning runs accumulate into the sums, which have to start over
+                status = ccml_prepare_opencl(ctx, state, graph, ir);
+                if (status != CCML_STATUS_OK) goto cleanup;
+            }
+        #endif
+        }
+
+        enqueued[k] = ccml_profile_time();
+        for (int d = 0; d < ir->n_shards; d++) {
+            ccml_dispatch dispatch = ccml_new_dispatch(ir, local[d], limit[d]);
+            cl_int ret = clEnqueueNDRangeKernel(state->devices[d].command_queue, kernels[k][d], 3, NULL, dispatch.global,
+                                                dispatch.local, 0, NULL, CCML_PROFILE_ENABLED ? &events[k][d] : NULL);
+            CCML_CHECK_OPENCL(ret, "clEnqueueNDRangeKernel");
+            clFlush(state->devices[d].command_queue);
+        }
+
+        // a single shard writes the whole buffer on the first device
+        for (int i = 0; i < ir->n_ops; i++) {
+            int written = ccml_ir_op_writes(&ir->ops[i]);
+            if (written == -1) continue;
+
+            state->on_device[written] = true;
+            state->on_host[written] = false;
+            state->shards[written] = ir->n_shards == 1 ? CCML_SHARD_SPLIT : ir->shards[written];
+            state->n_shards[written] = ir->n_shards;
+        }
+    }
+
+    for (int d = 0; d < state->n_devices; d++) {
+        CCML_CHECK_OPENCL(clFinish(state->devices[d].command_queue), "clFinish");
+    }
+
+    // device timestamps have their own origin, kernels are placed relative to when they were enqueued
+    for (int k = 0; CCML_PROFILE_ENABLED && k < n_irs; k++) {
+        for (int d = 0; d < irs[k]->n_shards; d++) {
+            cl_ulong queued = 0;
+            cl_ulong begin = 0;
+            cl_ulong end = 0;
+            clGetEventProfilingInfo(events[k][d], CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), &queued, NULL);
+            clGetEventProfilingInfo(events[k][d], CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &begin, NULL);
+            clGetEventProfilingInfo(events[k][d], CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
+
+            ccml_profile_event(&graph->profile, (ccml_event) {
+                .phase       = CCML_PHASE_RUN,
+                .kernel      = irs[k]->n_kernel,
+                .device      = d,
+                .start_node  = irs[k]->start,
+                .finish_node = irs[k]->finish,
+                .start       = enqueued[k] + (begin - queued) * 1e-9,
+                .duration    = (end - begin) * 1e-9
+            });
+        }
+    }
+
+    // the outputs and the gradients of the leaves are all the host reads, everything else
+    // is only ever needed by other kernels
+    start = ccml_profile_time();
+    for (int i = 0; i < graph->n_nodes; i++) {
+        ccml_tensor * tensor = graph->nodes[i];
+        bool leaf = (graph->table.flags[i] & CCML_FLAG_LEAF) && (graph->table.flags[i] & CCML_FLAG_GRADIENT);
+        int node = tensor->oper == CCML_OPER_SAVE ? i : leaf ? ccml_hashmap_get(graph->map, tensor->grad) : -1;
+        if (node == -1 || state->on_host[node] || !state->on_device[node]) continue;
+
+        status = ccml_download_opencl(ctx, state, graph, node);
+        if (status != CCML_STATUS_OK) goto cleanup;
+    }
+    ccml_profile_phase(&graph->profile, CCML_PHASE_DOWNLOAD, 0, start);
+
+    for (int i = 0; i < graph->n_nodes; i++) {
+        state->versions[i] = graph->nodes[i]->version;
+    }
+
+cleanup:
+    for (int k = 0; k < n_irs; k++) {
+        for (int d = 0; d < CCML_DEVICE_MAX; d++) {
+            if (events[k][d] != NULL) clReleaseEvent(events[k][d]);
+            if (kernels[k][d] != NULL) clReleaseKernel(kernels[k][d]);
+            if (owned[k][d] != NULL) clReleaseProgram(owned[k][d]);
+        }
+    }
+
+    // after a failure the devices are filled again from the host
+    for (int i = 0; status != CCML_STATUS_OK && i < graph->n_nodes; i++) {
+        state->versions[i] = -1;
+    }
+
+    return status;
+}
+
+#else
+
+CCML_API const char * ccml_new_kernel_opencl(ccml_context *, ccml_graph *, int, int, int);
+CCML_API ccml_status ccml_execute_graph_opencl(ccml_context *, ccml_graph *);
+
+#endif /* defined CCML_BACKEND_OPENCL */
+
+//
+//  ██████╗  █████╗  ██████╗██╗  ██╗███████╗███╗   ██╗██████╗
+//  ██╔══██╗██╔══██╗██╔════╝██║ ██╔╝██╔════╝████╗  ██║██╔══██╗
+//  ██████╔╝███████║██║     █████╔╝ █████╗  ██╔██╗ ██║██║  ██║
+//  ██╔══██╗██╔══██║██║     ██╔═██╗ ██╔══╝  ██║╚██╗██║██║  ██║
+//  ██████╔╝██║  ██║╚██████╗██║  ██╗███████╗██║ ╚████║██████╔╝
+//  ╚═════╝ ╚═╝  ╚═╝ ╚═════╝╚═╝  ╚═╝╚══════╝╚═╝  ╚═══╝╚═════╝
+//
+//   ██████╗██████╗ ██╗   ██╗
+//  ██╔════╝██╔══██╗██║   ██║
+//  ██║     ██████╔╝██║   ██║
+//  ██║     ██╔═══╝ ██║   ██║
+//  ╚██████╗██║     ╚██████╔╝
+//   ╚═════╝╚═╝      ╚═════╝
+//
+
+#if defined(CCML_BACKEND_CPU)
+
+#include <dlfcn.h>
+#include <unistd.h>
+
+#if !defined(CCML_CPU_COMPILER)
+    #define CCML_CPU_COMPILER "cc -O3 -march=native -shared -fPIC"
+#endif
+
+// elements per thread of elementwise kernels, 8 floats fill an avx2 register
+// (or two neon ones), 16 is the better choice for avx-512 targets
+#if !defined(CCML_CPU_WIDTH)
+    #define CCML_CPU_WIDTH 8
+#endif
+
+typedef void (*ccml_kernel_cpu)(float **, int, int);
+
+CCML_API void * ccml_compile_cpu(const char * source, void * target, ccml_status * status) {
+    // the kernel is compiled into a shared object by the system compiler and loaded back in.
+    // this runs on compiler threads, so nothing here may touch the arena of a context
+    (void)target;
+
+    char source_path[] = "/tmp/ccml_kernel_XXXXXX.c";
+    char object_path[sizeof(source_path) + 1] = "";
+    char command[1024];
+    void * library = NULL;
+    *status = CCML_STATUS_OK;
+
+    int fd = mkstemps(source_path, 2);
+    if (fd == -1) {
+        ccml_message(CCML_LOG_ERROR, "failed to create kernel source file");
+        *status = CCML_STATUS_IO_FAILED;
+        return NULL;
+    }
+
+    FILE * file = fdopen(fd, "w");
+    bool written = file != NULL && fputs(source, file) >= 0;
+    if (file != NULL) fclose(file);
+    snprintf(object_path, sizeof(object_path), "%.*s.so", (int)strlen(source_path) - 2, source_path);
+    snprintf(command, sizeof(command), "%s -o %s %s -lm", CCML_CPU_COMPILER, object_path, source_path);
+
+    if (!written) {
+        ccml_message(CCML_LOG_ERROR, "failed to write kernel source file %s", source_path);
+        *status = CCML_STATUS_IO_FAILED;
+    } else if (system(command) != 0) {
+        ccml_message(CCML_LOG_ERROR, "failed to compile kernel %s", source_path);
+        *status = CCML_STATUS_COMPILE_FAILED;
+    } else if ((library = dlopen(object_path, RTLD_NOW | RTLD_LOCAL)) == NULL) {
+        ccml_message(CCML_LOG_ERROR, "failed to load kernel: %s", dlerror());
+        *status = CCML_STATUS_BACKEND_FAILED;
+    }
+
+    unlink(object_path);
+    unlink(source_path);
+
+    return library;
+}
+
+CCML_API void ccml_release_cpu(void * library) {
+    dlclose(library);
+}
+
+CCML_API const char * ccml_new_kernel_cpu(ccml_context * ctx, struct ccml_graph * graph,
+                                          int n_kernel, int start, int finish) {
+    ccml_ir * ir = ccml_new_ir(ctx, graph, n_kernel, start, finish);
+    return ccml_new_program(ctx, &ir, 1, CCML_DIALECT_C);
+}
+
+typedef struct ccml_kernel_task {
+    ccml_kernel_cpu kernel;
+    float ** buffers;
+    int size;
+} ccml_kernel_task;
+
+CCML_API void ccml_run_kernel_task(void * arg, int worker, int n_workers) {
+    ccml_kernel_task * task = arg;
+    int start = (long)task->size * worker / n_workers;
+    int finish = (long)task->size * (worker + 1) / n_workers;
+    if (start < finish) task->kernel(task->buffers, start, finish);
+}
+
+CCML_API bool ccml_ir_is_parallel(ccml_ir * ir) {
+    // sums accumulate into shared locations, splitting them between workers would race
+    for (int i = 0; i < ir->n_ops; i++) {
+        if (ccml_is_reduce(ir->ops[i].oper)) return false;
+    }
+
+    return true;
+}
+
+CCML_API float ccml_interpret_op(ccml_ir_op * op, float * temps) {
+    int * src = op->src;
+
+    switch (op->oper) {
+        case CCML_OPER_LOG:   return logf(temps[src[0]]);
+        case CCML_OPER_EXP:   return expf(temps[src[0]]);
+        case CCML_OPER_SIN:   return sinf(temps[src[0]]);
+        case CCML_OPER_REC:   return 1/temps[src[0]];
+        case CCML_OPER_SQT:   return sqrtf(temps[src[0]]);
+        case CCML_OPER_NEG:   return -temps[src[0]];
+        case CCML_OPER_ADD:   return temps[src[0]] + temps[src[1]];
+        case CCML_OPER_MUL:   return temps[src[0]] * temps[src[1]];
+        case CCML_OPER_MAX:   return fmaxf(temps[src[0]], temps[src[1]]);
+        case CCML_OPER_POW:   return powf(temps[src[0]], temps[src[1]]);
+        case CCML_OPER_FMA:   return fmaf(temps[src[0]], temps[src[1]], temps[src[2]]);
+        case CCML_OPER_CMPLT: return temps[src[0]] < temps[src[1]] ? 1.0f : 0.0f;
+        case CCML_OPER_WHERE: return temps[src[0]] != 0.0f ? temps[src[1]] : temps[src[2]];
+        default: CCML_ASSERT(false, "oper can't be interpreted");
+    }
+
+    return 0;
+}
+
+CCML_API float ccml_interpret_read(ccml_tensor * tensor, int offset) {
+    // indices are kept in float temporaries like everything else, which holds them exactly
+    return tensor->type == CCML_TYPE_INT32 ? ((int32_t *)tensor->data)[offset] : tensor->data[offset];
+}
+
+CCML_API void ccml_interpret_kernel(ccml_ir * ir, ccml_graph * graph) {
+    // the generic path walks the grid an element at a time, slow but there's nothing to compile,
+    // so a kernel can run before its compiled version is ready. fused ops aren't supported
+    int ids[CCML_DIMS_MAX];
+    int size = ir->rows != 0 ? ir->rows : ir->grid[0];
+    for (int i = 1; i < CCML_DIMS_MAX; i++) size *= ir->grid[i];
+
+    float temps[CCML_NODE_MAX];
+    for (int element = 0; element < size; element++) {
+        for (int i = CCML_DIMS_MAX - 1, rest = element; i >= 0; rest /= ir->grid[i--]) {
+            ids[i] = i != 0 ? rest % ir->grid[i] : rest;
+        }
+
+        for (int i = 0; i < ir->n_ops; i++) {
+            ccml_ir_op * op = &ir->ops[i];
+            int offset = op->index.offset;
+            for (int j = 0; j < CCML_DIMS_MAX; j++) offset += ids[j] * op->index.stride[j];
+
+            switch (op->oper) {
+                case CCML_OPER_SUM:
+                    graph->nodes[op->buffer]->data[offset] += temps[op->src[0]];
+                    break;
+                case CCML_OPER_RMAX:
+                    graph->nodes[op->buffer]->data[offset] = fmaxf(graph->nodes[op->buffer]->data[offset],
+                                                                   temps[op->src[0]]);
+                    break;
+                case CCML_OPER_SCATTER_ADD:
+                    offset += (int)temps[op->src[1]] * op->pitch;
+                    graph->nodes[op->buffer]->data[offset] += temps[op->src[0]];
+                    break;
+                case CCML_OPER_UNIFORM:
+                case CCML_OPER_NORMAL:
+                    temps[op->dst] = ccml_random((uint32_t)temps[op->src[0]], op->axis, offset,
+                                                 op->oper == CCML_OPER_NORMAL);
+                    break;
+                case CCML_OPER_GATHER:
+                    offset += (int)temps[op->src[1]] * op->pitch;
+                    temps[op->dst] = graph->nodes[op->buffer]->data[offset];
+                    break;
+                case CCML_OPER_RES:
+                case CCML_OPER_PER:
+                    temps[op->dst] = ccml_interpret_read(graph->nodes[op->src[0]], offset);
+                    break;
+                case CCML_OPER_VIEW:
+                case CCML_OPER_LOAD:
+                case CCML_OPER_INTR:
+                    temps[op->dst] = ccml_interpret_read(graph->nodes[op->buffer], offset);
+                    break;
+                case CCML_OPER_STORE:
+                case CCML_OPER_SAVE:
+                    graph->nodes[op->buffer]->data[offset] = temps[op->src[0]];
+                    break;
+                default:
+                    temps[op->dst] = ccml_interpret_op(op, temps);
+            }
+        }
     }
 }
 
-CCML_API const char * ccml_type_metal(ccml_tensor * tensor) {
-    switch (tensor->type) {
-        case CCML_TYPE_FP32: return "float ";
-        default: CCML_ASSERT(false, "unknown variant of ccml_type");
+CCML_API ccml_status ccml_execute_graph_cpu(ccml_context * ctx, ccml_graph * graph) {
+    // only the kernels downstream of changed inputs run, the rest of the buffers still
+    // hold what they computed the last time
+    double start = ccml_profile_time();
+    ccml_ir * irs[CCML_KERN_MAX];
+    int n_irs = ccml_new_dirty_irs(ctx, graph, irs);
+    if (ccml_context_failed(ctx)) return ctx->status;
+    if (n_irs == 0) return CCML_STATUS_OK;
+
+    const char * sources[CCML_KERN_MAX];
+    for (int i = 0; i < n_irs; i++) {
+        ccml_ir_vectorize(irs[i], CCML_CPU_WIDTH);
+        sources[i] = ccml_new_program(ctx, &irs[i], 1, CCML_DIALECT_C);
+        if (sources[i] == NULL) return ctx->status;
+        ccml_message(CCML_LOG_DEBUG, "kernel source:\n%s", sources[i]);
+    }
+    ccml_profile_phase(&graph->profile, CCML_PHASE_CODEGEN, 0, start);
+
+    // every kernel is a library of its own compiled on the compile pool, all of them are
+    // queued before any is waited for so the compiles overlap
+    start = ccml_profile_time();
+    int entries[CCML_KERN_MAX];
+    for (int i = 0; i < n_irs; i++) {
+        entries[i] = ccml_cache_request(ccml_hash_string(sources[i]), sources[i], ccml_compile_cpu, ccml_release_cpu,
+                                        NULL, graph->on_ready, graph->user);
     }
-}
-
-CCML_API const char * ccml_new_kernel_metal(ccml_context * ctx, struct ccml_graph * graph,
-                                        int n_kernel, int start, int finish) {
-    int size = CCML_CHAR_MAX * CCML_NODE_MAX * sizeof(char);
-    const char * kernel = ccml_malloc(ctx, size);
-    char * string = (char*)kernel;
 
-    // the n_kernel parameter specifies the id of the kernel being generated,
-    // and start to finish are ides of graph->nodes that pertain to that kernel
-    if (n_kernel == 0) {
-        string += snprintf(string, size - (kernel - string), "#include <metal_stdlib>\nusing namespace metal;\n");
+    ccml_status status = CCML_STATUS_OK;
+    void * libraries[CCML_KERN_MAX] = {NULL};
+    bool owned[CCML_KERN_MAX] = {false};
+    ccml_kernel_cpu kernels[CCML_KERN_MAX] = {NULL};
+
+    for (int i = 0; i < n_irs && status == CCML_STATUS_OK; i++) {
+        // with a full cache the kernel is compiled here and unloaded again after the run,
+        // async graphs don't wait for kernels the interpreter can stand in for. it can't run
+        // fused ops, so until those are compiled nothing runs and the graph isn't ready
+        if (entries[i] == -1) {
+            libraries[i] = ccml_compile_cpu(sources[i], NULL, &status);
+            owned[i] = libraries[i] != NULL;
+        } else {
+            libraries[i] = ccml_cache_wait(entries[i], !graph->async_compile, &status);
+        }
+        if (libraries[i] == NULL && status == CCML_STATUS_OK && ccml_ir_fused(irs[i]) != NULL) {
+            status = CCML_STATUS_NOT_READY;
+        }
+        if (libraries[i] == NULL) continue;
+
+        char name[32];
+        snprintf(name, sizeof(name), "my_kernel_%d", irs[i]->n_kernel);
+        kernels[i] = (ccml_kernel_cpu)dlsym(libraries[i], name);
+        if (kernels[i] == NULL) {
+            ccml_message(CCML_LOG_ERROR, "failed to load kernel: %s", dlerror());
+            status = CCML_STATUS_BACKEND_FAILED;
+        }
     }
+    ccml_profile_phase(&graph->profile, CCML_PHASE_COMPILE, 0, start);
 
-    string += snprintf(string, size - (kernel - string), "kernel void my_kernel_%d(", n_kernel);
-    // adding kernel input parameters to the kernel string
-    int n_kernel_parameters = 0;
+    // kernel arguments are the buffers in graph order
+    float * buffers[CCML_NODE_MAX] = {NULL};
+    int n_buffers = 0;
     for (int i = 0; i < graph->n_nodes; i++) {
         ccml_tensor * tensor = graph->nodes[i];
-
         if (ccml_has_buffer(tensor)) {
-            if (n_kernel_parameters == 0) {
-                string += snprintf(string, size - (kernel - string), "device %s* data_%d [[buffer(0)]]",
-                                   ccml_type_metal(tensor), i);
-                n_kernel_parameters++;
-            } else {
-                string += snprintf(string, size - (kernel - string),  ", device %s* data_%d [[buffer(%d)]]",
-                                   ccml_type_metal(tensor), i, n_kernel_parameters);
-                n_kernel_parameters++;
-            }
+            buffers[n_buffers++] = tensor->data;
         }
     }
 
-    // setting up thread grid dims
-    int grid = 1;
-    for (int i = start; i < finish; i++) {
-        ccml_tensor * tensor = graph->nodes[i];
-        grid = grid > tensor->shape[1] ? grid : tensor->shape[1];
-    }
-
-    string += snprintf(string, size - (kernel - string),
-                       ", uint3 gid [[thread_position_in_grid]]) {\n"
-                       "\tuint id0 = gid.x / %d;\n\tuint id1 = gid.x %% %d;\n"
-                       "\tuint id2 = gid.y;\n\tuint id3 = gid.z;\n\n", grid, grid);
-
-    for (int i = start; i < finish; i++) {
-        ccml_tensor * tensor = graph->nodes[i];
-        switch (tensor->oper) {
-            case CCML_OPER_LOG:
-            case CCML_OPER_EXP:
-            case CCML_OPER_SIN:
-            case CCML_OPER_REC:
-            case CCML_OPER_SQT:
-                string += snprintf(string, size - (kernel - string), "\t%stemp_%d = %s(temp_%d);\n",
-                                   ccml_type_metal(tensor), tensor->index,
-                                   ccml_oper_metal(tensor), tensor->src[0]->index);
-                break;
-            case CCML_OPER_ADD:
-            case CCML_OPER_MUL:
-                string += snprintf(string, size - (kernel - string), "\t%stemp_%d = temp_%d %s temp_%d;\n",
-                                   ccml_type_metal(tensor), tensor->index, tensor->src[0]->index,
-                                   ccml_oper_metal(tensor), tensor->src[1]->index);
-                break;
-            case CCML_OPER_SUM:
-                string += snprintf(string, size - (kernel - string), "\tfor (int i = 0; i < %d; i++) {\n"
-                                   "\t\tdata_%d%s += temp_%d;\n"
-                                   "\t}\n", ccml_size(tensor->src[0]) / ccml_size(tensor), tensor->index + 1,
-                                   ccml_new_index(ctx, tensor, tensor->src[0]), tensor->src[0]->index);
-                break;
-            case CCML_OPER_RES:
-            case CCML_OPER_PER:
-                string += snprintf(string, size - (kernel - string), "\tdevice %s* data_%d = data_%d;\n"
-                                   "\t%stemp_%d = data_%d%s;\n", ccml_type_metal(tensor), tensor->index,
-                                    tensor->src[0]->index, ccml_type_metal(tensor), tensor->index,
-                                    tensor->index, ccml_new_index(ctx, NULL, tensor));
-                break;
-            case CCML_OPER_LOAD:
-                string += snprintf(string, size - (kernel - string), "\t%stemp_%d = data_%d%s;\n",
-                                   ccml_type_metal(tensor), tensor->index, tensor->index, ccml_new_index(ctx, NULL, tensor));
-                break;
-            case CCML_OPER_INTR:
-                string += snprintf(string, size - (kernel - string), "\t%stemp_%d = data_%d%s;\n",
-                                   ccml_type_metal(tensor), tensor->index, tensor->index, ccml_new_index(ctx, NULL, tensor));
-                break;
-            case CCML_OPER_SAVE:
-                string += snprintf(string, size - (kernel - string), "\tdata_%d%s = temp_%d;\n",
-                                   tensor->index, ccml_new_index(ctx, NULL, tensor), tensor->src[0]->index);
-                break;
-            default:
-                CCML_ASSERT(false, "unknown variant of ccml_oper");
+    // the range is cut into contiguous chunks so a worker keeps hitting the same stripe of memory
+    for (int i = 0; i < n_irs && status == CCML_STATUS_OK; i++) {
+        ccml_ir * ir = irs[i];
+        ccml_clear_sums(ir, graph);
+
+        start = ccml_profile_time();
+        if (kernels[i] == NULL) {
+            ccml_interpret_kernel(ir, graph);
+        } else if (ctx->pool != NULL && ccml_ir_is_parallel(ir)) {
+            ccml_kernel_task task = {.kernel = kernels[i], .buffers = buffers, .size = ir->threads[0]};
+            ccml_pool_run(ctx->pool, ccml_run_kernel_task, &task);
+        } else {
+            kernels[i](buffers, 0, ir->threads[0]);
         }
+
+        ccml_profile_event(&graph->profile, (ccml_event) {
+            .phase       = CCML_PHASE_RUN,
+            .kernel      = ir->n_kernel,
+            .device      = 0,
+            .start_node  = ir->start,
+            .finish_node = ir->finish,
+            .start       = start,
+            .duration    = ccml_profile_time() - start
+        });
     }
 
-    snprintf(string, size - (kernel - string), "}");
+    for (int i = 0; i < n_irs; i++) {
+        if (owned[i]) dlclose(libraries[i]);
+    }
 
-    return kernel;
+    return status;
 }
 
-CCML_API void ccml_execute_graph_metal(ccml_context * ctx, ccml_graph * graph) {
-    const char * kernel_source = ccml_new_kernel_metal(ctx, graph, 0, 0, graph->n_nodes);
-    printf("the kernel is:\n%s\n", kernel_source);
+#else
 
-    @autoreleasepool {
-        // Errors
-        NSError * error = nil;
+CCML_API const char * ccml_new_kernel_cpu(ccml_context *, ccml_graph *, int, int, int);
+CCML_API ccml_status ccml_execute_graph_cpu(ccml_context *, ccml_graph *);
 
-        // initialise metal
-        id<MTLDevice> device = MTLCreateSystemDefaultDevice();
-        NSString * kernel_source_ = [NSString stringWithUTF8String:kernel_source];
-        id<MTLLibrary> library = [device newLibraryWithSource:kernel_source_ options:nil error:&error];
-        if (!library) {
-            fprintf(stderr, "Failed to create MTLLibrary: %s\n", [[error localizedDescription] UTF8String]);
-            return;
-        }
+#endif /* defined CCML_BACKEND_CPU */
 
-        // create compute function and GPU pipeline
-        id<MTLFunction> function = [library newFunctionWithName:@"my_kernel_0"];
-        id<MTLComputePipelineState> pipeline_state = [device newComputePipelineStateWithFunction:function error:&error];
-        id<MTLCommandQueue> command_queue = [device newCommandQueue];
+//
+//  ███████╗██╗  ██╗███████╗ ██████╗██╗   ██╗████████╗██╗ ██████╗ ███╗   ██╗
+//  ██╔════╝╚██╗██╔╝██╔════╝██╔════╝██║   ██║╚══██╔══╝██║██╔═══██╗████╗  ██║
+//  █████╗   ╚███╔╝ █████╗  ██║     ██║   ██║   ██║   ██║██║   ██║██╔██╗ ██║
+//  ██╔══╝   ██╔██╗ ██╔══╝  ██║     ██║   ██║   ██║   ██║██║   ██║██║╚██╗██║
+//  ███████╗██╔╝ ██╗███████╗╚██████╗╚██████╔╝   ██║   ██║╚██████╔╝██║ ╚████║
+//  ╚══════╝╚═╝  ╚═╝╚══════╝ ╚═════╝ ╚═════╝    ╚═╝   ╚═╝ ╚═════╝ ╚═╝  ╚═══╝
+//
 
-        // data for buffers
-        id<MTLBuffer> buffers[CCML_NODE_MAX] = {NULL};
-        for (int i = 0; i < graph->n_nodes; i++) {
-            ccml_tensor * tensor = graph->nodes[i];
-            if (tensor != NULL && ccml_has_buffer(tensor)) {
-                buffers[i] = [device newBufferWithBytes:tensor->data length:ccml_size(tensor) options: MTLResourceStorageModeShared];
-            }
-        }
+CCML_API ccml_status ccml_graph_execute(ccml_context * ctx, ccml_graph * graph) {
+    // everything an execution allocates is scratch, so the arena is rolled back afterwards,
+    // along with running out of it. contexts that ran out while building stay out of memory
+    if (ccml_context_failed(ctx)) return ctx->status;
+    int used = ctx->used;
+    ccml_profile_reset(&graph->profile);
+    ccml_graph_check_loads(graph);
 
-        // command buffer and compute command encoder
-        id<MTLCommandBuffer> command_buffer = [command_queue commandBuffer];
-        id<MTLComputeCommandEncoder> compute_encoder = [command_buffer computeCommandEncoder];
+    #if defined(CCML_BACKEND_METAL)
+        ccml_status status = ccml_execute_graph_metal(ctx, graph);
+    #elif defined(CCML_BACKEND_OPENCL)
+        ccml_status status = ccml_execute_graph_opencl(ctx, graph);
+    #elif defined(CCML_BACKEND_CPU)
+        ccml_status status = ccml_execute_graph_cpu(ctx, graph);
+    #else
+        #error unknown backend
+    #endif
 
-        [compute_encoder setComputePipelineState:pipeline_state];
+    // after a failure nothing computed can be trusted and the next execution starts over,
+    // graphs that weren't ready ran nothing and run every kernel they skipped next time
+    for (int i = 0; i < graph->n_nodes; i++) {
+        graph->versions[i] = status == CCML_STATUS_OK ? graph->nodes[i]->version : -1;
+    }
 
-        int buffer_counter = 0;
-        int grid[CCML_DIMS_MAX] = {1, 1, 1, 1};
-        for (int i = 0; i < graph->n_nodes; i++) {
-            ccml_tensor * tensor = graph->nodes[i];
-            if (tensor != NULL && ccml_has_buffer(tensor)) {
-                [compute_encoder setBuffer:buffers[i] offset:0 atIndex:buffer_counter++];
-            }
+    ccml_context_rollback(ctx, used);
+    return status;
+}
 
-            for (int j = 0; j < CCML_DIMS_MAX; j++) {
-                if (tensor != NULL && grid[j] < tensor->shape[j]) {
-                    grid[j] = tensor->shape[j];
-                }
-            }
-        }
+CCML_API void ccml_graph_free(ccml_graph * graph) {
+    // the graph itself lives in its context, this only releases what the backend holds for it
+    #if defined(CCML_BACKEND_OPENCL)
+        ccml_free_graph_opencl(graph);
+    #else
+        (void)graph;
+    #endif
+}
 
-        // dispatch threads
-        MTLSize grid_size = MTLSizeMake(grid[0] * grid[1], grid[2], grid[3]);
-        MTLSize thread_group_size = MTLSizeMake(1, 1, 1);
-        [compute_encoder dispatchThreads:grid_size threadsPerThreadgroup:thread_group_size];
+//
+//  ██████╗  █████╗ ████████╗ █████╗ ███████╗███████╗████████╗
+//  ██╔══██╗██╔══██╗╚══██╔══╝██╔══██╗██╔════╝██╔════╝╚══██╔══╝
+//  ██║  ██║███████║   ██║   ███████║███████╗█████╗     ██║
+//  ██║  ██║██╔══██║   ██║   ██╔══██║╚════██║██╔══╝     ██║
+//  ██████╔╝██║  ██║   ██║   ██║  ██║███████║███████╗   ██║
+//  ╚═════╝ ╚═╝  ╚═╝   ╚═╝   ╚═╝  ╚═╝╚══════╝╚══════╝   ╚═╝
+//
 
-        // end encoding and commit command buffer
-        [compute_encoder endEncoding];
-        [command_buffer commit];
-        [command_buffer waitUntilCompleted];
+// datasets are files of fixed size records, mapped into memory and assembled into batches by
+// loader threads while the graph trains on earlier ones. every record holds one row of each of
+// the tensors it feeds, back to back, unless a decode hook says otherwise. batches go into
+// aligned buffers from the arena that are swapped into the tensors, so nothing is copied twice
+
+typedef void (*ccml_decode_hook)(const void * record, void ** rows, void * user);
+
+typedef struct ccml_pipeline_options {
+    int prefetch;            // batches assembled ahead of the one in use, two when zero
+    int window;              // records are shuffled within consecutive windows of this many
+    int n_threads;           // loader threads, one when zero
+    uint64_t seed;           // seed of the shuffle
+    int record_size;         // bytes per record, the rows of every tensor back to back when zero
+    ccml_decode_hook decode; // writes the rows of a record into every tensor, copied as they are when NULL
+    void * user;             // handed to decode
+} ccml_pipeline_options;
+
+typedef struct ccml_loader {
+    struct ccml_pipeline * pipeline;
+    int * order;
+    int64_t window;
+} ccml_loader;
+
+typedef struct ccml_pipeline {
+    int n_fields;
+    ccml_tensor * fields[CCML_FIELD_MAX];
+    int row_sizes[CCML_FIELD_MAX];
+    int batch_size;
+    int record_size;
+    int64_t n_records;
+    int64_t n_batches; // batches in an epoch, records that don't fill a whole one are dropped
+    ccml_pipeline_options options;
+
+    int fd;
+    size_t mapped;
+    const uint8_t * records;
+
+    // slots hold a batch each, one is bound to the tensors while the others are being filled
+    int n_slots;
+    void * slots[CCML_PREFETCH_MAX + 1][CCML_FIELD_MAX];
+    int64_t batches[CCML_PREFETCH_MAX + 1];
+    bool ready[CCML_PREFETCH_MAX + 1];
+    int bound;
+    int64_t claimed;
+    int64_t consumed;
+    double stalled; // seconds spent waiting for the loaders
+
+    pthread_mutex_t lock;
+    pthread_cond_t filled;
+    pthread_cond_t freed;
+    bool stop;
+    int n_threads;
+    pthread_t threads[CCML_THREAD_MAX];
+    ccml_loader loaders[CCML_THREAD_MAX];
+} ccml_pipeline;
+
+CCML_API uint64_t ccml_mix(uint64_t value) {
+    // splitmix64 finalizer
+    value += 0x9E3779B97F4A7C15u;
+    value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9u;
+    value = (value ^ (value >> 27)) * 0x94D049BB133111EBu;
+    return value ^ (value >> 31);
+}
 
-        // copy the result back to the C array to check it
-        float * result = NULL;
-        int result_size = 1;
-        for (int i = 0; i < graph->n_nodes; i++) {
-            ccml_tensor * tensor = graph->nodes[i];
-            if (tensor != NULL && ccml_has_buffer(tensor)) {
-                result = [buffers[i] contents];
-                result_size = ccml_size(tensor);
-            }
+CCML_API int64_t ccml_pipeline_record(ccml_pipeline * pipeline, ccml_loader * loader, int64_t batch, int row) {
+    // every window of every epoch gets a permutation of its own, which only depends on the
+    // seed, so the order of the records doesn't depend on which loader assembles a batch
+    int64_t epoch = batch / pipeline->n_batches;
+    int64_t position = batch % pipeline->n_batches * pipeline->batch_size + row;
+    int window = pipeline->options.window;
+    if (window <= 1) return position;
+
+    int64_t start = position / window * window;
+    int size = pipeline->n_records - start < window ? (int)(pipeline->n_records - start) : window;
+    int64_t key = epoch * (pipeline->n_records / window + 1) + start / window;
+    if (loader->window != key) {
+        uint64_t state = ccml_mix(pipeline->options.seed ^ ccml_mix(key));
+        for (int i = 0; i < size; i++) loader->order[i] = i;
+        for (int i = size - 1; i > 0; i--) {
+            state = ccml_mix(state);
+            int j = state % (i + 1);
+            int swap = loader->order[i];
+            loader->order[i] = loader->order[j];
+            loader->order[j] = swap;
+        }
+        loader->window = key;
+    }
+
+    return start + loader->order[position - start];
+}
+
+CCML_API void ccml_pipeline_fill(ccml_pipeline * pipeline, ccml_loader * loader, int slot, int64_t batch) {
+    for (int i = 0; i < pipeline->batch_size; i++) {
+        const uint8_t * record = pipeline->records + ccml_pipeline_record(pipeline, loader, batch, i) * pipeline->record_size;
+        void * rows[CCML_FIELD_MAX];
+        for (int j = 0; j < pipeline->n_fields; j++) {
+            rows[j] = (uint8_t *)pipeline->slots[slot][j] + (size_t)i * pipeline->row_sizes[j];
         }
 
-        for (int i = 0; i < result_size; i++) {
-            printf("%f ", result[i]);
+        if (pipeline->options.decode != NULL) {
+            pipeline->options.decode(record, rows, pipeline->options.user);
+            continue;
+        }
+        for (int j = 0; j < pipeline->n_fields; j++) {
+            memcpy(rows[j], record, pipeline->row_sizes[j]);
+            record += pipeline->row_sizes[j];
         }
-        printf("\n");
     }
 }
 
-#else
+CCML_API void * ccml_pipeline_loader(void * arg) {
+    // loaders claim batches in order, whenever a slot is free, and fill them in parallel
+    ccml_loader * loader = arg;
+    ccml_pipeline * pipeline = loader->pipeline;
+
+    pthread_mutex_lock(&pipeline->lock);
+    while (true) {
+        int slot = -1;
+        while (!pipeline->stop && slot == -1) {
+            for (int i = 0; i < pipeline->n_slots && slot == -1; i++) {
+                if (pipeline->batches[i] == -1) slot = i;
+            }
+            if (slot == -1) pthread_cond_wait(&pipeline->freed, &pipeline->lock);
+        }
+        if (pipeline->stop) break;
 
-CCML_API const char * ccml_oper_metal(ccml_tensor *);
-CCML_API const char * ccml_type_metal(ccml_tensor *);
-CCML_API const char * ccml_new_kernel_metal(ccml_context *, ccml_graph *, int, int, int);
-CCML_API void ccml_execute_graph_metal(ccml_context *, ccml_graph *);
+        int64_t batch = pipeline->claimed++;
+        pipeline->batches[slot] = batch;
+        pthread_mutex_unlock(&pipeline->lock);
+        ccml_pipeline_fill(pipeline, loader, slot, batch);
+        pthread_mutex_lock(&pipeline->lock);
 
-#endif /* defined(__APPLE__) */
+        pipeline->ready[slot] = true;
+        pthread_cond_broadcast(&pipeline->filled);
+    }
+    pthread_mutex_unlock(&pipeline->lock);
 
-//
-//  ██████╗  █████╗  ██████╗██╗  ██╗███████╗███╗   ██╗██████╗
-//  ██╔══██╗██╔══██╗██╔════╝██║ ██╔╝██╔════╝████╗  ██║██╔══██╗
-//  ██████╔╝███████║██║     █████╔╝ █████╗  ██╔██╗ ██║██║  ██║
-//  ██╔══██╗██╔══██║██║     ██╔═██╗ ██╔══╝  ██║╚██╗██║██║  ██║
-//  ██████╔╝██║  ██║╚██████╗██║  ██╗███████╗██║ ╚████║██████╔╝
-//  ╚═════╝ ╚═╝  ╚═╝ ╚═════╝╚═╝  ╚═╝╚══════╝╚═╝  ╚═══╝╚═════╝
-//
-//   ██████╗ ██████╗ ███████╗███╗   ██╗ ██████╗██╗
-//  ██╔═══██╗██╔══██╗██╔════╝████╗  ██║██╔════╝██║
-//  ██║   ██║██████╔╝█████╗  ██╔██╗ ██║██║     ██║
-//  ██║   ██║██╔═══╝ ██╔══╝  ██║╚██╗██║██║     ██║
-//  ╚██████╔╝██║     ███████╗██║ ╚████║╚██████╗███████╗
-//   ╚═════╝ ╚═╝     ╚══════╝╚═╝  ╚═══╝ ╚═════╝╚══════╝
-//
+    return NULL;
+}
 
-#if defined(CCML_BACKEND_OPENCL)
+CCML_API void ccml_pipeline_free(ccml_pipeline * pipeline);
+
+CCML_API ccml_pipeline * ccml_new_pipeline(ccml_context * ctx, const char * path, int n_fields,
+                                           ccml_tensor ** fields, ccml_pipeline_options options) {
+    // the tensors are loads sharing their leading dim, which is the batch size. the loaders
+    // start filling batches straight away, NULL means the file couldn't be mapped or the
+    // context ran out of memory
+    if (ccml_context_failed(ctx)) return NULL;
+    CCML_ASSERT(n_fields > 0 && n_fields <= CCML_FIELD_MAX, "invalid number of pipeline tensors");
+    CCML_ASSERT(options.prefetch >= 0 && options.prefetch <= CCML_PREFETCH_MAX, "invalid number of prefetched batches");
+    CCML_ASSERT(options.n_threads >= 0 && options.n_threads <= CCML_THREAD_MAX, "invalid number of loaders");
+    ccml_pipeline * pipeline = ccml_malloc(ctx, sizeof(ccml_pipeline));
+    if (pipeline == NULL) return NULL;
+
+    *pipeline = (ccml_pipeline) {
+        .n_fields   = n_fields,
+        .batch_size = fields[0]->shape[0],
+        .options    = options,
+        .fd         = -1,
+        .n_slots    = (options.prefetch != 0 ? options.prefetch : 2) + 1,
+        .bound      = -1,
+        .n_threads  = options.n_threads != 0 ? options.n_threads : 1
+    };
 
-#if defined(__APPLE__)
-    #include <OpenCL/opencl.h>
-#else
-    #include <CL/cl.h>
-#endif
+    int record_size = 0;
+    for (int i = 0; i < n_fields; i++) {
+        CCML_ASSERT(fields[i]->oper == CCML_OPER_LOAD, "pipelines feed loads");
+        CCML_ASSERT(fields[i]->shape[0] == pipeline->batch_size, "pipeline tensors must share their batch size");
+        pipeline->fields[i] = fields[i];
+        pipeline->row_sizes[i] = ccml_size(fields[i]) / pipeline->batch_size * sizeof(float);
+        record_size += pipeline->row_sizes[i];
+    }
+    pipeline->record_size = options.record_size != 0 ? options.record_size : record_size;
+    CCML_ASSERT(options.decode != NULL || pipeline->record_size >= record_size, "records are smaller than their rows");
+
+    struct stat info;
+    pipeline->fd = open(path, O_RDONLY);
+    if (pipeline->fd == -1 || fstat(pipeline->fd, &info) != 0) {
+        ccml_message(CCML_LOG_ERROR, "failed to open %s", path);
+        if (pipeline->fd != -1) close(pipeline->fd);
+        return NULL;
+    }
 
-CCML_API const char * ccml_oper_opencl(ccml_tensor * tensor) {
-    switch (tensor->oper) {
-        case CCML_OPER_LOG: return "log";
-        case CCML_OPER_EXP: return "exp";
-        case CCML_OPER_SIN: return "sin";
-        case CCML_OPER_REC: return "1/";
-        case CCML_OPER_SQT: return "sqrt";
-        case CCML_OPER_ADD: return "+";
-        case CCML_OPER_MUL: return "*";
-        default: CCML_ASSERT(false, "no meaningful conversion to string exists");
+    pipeline->n_records = info.st_size / pipeline->record_size;
+    pipeline->n_batches = pipeline->n_records / pipeline->batch_size;
+    if (pipeline->n_batches == 0) {
+        ccml_message(CCML_LOG_ERROR, "%s holds less than a batch of records", path);
+        close(pipeline->fd);
+        return NULL;
     }
-}
 
-CCML_API const char * ccml_type_opencl(ccml_tensor * tensor) {
-    switch (tensor->type) {
-        case CCML_TYPE_FP32: return "float ";
-        default: CCML_ASSERT(false, "unknown variant of ccml_type");
+    pipeline->mapped = info.st_size;
+    pipeline->records = mmap(NULL, pipeline->mapped, PROT_READ, MAP_PRIVATE, pipeline->fd, 0);
+    if (pipeline->records == MAP_FAILED) {
+        ccml_message(CCML_LOG_ERROR, "failed to map %s", path);
+        close(pipeline->fd);
+        return NULL;
     }
-}
 
-CCML_API const char * ccml_new_kernel_opencl(ccml_context * ctx, struct ccml_graph * graph,
-                                         int n_kernel, int start, int finish) {
-    int size = CCML_CHAR_MAX * CCML_NODE_MAX * sizeof(char);
-    const char * kernel = ccml_malloc(ctx, size);
-    char * string = (char*)kernel;
-
-    string += snprintf(string, size - (kernel - string), "__kernel void my_kernel_%d(", n_kernel);
-    // adding kernel input parameters to the kernel string
-    int n_kernel_parameters = 0;
-    for (int i = 0; i < graph->n_nodes; i++) {
-        ccml_tensor * tensor = graph->nodes[i];
+    for (int i = 0; i < pipeline->n_slots; i++) {
+        for (int j = 0; j < n_fields; j++) {
+            pipeline->slots[i][j] = ccml_malloc_aligned(ctx, ccml_size(fields[j]) * sizeof(float), ctx->alignment);
+        }
+        pipeline->batches[i] = -1;
+    }
+    if (ccml_context_failed(ctx)) {
+        munmap((void *)pipeline->records, pipeline->mapped);
+        close(pipeline->fd);
+        return NULL;
+    }
 
-        if (ccml_has_buffer(tensor)) {
-            if (n_kernel_parameters == 0) {
-                string += snprintf(string, size - (kernel - string), "__global %s* data_%d",
-                                   ccml_type_opencl(tensor), i);
-                n_kernel_parameters++;
-            } else {
-                string += snprintf(string, size - (kernel - string),  ", __global %s* data_%d",
-                                   ccml_type_opencl(tensor), i);
-                n_kernel_parameters++;
-            }
+    // graphs can be built over the tensors before the first batch is bound
+    for (int i = 0; i < n_fields; i++) fields[i]->data = pipeline->slots[0][i];
+
+    pthread_mutex_init(&pipeline->lock, NULL);
+    pthread_cond_init(&pipeline->filled, NULL);
+    pthread_cond_init(&pipeline->freed, NULL);
+
+    int window = options.window > 1 ? options.window : 1;
+    for (int i = 0; i < pipeline->n_threads; i++) {
+        pipeline->loaders[i] = (ccml_loader) {
+            .pipeline = pipeline,
+            .order    = ccml_malloc(ctx, window * sizeof(int)),
+            .window   = -1
+        };
+        bool started = pipeline->loaders[i].order != NULL &&
+                       pthread_create(&pipeline->threads[i], NULL, ccml_pipeline_loader, &pipeline->loaders[i]) == 0;
+        if (!started) {
+            // the loaders already running are stopped and joined along with everything else
+            ccml_message(CCML_LOG_ERROR, "failed to start pipeline loader %d", i);
+            pipeline->n_threads = i;
+            ccml_pipeline_free(pipeline);
+            return NULL;
         }
     }
 
-    string += snprintf(string, size - (kernel - string), ") {\n");
+    return pipeline;
+}
 
-    // setting up thread grid dims
-    int grid = 1;
-    for (int i = start; i < finish; i++) {
-        ccml_tensor * tensor = graph->nodes[i];
-        grid = grid > tensor->shape[1] ? grid : tensor->shape[1];
+CCML_API int64_t ccml_pipeline_next(ccml_pipeline * pipeline) {
+    // the batch in use goes back to the loaders and the next one is bound to the tensors, which
+    // only waits when the loaders fell behind. batches count on across epochs, n_batches per epoch
+    double start = ccml_time();
+    pthread_mutex_lock(&pipeline->lock);
+    if (pipeline->bound != -1) {
+        pipeline->batches[pipeline->bound] = -1;
+        pipeline->ready[pipeline->bound] = false;
+        pthread_cond_broadcast(&pipeline->freed);
     }
 
-    string += snprintf(string, size - (kernel - string),
-                       "\tint id0 = get_global_id(0) / %d;\n\tint id1 = get_global_id(0) %% %d;\n"
-                       "\tint id2 = get_global_id(1);\n\tint id3 = get_global_id(2);\n\n", grid, grid);
-
-    for (int i = start; i < finish; i++) {
-        ccml_tensor * tensor = graph->nodes[i];
-        switch (tensor->oper) {
-            case CCML_OPER_LOG:
-            case CCML_OPER_EXP:
-            case CCML_OPER_SIN:
-            case CCML_OPER_REC:
-            case CCML_OPER_SQT:
-                string += snprintf(string, size - (kernel - string), "\t%stemp_%d = %s(temp_%d);\n",
-                                   ccml_type_opencl(tensor), tensor->index,
-                                   ccml_oper_opencl(tensor), tensor->src[0]->index);
-                break;
-            case CCML_OPER_ADD:
-            case CCML_OPER_MUL:
-                string += snprintf(string, size - (kernel - string), "\t%stemp_%d = temp_%d %s temp_%d;\n",
-                                   ccml_type_opencl(tensor), tensor->index, tensor->src[0]->index,
-                                   ccml_oper_opencl(tensor), tensor->src[1]->index);
-                break;
-            case CCML_OPER_SUM:
-                string += snprintf(string, size - (kernel - string), "\tfor (int i = 0; i < %d; i++) {\n"
-                                   "\t\tdata_%d%s += temp_%d;\n"
-                                   "\t}\n", ccml_size(tensor->src[0]) / ccml_size(tensor), tensor->index + 1,
-                                   ccml_new_index(ctx, tensor, tensor->src[0]), tensor->src[0]->index);
-                break;
-            case CCML_OPER_RES:
-            case CCML_OPER_PER:
-                string += snprintf(string, size - (kernel - string), "\tdevice %s* data_%d = data_%d;\n"
-                                   "\t%stemp_%d = data_%d%s;\n", ccml_type_opencl(tensor), tensor->index,
-                                    tensor->src[0]->index, ccml_type_opencl(tensor), tensor->index,
-                                    tensor->index, ccml_new_index(ctx, NULL, tensor));
-                break;
-            case CCML_OPER_LOAD:
-                string += snprintf(string, size - (kernel - string), "\t%stemp_%d = data_%d%s;\n",
-                                   ccml_type_opencl(tensor), tensor->index, tensor->index, ccml_new_index(ctx, NULL, tensor));
-                break;
-            case CCML_OPER_INTR:
-                string += snprintf(string, size - (kernel - string), "\t%stemp_%d = data_%d%s;\n",
-                                   ccml_type_opencl(tensor), tensor->index, tensor->index, ccml_new_index(ctx, NULL, tensor));
-                break;
-            case CCML_OPER_SAVE:
-                string += snprintf(string, size - (kernel - string), "\tdata_%d%s = temp_%d;\n",
-                                   tensor->index, ccml_new_index(ctx, NULL, tensor), tensor->src[0]->index);
-                break;
-            default:
-                CCML_ASSERT(false, "unknown variant of ccml_oper");
+    int64_t batch = pipeline->consumed++;
+    int slot = -1;
+    while (slot == -1) {
+        for (int i = 0; i < pipeline->n_slots && slot == -1; i++) {
+            if (pipeline->batches[i] == batch && pipeline->ready[i]) slot = i;
         }
+        if (slot == -1) pthread_cond_wait(&pipeline->filled, &pipeline->lock);
     }
+    pipeline->bound = slot;
+    pipeline->stalled += ccml_time() - start;
+    pthread_mutex_unlock(&pipeline->lock);
 
-    snprintf(string, size - (kernel - string), "}");
+    for (int i = 0; i < pipeline->n_fields; i++) {
+        pipeline->fields[i]->data = pipeline->slots[slot][i];
+        ccml_invalidate(pipeline->fields[i]);
+    }
 
-    return kernel;
+    return batch;
 }
 
-CCML_API void ccml_check_error_opencl(cl_int err, const char* operation) {
-    if (err != CL_SUCCESS) {
-        fprintf(stderr, "Error during operation '%s': %d\n", operation, err);
-        exit(1);
+CCML_API void ccml_pipeline_free(ccml_pipeline * pipeline) {
+    // the tensors are unbound from the slots, they need data of their own before a graph
+    // reads them again
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->stop = true;
+    pthread_cond_broadcast(&pipeline->freed);
+    pthread_mutex_unlock(&pipeline->lock);
+
+    for (int i = 0; i < pipeline->n_threads; i++) {
+        pthread_join(pipeline->threads[i], NULL);
     }
-}
 
-CCML_API void ccml_execute_graph_opencl(ccml_context * ctx, ccml_graph * graph) {
-    const char * kernel_source = ccml_new_kernel_opencl(ctx, graph, 0, 0, graph->n_nodes);
-    printf("kernel is: \n %s \n", kernel_source);
+    munmap((void *)pipeline->records, pipeline->mapped);
+    close(pipeline->fd);
+    pthread_mutex_destroy(&pipeline->lock);
+    pthread_cond_destroy(&pipeline->filled);
+    pthread_cond_destroy(&pipeline->freed);
 
-    // get platform and device information
-    cl_platform_id platform_id = NULL;
-    cl_device_id device_id = NULL;
-    cl_uint ret_num_devices;
-    cl_uint ret_num_platforms;
-    cl_int ret = clGetPlatformIDs(1, &platform_id, &ret_num_platforms);
-    ccml_check_error_opencl(ret, "clGetPlatformIDs");
+    for (int i = 0; i < pipeline->n_fields; i++) {
+        pipeline->fields[i]->data = NULL;
+    }
+}
 
-    ret = clGetDeviceIDs(platform_id, CL_DEVICE_TYPE_DEFAULT, 1, &device_id, &ret_num_devices);
-    ccml_check_error_opencl(ret, "clGetDeviceIDs");
+//
+//  ███████╗██╗  ██╗██████╗  ██████╗ ██████╗ ████████╗
+//  ██╔════╝╚██╗██╔╝██╔══██╗██╔═══██╗██╔══██╗╚══██╔══╝
+//  █████╗   ╚███╔╝ ██████╔╝██║   ██║██████╔╝   ██║
+//  ██╔══╝   ██╔██╗ ██╔═══╝ ██║   ██║██╔══██╗   ██║
+//  ███████╗██╔╝ ██╗██║     ╚██████╔╝██║  ██║   ██║
+//  ╚══════╝╚═╝  ╚═╝╚═╝      ╚═════╝ ╚═╝  ╚═╝   ╚═╝
+//
 
-    // create OpenCL context
-    cl_context context = clCreateContext(NULL, 1, &device_id, NULL, NULL, &ret);
-    ccml_check_error_opencl(ret, "clCreateContext");
+// graphs can be exported as a c library with no dependency on ccml, for targets that can't
+// compile kernels at runtime. the library holds the kernels, a static buffer per intermediate
+// and a run function. inputs are bound to the kernels as they are, outputs are copied out.
+// every other load is a weight, either embedded with its current values or bound by the caller
 
-    // create command queue
-    cl_command_queue command_queue = clCreateCommandQueue(context, device_id, 0, &ret);
-    ccml_check_error_opencl(ret, "clCreateCommandQueue");
+#if !defined(CCML_EXPORT_WIDTH)
+    #define CCML_EXPORT_WIDTH 8
+#endif
 
-    // create memory buffers on the device for each vector and copy data inside buffers
-    cl_mem buffers[CCML_NODE_MAX] = {NULL};
-    for (int i = 0; i < graph->n_nodes; i++) {
-        ccml_tensor * tensor = graph->nodes[i];
-        if (ccml_has_buffer(tensor) && tensor->oper != CCML_OPER_SAVE) {
-            buffers[i] = clCreateBuffer(context, CL_MEM_READ_ONLY, ccml_size(tensor) * sizeof(float), NULL, &ret);
-            ccml_check_error_opencl(ret, "clCreateBuffer");
+CCML_API const char * ccml_export_type(ccml_tensor * tensor) {
+    return tensor->type == CCML_TYPE_INT32 ? "ints" : "floats";
+}
 
-            ret = clEnqueueWriteBuffer(command_queue, buffers[i], CL_TRUE, 0, ccml_size(tensor) * sizeof(float), tensor->data, 0, NULL, NULL);
-            ccml_check_error_opencl(ret, "clEnqueueWriteBuffer");
-        } else if (ccml_has_buffer(tensor) && tensor->oper == CCML_OPER_SAVE) {
-            buffers[i] = clCreateBuffer(context, CL_MEM_WRITE_ONLY, ccml_size(tensor) * sizeof(float), NULL, &ret);
-            ccml_check_error_opencl(ret, "clCreateBuffer");
+CCML_API void ccml_export_values(FILE * file, ccml_tensor * tensor) {
+    // hex floats round-trip exactly, which decimal ones only do with enough digits
+    int size = ccml_size(tensor);
+    for (int i = 0; i < size; i++) {
+        const char * separator = i == 0 ? "\n\t" : i % 8 == 0 ? ",\n\t" : ", ";
+        if (tensor->type == CCML_TYPE_INT32) {
+            fprintf(file, "%s%d", separator, ((int32_t *)tensor->data)[i]);
+        } else if (isnan(tensor->data[i])) {
+            fprintf(file, "%sNAN", separator);
+        } else if (isinf(tensor->data[i])) {
+            fprintf(file, "%s%sINFINITY", separator, tensor->data[i] < 0 ? "-" : "");
+        } else {
+            fprintf(file, "%s%a", separator, tensor->data[i]);
         }
     }
+    fprintf(file, "\n");
+}
 
-    // Create a program from the kernel source
-    cl_program program = clCreateProgramWithSource(context, 1, &kernel_source, NULL, &ret);
-    ccml_check_error_opencl(ret, "clCreateProgramWithSource");
-
-    // Build the program
-    ret = clBuildProgram(program, 1, &device_id, NULL, NULL, NULL);
-    if (ret != CL_SUCCESS) {
-        size_t len;
-        char buffer[2048];
-        clGetProgramBuildInfo(program, device_id, CL_PROGRAM_BUILD_LOG, sizeof(buffer), buffer, &len);
-        fprintf(stderr, "Build error: %s\n", buffer);
-        exit(1);
+CCML_API void ccml_export_source(FILE * file, ccml_graph * graph, const char * name, ccml_ir ** irs, int n_irs,
+                                 const char * program, int * roles, bool embed) {
+    // roles are the input or weight a load is, or -1 for the buffers the library owns.
+    // buffers no kernel touches are left out and stay NULL in the table
+    for (int i = 0; i < n_irs; i++) {
+        fprintf(file, "static void my_kernel_%d(float ** data, int start, int finish);\n", irs[i]->n_kernel);
     }
+    fprintf(file, "\n%s\n", program);
 
-    // Create the OpenCL kernel
-    cl_kernel kernel = clCreateKernel(program, "my_kernel_0", &ret);
-    ccml_check_error_opencl(ret, "clCreateKernel");
+    bool used[CCML_NODE_MAX] = {false};
+    for (int i = 0; i < graph->n_nodes; i++) {
+        for (int j = 0; j < n_irs && !used[i]; j++) used[i] = ccml_ir_uses(irs[j], i);
+    }
 
-    // Set the arguments of the kernel
-    int buffer_index = 0;
-    int grid[CCML_DIMS_MAX] = {1, 1, 1, 1};
+    int n_buffers = 0;
     for (int i = 0; i < graph->n_nodes; i++) {
         ccml_tensor * tensor = graph->nodes[i];
-        if (ccml_has_buffer(tensor)) {
-            ret = clSetKernelArg(kernel, buffer_index++, sizeof(cl_mem), (void *)&buffers[i]);
-            ccml_check_error_opencl(ret, "clSetKernelArg");
-        }
+        if (!ccml_has_buffer(tensor)) continue;
 
-        for (int j = 0; j < CCML_DIMS_MAX; j++) {
-            if (grid[j] < tensor->shape[j]) grid[j] = tensor->shape[j];
+        n_buffers++;
+        bool weight = tensor->oper == CCML_OPER_LOAD && roles[i] < 0;
+        if (roles[i] >= 0 || (weight && !embed) || !used[i]) continue;
+
+        fprintf(file, "static _Alignas(64) %sbuffer_%d[%d]%s", ccml_type_string(tensor->type), i, ccml_size(tensor), weight ? " = {" : ";\n");
+        if (weight) {
+            ccml_export_values(file, tensor);
+            fprintf(file, "};\n");
         }
     }
 
-    // Execute the OpenCL kernel on the list
-    size_t global_item_size[3] = {grid[0] * grid[1], grid[2], grid[3]}; // Adjust according to your problem
-    ret = clEnqueueNDRangeKernel(command_queue, kernel, 1, NULL, global_item_size, NULL, 0, NULL, NULL);
-    ccml_check_error_opencl(ret, "clEnqueueNDRangeKernel");
-
-    // Read the memory buffer c on the device to the local variable c
-    float * result = NULL;
-    int result_size = 1;
-    for (int i = 0; i < graph->n_nodes; i++) {
-        ccml_tensor * tensor = graph->nodes[i];
-        if (ccml_has_buffer(tensor) && tensor->oper == CCML_OPER_SAVE) {
-            ret = clEnqueueReadBuffer(command_queue, buffers[i], CL_TRUE, 0, ccml_size(tensor) * sizeof(float), tensor->data, 0, NULL, NULL);
-            ccml_check_error_opencl(ret, "clEnqueueReadBuffer");
+    fprintf(file, "\nstatic float * %s_data[%d] = {", name, n_buffers);
+    for (int i = 0, j = 0; i < graph->n_nodes; i++) {
+        if (!ccml_has_buffer(graph->nodes[i])) continue;
+        bool bound = roles[i] >= 0 || (graph->nodes[i]->oper == CCML_OPER_LOAD && !embed) || !used[i];
+        fprintf(file, "%s%s", j++ % 8 == 0 ? "\n\t" : " ", bound ? "0," : "");
+        if (!bound) fprintf(file, "(float *)buffer_%d,", i);
+    }
+    fprintf(file, "\n};\n");
+
+    if (!embed) {
+        fprintf(file, "\nvoid %s_bind(float ** weights) {\n", name);
+        for (int i = 0, j = 0; i < graph->n_nodes; i++) {
+            if (!ccml_has_buffer(graph->nodes[i])) continue;
+            if (graph->nodes[i]->oper == CCML_OPER_LOAD && roles[i] < 0) {
+                fprintf(file, "\t%s_data[%d] = weights[%d];\n", name, j, -roles[i] - 1);
+            }
+            j++;
+        }
+        fprintf(file, "}\n");
+    }
 
-            result = tensor->data;
-            result_size = ccml_size(tensor);
+    // sums start out from zero and max reductions from -inf on every run
+    fprintf(file, "\nvoid %s_run(float ** inputs, float ** outputs) {\n\tfloat * data[%d];\n", name, n_buffers);
+    fprintf(file, "\tmemcpy(data, %s_data, sizeof(data));\n", name);
+    for (int i = 0, j = 0; i < graph->n_nodes; i++) {
+        if (!ccml_has_buffer(graph->nodes[i])) continue;
+        if (roles[i] >= 0) fprintf(file, "\tdata[%d] = inputs[%d];\n", j, roles[i]);
+        j++;
+    }
+    for (int i = 0; i < n_irs; i++) {
+        ccml_ir * ir = irs[i];
+        for (int j = 0; j < ir->n_ops; j++) {
+            ccml_oper oper = ir->ops[j].oper;
+            int buffer = ir->ops[j].buffer;
+            if (oper == CCML_OPER_SUM || oper == CCML_OPER_SCATTER_ADD) {
+                fprintf(file, "\tmemset(buffer_%d, 0, sizeof(buffer_%d));\n", buffer, buffer);
+            }
+            if (oper == CCML_OPER_RMAX) {
+                fprintf(file, "\tfor (int i = 0; i < %d; i++) buffer_%d[i] = -INFINITY;\n",
+                        ccml_size(graph->nodes[buffer]), buffer);
+            }
         }
+        fprintf(file, "\tmy_kernel_%d(data, 0, %d);\n", ir->n_kernel, ir->threads[0]);
     }
+    for (int i = 0; i < graph->n_outputs; i++) {
+        int output = ccml_hashmap_get(graph->map, graph->outputs[i]);
+        fprintf(file, "\tmemcpy(outputs[%d], buffer_%d, sizeof(buffer_%d));\n", i, output, output);
+    }
+    fprintf(file, "}\n");
+}
 
-    for (int i = 0; i < result_size; i++) {
-        printf("%f ", result[i]);
+CCML_API ccml_status ccml_graph_export(ccml_context * ctx, ccml_graph * graph, const char * path,
+                                       int n_inputs, ccml_tensor ** inputs, bool embed) {
+    // writes path.c and path.h, the functions are prefixed with the last component of the
+    // path. inputs are fed to run in the order given here and the weights, when they aren't
+    // embedded, are bound in graph order. the library always runs the traced row count, so
+    // graphs running fewer rows through ccml_graph_set_rows can't be exported
+    if (graph->rows != 0) {
+        ccml_message(CCML_LOG_ERROR, "graphs running %d of their rows can't be exported", graph->rows);
+        return CCML_STATUS_UNSUPPORTED;
     }
 
-    // Clean up
+    if (ccml_context_failed(ctx)) return ctx->status;
+    int used = ctx->used;
+    const char * name = strrchr(path, '/') != NULL ? strrchr(path, '/') + 1 : path;
+
+    int roles[CCML_NODE_MAX];
+    int n_weights = 0;
     for (int i = 0; i < graph->n_nodes; i++) {
-        if (buffers[i] != NULL) {
-            clReleaseMemObject(buffers[i]);
-        }
+        roles[i] = -1;
+    }
+    for (int i = 0; i < n_inputs; i++) {
+        int node = ccml_hashmap_get(graph->map, inputs[i]);
+        CCML_ASSERT(node != -1 && inputs[i]->oper == CCML_OPER_LOAD, "exported inputs must be loads of the graph");
+        roles[node] = i;
+    }
+    for (int i = 0; i < graph->n_nodes; i++) {
+        if (graph->nodes[i]->oper == CCML_OPER_LOAD && roles[i] < 0) roles[i] = -(++n_weights);
+        CCML_ASSERT(!embed || roles[i] >= 0 || graph->nodes[i]->oper != CCML_OPER_LOAD || graph->nodes[i]->data != NULL,
+                    "embedded weights must hold data");
     }
 
+    int n_kernels = 0;
+    int kernels[CCML_KERN_MAX][2];
+    ccml_new_kernel_slice(graph, &n_kernels, kernels);
+    ccml_ir * irs[CCML_KERN_MAX];
+    for (int i = 0; i < n_kernels; i++) {
+        irs[i] = ccml_new_ir(ctx, graph, i, kernels[i][0], kernels[i][1]);
+        if (irs[i] == NULL) return ccml_context_rollback(ctx, used);
+        ccml_ir_vectorize(irs[i], CCML_EXPORT_WIDTH);
+    }
+    const char * program = ccml_new_program(ctx, irs, n_kernels, CCML_DIALECT_C);
+    if (program == NULL) return ccml_context_rollback(ctx, used);
+
+    char file_path[1024];
+    snprintf(file_path, sizeof(file_path), "%s.h", path);
+    FILE * header = fopen(file_path, "w");
+    snprintf(file_path, sizeof(file_path), "%s.c", path);
+    FILE * source = fopen(file_path, "w");
+    if (header == NULL || source == NULL) {
+        ccml_message(CCML_LOG_ERROR, "failed to create %s", header == NULL ? "header" : "source");
+        if (header != NULL) fclose(header);
+        if (source != NULL) fclose(source);
+        ctx->used = used;
+        return CCML_STATUS_IO_FAILED;
+    }
 
-    clReleaseKernel(kernel);
-    clReleaseProgram(program);
-    clReleaseCommandQueue(command_queue);
-    clReleaseContext(context);
-}
-#else
-
-CCML_API const char * ccml_oper_opencl(ccml_tensor *);
-CCML_API const char * ccml_type_opencl(ccml_tensor *);
-CCML_API const char * ccml_new_kernel_opencl(ccml_context *, ccml_graph *, int, int, int);
-CCML_API void ccml_execute_graph_opencl(ccml_context *, ccml_graph *);
+    fprintf(header, "// generated by ccml, %d kernels over %d nodes\n\n", n_kernels, graph->n_nodes);
+    fprintf(header, "#pragma once\n\n#ifdef __cplusplus\nextern \"C\" {\n#endif\n\n");
+    for (int i = 0; i < n_inputs; i++) {
+        fprintf(header, "// input %d holds %d %s\n", i, ccml_size(inputs[i]), ccml_export_type(inputs[i]));
+    }
+    for (int i = 0; i < graph->n_outputs; i++) {
+        ccml_tensor * output = graph->outputs[i];
+        fprintf(header, "// output %d holds %d %s\n", i, ccml_size(output), ccml_export_type(output));
+    }
+    if (!embed) {
+        for (int i = 0; i < graph->n_nodes; i++) {
+            ccml_tensor * tensor = graph->nodes[i];
+            if (tensor->oper != CCML_OPER_LOAD || roles[i] >= 0) continue;
+            fprintf(header, "// weight %d holds %d %s\n", -roles[i] - 1, ccml_size(tensor), ccml_export_type(tensor));
+        }
+        fprintf(header, "\nvoid %s_bind(float ** weights);", name);
+    }
+    fprintf(header, "\nvoid %s_run(float ** inputs, float ** outputs);\n", name);
+    fprintf(header, "\n#ifdef __cplusplus\n}\n#endif\n");
 
-#endif /* defined CCML_BACKEND_OPENCL */
+    fprintf(source, "// generated by ccml, link with -lm\n\n#include <string.h>\n#include \"%s.h\"\n\n", name);
+    ccml_export_source(source, graph, name, irs, n_kernels, program, roles, embed);
 
-//
-//  ███████╗██╗  ██╗███████╗ ██████╗██╗   ██╗████████╗██╗ ██████╗ ███╗   ██╗
-//  ██╔════╝╚██╗██╔╝██╔════╝██╔════╝██║   ██║╚══██╔══╝██║██╔═══██╗████╗  ██║
-//  █████╗   ╚███╔╝ █████╗  ██║     ██║   ██║   ██║   ██║██║   ██║██╔██╗ ██║
-//  ██╔══╝   ██╔██╗ ██╔══╝  ██║     ██║   ██║   ██║   ██║██║   ██║██║╚██╗██║
-//  ███████╗██╔╝ ██╗███████╗╚██████╗╚██████╔╝   ██║   ██║╚██████╔╝██║ ╚████║
-//  ╚══════╝╚═╝  ╚═╝╚══════╝ ╚═════╝ ╚═════╝    ╚═╝   ╚═╝ ╚═════╝ ╚═╝  ╚═══╝
-//
+    bool written = !ferror(header) && !ferror(source);
+    written &= fclose(header) == 0;
+    written &= fclose(source) == 0;
+    if (!written) ccml_message(CCML_LOG_ERROR, "failed to write %s", path);
 
-CCML_API void ccml_graph_execute(ccml_context * ctx, ccml_graph * graph) {
-    #if defined(CCML_BACKEND_METAL)
-        ccml_execute_graph_metal(ctx, graph);
-    #elif defined(CCML_BACKEND_OPENCL)
-        ccml_execute_graph_opencl(ctx, graph);
-    #else
-        #error unknown backend
-    #endif
+    ctx->used = used;
+    return written ? CCML_STATUS_OK : CCML_STATUS_IO_FAILED;
 }
 
 #endif /* CCML_IMPL */
\ No newline at end of file
@@ -0,0 +1,87 @@
+#define CCML_BACKEND_CPU
+#include "../ccml.h"
+
+#define N 65536
+#define N_OPS 5
+
+typedef struct op {
+    const char * name;
+    ccml_tensor * (*build)(ccml_context * ctx, ccml_tensor * tensor);
+    double (*reference)(double x);
+    float min, max;
+} op;
+
+static double rec(double x) {
+    return 1.0 / x;
+}
+
+// distance to the double reference in units of the float spacing around the reference
+static double ulp_error(float value, double reference) {
+    float rounded = (float)fabs(reference);
+    double ulp = nextafterf(rounded, INFINITY) - rounded;
+    return fabs(value - reference) / (ulp > 0.0 ? ulp : 1e-45);
+}
+
+int main() {
+    op ops[N_OPS] = {
+        {"log",  ccml_log,  log,  1e-3f, 1e3f},
+        {"exp",  ccml_exp,  exp,  -80.0f, 80.0f},
+        {"sin",  ccml_sin,  sin,  -100.0f, 100.0f},
+        {"sqrt", ccml_sqrt, sqrt, 0.0f, 1e4f},
+        {"rec",  ccml_rec,  rec,  1e-2f, 1e2f},
+    };
+    ccml_accuracy modes[] = {CCML_ACCURACY_PRECISE, CCML_ACCURACY_FAST};
+    const char * names[] = {"precise", "fast"};
+
+    // creating new memory context
+    ccml_context * ctx = ccml_new_context(64 << 20 /* bytes */);
+
+    // one input per op spread evenly over the range it is checked on
+    ccml_tensor * inputs[N_OPS];
+    ccml_tensor * roots[N_OPS];
+    for (int i = 0; i < N_OPS; i++) {
+        inputs[i] = ccml_new_tensor(ctx, N);
+        ccml_fill(ctx, inputs[i], 0.0f);
+        for (int j = 0; j < N; j++) {
+            inputs[i]->data[j] = ops[i].min + (ops[i].max - ops[i].min) * j / (N - 1);
+        }
+        roots[i] = ops[i].build(ctx, inputs[i]);
+    }
+
+    // the same ops compiled once per accuracy, errors are measured against libm in double
+    double ulps[2][N_OPS], errors[2][N_OPS];
+    for (int m = 0; m < 2; m++) {
+        ccml_graph * graph = ccml_new_graph_options(ctx, N_OPS, roots, NULL,
+                                                    (ccml_graph_options) {.inference = true, .accuracy = modes[m]});
+        if (ccml_graph_execute(ctx, graph) != CCML_STATUS_OK) {
+            ccml_context_free(ctx);
+            return 1;
+        }
+
+        for (int i = 0; i < N_OPS; i++) {
+            ccml_tensor * result = ccml_graph_output_at(graph, i);
+            ulps[m][i] = errors[m][i] = 0.0;
+            for (int j = 0; j < N; j++) {
+                double reference = ops[i].reference(inputs[i]->data[j]);
+                double error = fabs(result->data[j] - reference);
+                ulps[m][i] = fmax(ulps[m][i], ulp_error(result->data[j], reference));
+                errors[m][i] = fmax(errors[m][i], error / fmax(fabs(reference), 1.0));
+            }
+        }
+    }
+
+    // relative errors turn absolute below one, where sin crosses zero
+    printf("%-6s %-20s", "op", "range");
+    for (int m = 0; m < 2; m++) printf(" %10s ulp %10s err", names[m], names[m]);
+    printf("\n");
+    for (int i = 0; i < N_OPS; i++) {
+        char range[32];
+        snprintf(range, sizeof(range), "[%g, %g]", ops[i].min, ops[i].max);
+        printf("%-6s %-20s", ops[i].name, range);
+        for (int m = 0; m < 2; m++) printf(" %14.2f %14.2e", ulps[m][i], errors[m][i]);
+        printf("\n");
+    }
+
+    // freeing the context
+    ccml_context_free(ctx);
+}
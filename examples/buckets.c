@@ -0,0 +1,52 @@
+#define CCML_BACKEND_CPU
+#include "../ccml.h"
+
+#define FEATURES 16
+
+int main() {
+    // creating new memory context
+    ccml_context * ctx = ccml_new_context(16 << 20 /* bytes */);
+
+    // sequences of varying length are traced once at the bucket of their length, the rows past
+    // the live ones are only padding
+    int lengths[] = {20, 13};
+    int bucket = ccml_bucket(lengths[0]);
+    ccml_tensor * x = ccml_new_tensor(ctx, bucket, FEATURES);
+    ccml_tensor * w = ccml_new_tensor(ctx, 1, FEATURES);
+    ccml_fill(ctx, x, 0.0f);
+    ccml_fill(ctx, w, 0.0f);
+    for (int i = 0; i < bucket * FEATURES; i++) x->data[i] = sinf(i * 0.3f);
+    for (int i = 0; i < FEATURES; i++) w->data[i] = cosf(i * 0.7f);
+
+    ccml_tensor * scaled = ccml_mul(ctx, x, w);
+    ccml_tensor * y = ccml_sum(ctx, ccml_exp(ctx, scaled), 1, (int[]) {1});
+    ccml_graph * graph = ccml_new_graph_options(ctx, 1, &y, NULL, (ccml_graph_options) {.inference = true});
+
+    // short batches run kernels taking the row count as an argument, so every length below
+    // the bucket goes through the same compiled programs
+    printf("%-8s %10s %10s\n", "rows", "max error", "programs");
+    int programs[2];
+    double error = 0.0;
+    for (int i = 0; i < 2; i++) {
+        ccml_graph_set_rows(graph, lengths[i]);
+        if (ccml_graph_execute(ctx, graph) != CCML_STATUS_OK) {
+            ccml_context_free(ctx);
+            return 1;
+        }
+
+        double row_error = 0.0;
+        for (int r = 0; r < lengths[i]; r++) {
+            double reference = 0.0;
+            for (int c = 0; c < FEATURES; c++) reference += exp(x->data[r * FEATURES + c] * w->data[c]);
+            row_error = fmax(row_error, fabs(ccml_graph_output(graph)->data[r] - reference) / reference);
+        }
+        error = fmax(error, row_error);
+        programs[i] = ccml_cache_count();
+        printf("%-8d %10.2e %10d\n", lengths[i], row_error, programs[i]);
+    }
+
+    // freeing the context
+    ccml_context_free(ctx);
+
+    return error < 1e-5 && programs[1] == programs[0] ? 0 : 1;
+}
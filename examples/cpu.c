@@ -0,0 +1,30 @@
+#define CCML_BACKEND_CPU
+#include "../ccml.h"
+
+int main() {
+    // creating new memory context
+    ccml_context * ctx = ccml_new_context(2<<16 /* bytes */);
+
+    // creating 2d 2x3 tensor w/o gradient tracking
+    ccml_tensor * x = ccml_new_tensor(ctx, 2, 3);
+    ccml_tensor * z = ccml_sin(ctx, ccml_cos(ctx, x));
+
+    // initialising tensors with data
+    ccml_fill(ctx, x, 2.0f);
+
+    // creating a new computational graph
+    ccml_graph * graph = ccml_new_graph(ctx, z);
+    if (ccml_graph_execute(ctx, graph) != CCML_STATUS_OK) {
+        ccml_context_free(ctx);
+        return 1;
+    }
+
+    ccml_tensor * result = ccml_graph_output(graph);
+    for (int i = 0; i < ccml_size(result); i++) {
+        printf("%f ", result->data[i]);
+    }
+    printf("\n");
+
+    // freeing the context
+    ccml_context_free(ctx);
+}
\ No newline at end of file
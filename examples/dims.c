@@ -0,0 +1,56 @@
+#define CCML_BACKEND_CPU
+#define CCML_DIMS_MAX 6
+#include "../ccml.h"
+
+int main() {
+    // creating new memory context
+    ccml_context * ctx = ccml_new_context(16 << 20 /* bytes */);
+
+    // creating a full-rank 6d 2x3x2x4x3x2 tensor with gradient tracking
+    int shape[CCML_DIMS_MAX] = {2, 3, 2, 4, 3, 2};
+    ccml_tensor * x = ccml_new_tensor(ctx, 2, 3, 2, 4, 3, 2, CCML_GRAD_YES);
+    ccml_fill(ctx, x, 0.0f);
+    for (int i = 0; i < ccml_size(x); i++) x->data[i] = sinf(i * 0.1f);
+
+    // the last axis swapped with the first one, then reduced over every other axis
+    ccml_tensor * permuted = ccml_permute(ctx, ccml_sin(ctx, x), (int[CCML_DIMS_MAX]) {5, 1, 2, 3, 4, 0});
+    ccml_tensor * y = ccml_sum(ctx, permuted, 3, (int[]) {1, 3, 5});
+    ccml_tensor * loss = ccml_sum(ctx, ccml_square(ctx, y), CCML_DIMS_MAX, (int[]) {0, 1, 2, 3, 4, 5});
+
+    ccml_graph * graph = ccml_new_graph(ctx, loss);
+    if (ccml_graph_execute(ctx, graph) != CCML_STATUS_OK) {
+        ccml_context_free(ctx);
+        return 1;
+    }
+
+    // references computed on the host in double, y[f][c][e] sums sin(x) over the other axes
+    // and the gradient of sum(y^2) with respect to x is 2 * y * cos(x)
+    double sums[2][2][3] = {0};
+    for (int i = 0; i < ccml_size(x); i++) {
+        int c = i / (shape[3] * shape[4] * shape[5]) % shape[2];
+        int e = i / shape[5] % shape[4];
+        int f = i % shape[5];
+        sums[f][c][e] += sin(x->data[i]);
+    }
+
+    double loss_reference = 0.0;
+    for (int i = 0; i < 12; i++) loss_reference += ((double *)sums)[i] * ((double *)sums)[i];
+
+    double gradient_error = 0.0;
+    for (int i = 0; i < ccml_size(x); i++) {
+        int c = i / (shape[3] * shape[4] * shape[5]) % shape[2];
+        int e = i / shape[5] % shape[4];
+        int f = i % shape[5];
+        double reference = 2.0 * sums[f][c][e] * cos(x->data[i]);
+        gradient_error = fmax(gradient_error, fabs(x->grad->data[i] - reference));
+    }
+
+    double loss_error = fabs(ccml_graph_output(graph)->data[0] - loss_reference) / loss_reference;
+    printf("%-28s %10.2e\n", "loss relative error", loss_error);
+    printf("%-28s %10.2e\n", "gradient max error", gradient_error);
+
+    // freeing the context
+    ccml_context_free(ctx);
+
+    return loss_error < 1e-5 && gradient_error < 1e-4 ? 0 : 1;
+}
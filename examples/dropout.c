@@ -0,0 +1,58 @@
+#define CCML_BACKEND_CPU
+#include "../ccml.h"
+
+#define ROWS 512
+#define COLS 128
+#define P 0.25f
+
+int main() {
+    // creating new memory context
+    ccml_context * ctx = ccml_new_context(16 << 20 /* bytes */);
+
+    // random tensors are generated in the kernels from a seed tensor and a stream per tensor,
+    // so they take no memory and a new seed is all it takes to draw again
+    ccml_tensor * seed = ccml_new_tensor(ctx, 1, CCML_TYPE_INT32);
+    ccml_tensor * x = ccml_new_tensor(ctx, ROWS, COLS);
+    ccml_fill(ctx, seed, 1);
+    ccml_fill(ctx, x, 1.0f);
+
+    ccml_tensor * uniform = ccml_uniform(ctx, (int[CCML_DIMS_MAX]) {ROWS, COLS}, seed, 0);
+    ccml_tensor * dropped = ccml_dropout(ctx, x, P, seed, 1);
+
+    ccml_tensor * roots[] = {uniform, dropped};
+    ccml_graph * graph = ccml_new_graph_options(ctx, 2, roots, NULL, (ccml_graph_options) {.inference = true});
+
+    // the same seed draws the same values, another one draws new ones
+    static float first[ROWS * COLS];
+    int seeds[] = {1, 2, 1};
+    printf("%-6s %10s %10s %10s %10s %10s\n", "seed", "mean", "variance", "dropped", "kept mean", "changed");
+    for (int s = 0; s < 3; s++) {
+        ((int32_t *)seed->data)[0] = seeds[s];
+        ccml_invalidate(seed);
+        if (ccml_graph_execute(ctx, graph) != CCML_STATUS_OK) {
+            ccml_context_free(ctx);
+            return 1;
+        }
+
+        // uniforms should have a mean of 1/2 and a variance of 1/12, dropout should zero
+        // a fraction p and scale the rest so the mean stays at 1
+        float * u = ccml_graph_output_at(graph, 0)->data;
+        float * d = ccml_graph_output_at(graph, 1)->data;
+        double mean = 0.0, square = 0.0, zeros = 0.0, kept = 0.0;
+        int changed = 0;
+        for (int i = 0; i < ROWS * COLS; i++) {
+            mean += u[i];
+            square += u[i] * u[i];
+            zeros += d[i] == 0.0f;
+            kept += d[i];
+            if (s == 0) first[i] = u[i];
+            changed += u[i] != first[i];
+        }
+        mean /= ROWS * COLS;
+        printf("%-6d %10.4f %10.4f %10.4f %10.4f %10d\n", seeds[s], mean, square / (ROWS * COLS) - mean * mean,
+               zeros / (ROWS * COLS), kept / (ROWS * COLS), changed);
+    }
+
+    // freeing the context
+    ccml_context_free(ctx);
+}
@@ -0,0 +1,77 @@
+#define CCML_BACKEND_CPU
+#include "../ccml.h"
+
+#define BATCH 4
+#define INPUTS 8
+#define HIDDEN 16
+#define OUTPUTS 3
+
+typedef void (*run_fn)(float ** inputs, float ** outputs);
+
+int main() {
+    // creating new memory context
+    ccml_context * ctx = ccml_new_context(16 << 20 /* bytes */);
+
+    // a small classifier whose weights are embedded into the library with their current values
+    ccml_tensor * x = ccml_new_tensor(ctx, BATCH, INPUTS);
+    ccml_tensor * w1 = ccml_new_tensor(ctx, INPUTS, HIDDEN);
+    ccml_tensor * w2 = ccml_new_tensor(ctx, HIDDEN, OUTPUTS);
+    ccml_fill(ctx, x, 0.0f);
+    ccml_fill(ctx, w1, 0.0f);
+    ccml_fill(ctx, w2, 0.0f);
+    for (int i = 0; i < BATCH * INPUTS; i++) x->data[i] = sinf(i);
+    for (int i = 0; i < INPUTS * HIDDEN; i++) w1->data[i] = cosf(i * 0.3f) * 0.5f;
+    for (int i = 0; i < HIDDEN * OUTPUTS; i++) w2->data[i] = sinf(i * 0.7f) * 0.5f;
+
+    ccml_tensor * hidden = ccml_relu(ctx, ccml_matmul(ctx, x, w1));
+    ccml_tensor * y = ccml_softmax(ctx, ccml_matmul(ctx, hidden, w2), 1);
+
+    ccml_tensor * roots[] = {y};
+    ccml_graph * graph = ccml_new_graph_options(ctx, 1, roots, NULL, (ccml_graph_options) {.inference = true});
+    if (ccml_graph_execute(ctx, graph) != CCML_STATUS_OK) {
+        ccml_context_free(ctx);
+        return 1;
+    }
+
+    // the library is written next to the example as model.c and model.h, x is its only input
+    if (ccml_graph_export(ctx, graph, "model", 1, (ccml_tensor *[]) {x}, true) != CCML_STATUS_OK) {
+        ccml_context_free(ctx);
+        return 1;
+    }
+
+    // compiled the way a project embedding it would, any warning fails the build
+    if (system(CCML_CPU_COMPILER " -Wall -Wextra -Werror -o ./libmodel.so model.c -lm") != 0) {
+        printf("model.c doesn't compile cleanly\n");
+        ccml_context_free(ctx);
+        return 1;
+    }
+
+    void * library = dlopen("./libmodel.so", RTLD_NOW | RTLD_LOCAL);
+    run_fn run = library != NULL ? (run_fn)dlsym(library, "model_run") : NULL;
+    if (run == NULL) {
+        printf("failed to load the model: %s\n", dlerror());
+        ccml_context_free(ctx);
+        return 1;
+    }
+
+    // the library vectorizes its kernels on its own, so the sums may round differently
+    float output[BATCH * OUTPUTS];
+    run((float *[]) {x->data}, (float *[]) {output});
+
+    ccml_tensor * result = ccml_graph_output(graph);
+    double difference = 0.0;
+    for (int i = 0; i < BATCH * OUTPUTS; i++) {
+        difference = fmax(difference, fabs(output[i] - result->data[i]));
+    }
+    printf("%-10s %-10s\n", "runtime", "exported");
+    for (int i = 0; i < BATCH * OUTPUTS; i++) {
+        printf("%-10f %-10f\n", result->data[i], output[i]);
+    }
+    printf("max difference %g\n", difference);
+
+    // freeing the library and the context
+    dlclose(library);
+    ccml_context_free(ctx);
+
+    return difference < 1e-5 ? 0 : 1;
+}
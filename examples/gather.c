@@ -0,0 +1,65 @@
+#define CCML_BACKEND_CPU
+#include "../ccml.h"
+
+#define ROWS 1000
+#define COLS 8
+#define N_IDS 6
+
+int main() {
+    // creating new memory context
+    ccml_context * ctx = ccml_new_context(16 << 20 /* bytes */);
+
+    // a few rows of a large table looked up by index, repeated ones included
+    int ids[N_IDS] = {3, 999, 3, 0, 42, 3};
+    ccml_tensor * table = ccml_new_tensor(ctx, ROWS, COLS);
+    ccml_tensor * indices = ccml_new_tensor(ctx, N_IDS, CCML_TYPE_INT32);
+    ccml_tensor * weights = ccml_new_tensor(ctx, N_IDS, COLS);
+    ccml_fill(ctx, table, 0.0f);
+    ccml_fill(ctx, indices, 0);
+    ccml_fill(ctx, weights, 0.0f);
+    table->has_gradient = true;
+    for (int i = 0; i < ROWS * COLS; i++) table->data[i] = sinf(i * 0.01f);
+    for (int i = 0; i < N_IDS; i++) ((int32_t *)indices->data)[i] = ids[i];
+    for (int i = 0; i < N_IDS * COLS; i++) weights->data[i] = cosf(i);
+
+    // the gradient of a gather is a scatter-add of the rows it picked, so the gradient of the
+    // table has to match the scatter-add of the weights computed next to it
+    ccml_tensor * rows = ccml_gather(ctx, table, indices);
+    ccml_tensor * loss = ccml_sum(ctx, ccml_mul(ctx, rows, weights), 2, (int[]) {0, 1});
+    ccml_tensor * scattered = ccml_scatter_add(ctx, weights, indices, ROWS);
+
+    ccml_tensor * roots[] = {loss, rows, scattered};
+    ccml_tensor * grads[] = {ccml_scalar(ctx, 1.0f), NULL, NULL};
+    ccml_graph * graph = ccml_new_graph_options(ctx, 3, roots, grads, (ccml_graph_options) {0});
+    if (ccml_graph_execute(ctx, graph) != CCML_STATUS_OK) {
+        ccml_context_free(ctx);
+        return 1;
+    }
+
+    // references computed on the host in double
+    static double reference[ROWS * COLS];
+    double gather_error = 0.0;
+    double scatter_error = 0.0;
+    double gradient_error = 0.0;
+    float * gathered = ccml_graph_output_at(graph, 1)->data;
+    float * added = ccml_graph_output_at(graph, 2)->data;
+    for (int i = 0; i < N_IDS; i++) {
+        for (int j = 0; j < COLS; j++) {
+            gather_error = fmax(gather_error, fabs(gathered[i * COLS + j] - table->data[ids[i] * COLS + j]));
+            reference[ids[i] * COLS + j] += weights->data[i * COLS + j];
+        }
+    }
+    for (int i = 0; i < ROWS * COLS; i++) {
+        scatter_error = fmax(scatter_error, fabs(added[i] - reference[i]));
+        gradient_error = fmax(gradient_error, fabs(table->grad->data[i] - added[i]));
+    }
+
+    printf("%-28s %10.2e\n", "gather max error", gather_error);
+    printf("%-28s %10.2e\n", "scatter-add max error", scatter_error);
+    printf("%-28s %10.2e\n", "gradient vs scatter-add", gradient_error);
+
+    // freeing the context
+    ccml_context_free(ctx);
+
+    return fmax(gather_error, fmax(scatter_error, gradient_error)) < 1e-5 ? 0 : 1;
+}
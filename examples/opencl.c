@@ -14,8 +14,19 @@ int main() {
 
     // creating a new computational graph
     ccml_graph * graph = ccml_new_graph(ctx, z);
-    ccml_graph_execute(ctx, graph);
-    
-    // freeing the context
+    if (ccml_graph_execute(ctx, graph) != CCML_STATUS_OK) {
+        ccml_graph_free(graph);
+        ccml_context_free(ctx);
+        return 1;
+    }
+
+    ccml_tensor * result = ccml_graph_output(graph);
+    for (int i = 0; i < ccml_size(result); i++) {
+        printf("%f ", result->data[i]);
+    }
+    printf("\n");
+
+    // freeing the device buffers of the graph and the context
+    ccml_graph_free(graph);
     ccml_context_free(ctx);
 }
\ No newline at end of file
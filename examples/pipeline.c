@@ -0,0 +1,81 @@
+#define CCML_BACKEND_CPU
+#include "../ccml.h"
+
+#define N_RECORDS 4096
+#define BATCH 32
+#define FEATURES 4
+#define EPOCHS 4
+
+typedef struct record {
+    float x[FEATURES];
+    float y;
+} record;
+
+int main() {
+    // a dataset of records for a linear regression, written next to the example
+    float truth[FEATURES] = {0.5f, -1.0f, 2.0f, 0.25f};
+    FILE * file = fopen("pipeline.bin", "wb");
+    if (file == NULL) return 1;
+    for (int i = 0; i < N_RECORDS; i++) {
+        record r = {.y = 0.0f};
+        for (int j = 0; j < FEATURES; j++) {
+            r.x[j] = sinf(i * (0.37f + 0.21f * j) + j);
+            r.y += truth[j] * r.x[j];
+        }
+        fwrite(&r, sizeof(r), 1, file);
+    }
+    fclose(file);
+
+    // creating new memory context
+    ccml_context * ctx = ccml_new_context(16 << 20 /* bytes */);
+
+    // every record holds a row of x and one of y back to back, the loader threads assemble
+    // shuffled batches straight into the tensors while the graph trains on earlier ones
+    ccml_tensor * x = ccml_new_tensor(ctx, BATCH, FEATURES);
+    ccml_tensor * y = ccml_new_tensor(ctx, BATCH, 1);
+    ccml_pipeline * pipeline = ccml_new_pipeline(ctx, "pipeline.bin", 2, (ccml_tensor *[]) {x, y},
+                                                 (ccml_pipeline_options) {.window = 256, .n_threads = 2, .seed = 1});
+    if (pipeline == NULL) {
+        ccml_context_free(ctx);
+        return 1;
+    }
+
+    ccml_tensor * w = ccml_new_tensor(ctx, 1, FEATURES);
+    ccml_fill(ctx, w, 0.0f);
+    w->has_gradient = true;
+
+    ccml_tensor * products = ccml_mul(ctx, x, ccml_expand(ctx, w, (int[CCML_DIMS_MAX]) {BATCH, FEATURES}));
+    ccml_tensor * error = ccml_sub(ctx, ccml_sum(ctx, products, 1, (int[]) {1}), y);
+    ccml_tensor * loss = ccml_mul(ctx, ccml_sum(ctx, ccml_square(ctx, error), 2, (int[]) {0, 1}), ccml_scalar(ctx, 1.0f / BATCH));
+    ccml_graph * graph = ccml_new_graph(ctx, loss);
+
+    // plain sgd, the weights change on the host so the graph is told about it
+    printf("%-6s %12s\n", "epoch", "mean loss");
+    for (int epoch = 0; epoch < EPOCHS; epoch++) {
+        double total = 0.0;
+        for (int64_t i = 0; i < pipeline->n_batches; i++) {
+            ccml_pipeline_next(pipeline);
+            if (ccml_graph_execute(ctx, graph) != CCML_STATUS_OK) {
+                ccml_pipeline_free(pipeline);
+                ccml_context_free(ctx);
+                return 1;
+            }
+
+            total += ccml_graph_output(graph)->data[0];
+            for (int j = 0; j < FEATURES; j++) w->data[j] -= 0.1f * w->grad->data[j];
+            ccml_invalidate(w);
+        }
+        printf("%-6d %12.6f\n", epoch, total / pipeline->n_batches);
+    }
+
+    printf("%-6s", "w");
+    for (int j = 0; j < FEATURES; j++) printf(" %8.4f", w->data[j]);
+    printf("\n%-6s", "truth");
+    for (int j = 0; j < FEATURES; j++) printf(" %8.4f", truth[j]);
+    printf("\nseconds waiting for batches %.4f\n", pipeline->stalled);
+
+    // freeing the pipeline, the dataset and the context
+    ccml_pipeline_free(pipeline);
+    remove("pipeline.bin");
+    ccml_context_free(ctx);
+}
@@ -0,0 +1,58 @@
+#define CCML_BACKEND_CPU
+#include "../ccml.h"
+
+#define ROWS 4
+#define X_COLS 6
+#define Y_COLS 3
+
+int main() {
+    // creating new memory context
+    ccml_context * ctx = ccml_new_context(16 << 20 /* bytes */);
+
+    ccml_tensor * x = ccml_new_tensor(ctx, ROWS, X_COLS, CCML_GRAD_YES);
+    ccml_tensor * y = ccml_new_tensor(ctx, ROWS, Y_COLS, CCML_GRAD_YES);
+    ccml_fill(ctx, x, 0.0f);
+    ccml_fill(ctx, y, 0.0f);
+    for (int i = 0; i < ROWS * X_COLS; i++) x->data[i] = sinf(i * 0.4f) + 0.5f;
+    for (int i = 0; i < ROWS * Y_COLS; i++) y->data[i] = cosf(i * 0.9f);
+
+    // sin(x) and y^2 side by side, of which every other column from the second one on is
+    // kept, so the gradient has to find its way back through the slice and both parts
+    ccml_tensor * joined = ccml_concat(ctx, 2, (ccml_tensor *[]) {ccml_sin(ctx, x), ccml_square(ctx, y)}, 1);
+    ccml_tensor * picked = ccml_slice(ctx, joined, 1, 1, X_COLS + Y_COLS, 2);
+    ccml_tensor * loss = ccml_sum(ctx, ccml_square(ctx, picked), 2, (int[]) {0, 1});
+
+    ccml_graph * graph = ccml_new_graph(ctx, loss);
+    if (ccml_graph_execute(ctx, graph) != CCML_STATUS_OK) {
+        ccml_context_free(ctx);
+        return 1;
+    }
+
+    // the picked columns are 1, 3 and 5 of sin(x) and 1 of y^2, the other columns of both
+    // inputs get no gradient at all
+    double loss_reference = 0.0;
+    double gradient_error = 0.0;
+    for (int r = 0; r < ROWS; r++) {
+        for (int c = 0; c < X_COLS; c++) {
+            double value = sin(x->data[r * X_COLS + c]);
+            double reference = c % 2 == 1 ? 2.0 * value * cos(x->data[r * X_COLS + c]) : 0.0;
+            if (c % 2 == 1) loss_reference += value * value;
+            gradient_error = fmax(gradient_error, fabs(x->grad->data[r * X_COLS + c] - reference));
+        }
+        for (int c = 0; c < Y_COLS; c++) {
+            double value = y->data[r * Y_COLS + c];
+            double reference = c == 1 ? 4.0 * value * value * value : 0.0;
+            if (c == 1) loss_reference += value * value * value * value;
+            gradient_error = fmax(gradient_error, fabs(y->grad->data[r * Y_COLS + c] - reference));
+        }
+    }
+
+    double loss_error = fabs(ccml_graph_output(graph)->data[0] - loss_reference) / loss_reference;
+    printf("%-28s %10.2e\n", "loss relative error", loss_error);
+    printf("%-28s %10.2e\n", "gradient max error", gradient_error);
+
+    // freeing the context
+    ccml_context_free(ctx);
+
+    return loss_error < 1e-5 && gradient_error < 1e-5 ? 0 : 1;
+}